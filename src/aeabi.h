@@ -0,0 +1,251 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* exporting the soft-float helpers of the ARM run-time ABI ('__aeabi_fadd'
+* and the rest), and their GNU names, built on the emulator's integer
+* kernels. They preempt libgcc's wherever a helper is bound dynamically:
+* in this library, in libraries calling libgcc_s and in programs linked
+* with -shared-libgcc. Copies statically linked from libgcc.a are hidden
+* and keep being used by the objects they were linked into.
+* Results are bit-exact with libgcc's, both rounding to nearest without
+* flushing subnormals, except for NaN payloads: a NaN result is made from
+* the operands as ARM's VFP rules choose it.
+* libgcc puts several helpers in each of its objects, so each group below
+* is complete. Otherwise a helper missing from it would pull libgcc's
+* object into this library's link, clashing with the ones defined here.
+* Off by default: preempting the helpers changes them for the whole process,
+* which is only worth it once tests/aeabi-bench shows them faster than
+* libgcc's on ARM.
+*/
+//#define DO_AEABI_HELPERS
+
+#ifdef DO_AEABI_HELPERS
+
+#define AEABI_ALIAS(name, target) __typeof__(target) name __attribute__((alias(#target)));
+
+// Returns the 64-bit integer 'a' with sign 'sign' (F32_SIGN or 0) as a float
+static inline uint32_t aeabi_u64_to_f32(uint64_t a, uint32_t sign) {
+	if (a == 0) {
+		return 0;
+	}
+	int lz = __builtin_clzll(a);
+	return f32_round_pack(sign, 189 - lz, short_shift_right_jam64(a << lz, 33));
+}
+
+// As aeabi_u64_to_f32(), 'sign' being F64_SIGN or 0
+static inline uint64_t aeabi_u64_to_f64(uint64_t a, uint64_t sign) {
+	if (a == 0) {
+		return 0;
+	}
+	int lz = __builtin_clzll(a);
+	return f64_round_pack(sign, 1085 - lz, shift_right_jam64(a << lz, 1));
+}
+
+/*
+* Truncates the double 'a' to a 64-bit integer, saturating out of range
+* values and giving 0 for NaNs, as the VFP's 32-bit conversions do.
+*/
+static inline uint64_t aeabi_f64_to_u64(uint64_t a, int is_unsigned) {
+	int32_t exp = F64_EXP(a) - 0x3FF;
+	int sign = (a & F64_SIGN) != 0;
+	if (exp == 0x400 && F64_FRAC(a) != 0) {
+		return 0;
+	}
+	if (exp < 0 || (is_unsigned && sign)) {
+		return 0;
+	}
+	if (exp >= 64 - !is_unsigned) {
+		return is_unsigned ? UINT64_MAX : sign ? (uint64_t) INT64_MIN : INT64_MAX;
+	}
+	uint64_t sig = F64_FRAC(a) | F64_HIDDEN;
+	uint64_t mag = exp >= 52 ? sig << (exp - 52) : sig >> (52 - exp);
+	return sign ? -mag : mag;
+}
+
+// Single precision addition and subtraction, with the integer conversions in libgcc's object
+uint32_t __aeabi_fadd(uint32_t a, uint32_t b) { return f32_add_in(a, b, ROUND_NEAREST); }
+uint32_t __aeabi_fsub(uint32_t a, uint32_t b) { return f32_sub_in(a, b, ROUND_NEAREST); }
+uint32_t __aeabi_frsub(uint32_t a, uint32_t b) { return f32_sub_in(b, a, ROUND_NEAREST); }
+uint32_t __aeabi_i2f(int32_t a) { return i32_to_f32(a); }
+uint32_t __aeabi_ui2f(uint32_t a) { return u32_to_f32(a); }
+uint32_t __aeabi_l2f(int64_t a) { return aeabi_u64_to_f32(a < 0 ? -(uint64_t) a : a, a < 0 ? F32_SIGN : 0); }
+uint32_t __aeabi_ul2f(uint64_t a) { return aeabi_u64_to_f32(a, 0); }
+AEABI_ALIAS(__addsf3, __aeabi_fadd)
+AEABI_ALIAS(__subsf3, __aeabi_fsub)
+AEABI_ALIAS(__floatsisf, __aeabi_i2f)
+AEABI_ALIAS(__floatunsisf, __aeabi_ui2f)
+AEABI_ALIAS(__floatdisf, __aeabi_l2f)
+AEABI_ALIAS(__floatundisf, __aeabi_ul2f)
+
+uint32_t __aeabi_fmul(uint32_t a, uint32_t b) { return f32_mul_in(a, b, ROUND_NEAREST); }
+uint32_t __aeabi_fdiv(uint32_t a, uint32_t b) { return f32_div_in(a, b, ROUND_NEAREST); }
+AEABI_ALIAS(__mulsf3, __aeabi_fmul)
+AEABI_ALIAS(__divsf3, __aeabi_fdiv)
+
+uint32_t __aeabi_fneg(uint32_t a) { return a ^ F32_SIGN; }
+AEABI_ALIAS(__negsf2, __aeabi_fneg)
+
+uint32_t __aeabi_f2iz(uint32_t a) { return f32_to_i32(a, ROUND_ZERO); }
+uint32_t __aeabi_f2uiz(uint32_t a) { return f32_to_u32(a, ROUND_ZERO); }
+AEABI_ALIAS(__fixsfsi, __aeabi_f2iz)
+AEABI_ALIAS(__fixunssfsi, __aeabi_f2uiz)
+
+// The 64-bit conversions are C functions in libgcc, each in an object of its own
+int64_t __aeabi_f2lz(uint32_t a) { return aeabi_f64_to_u64(f32_to_f64(a, 0), 0); }
+uint64_t __aeabi_f2ulz(uint32_t a) { return aeabi_f64_to_u64(f32_to_f64(a, 0), 1); }
+int64_t __aeabi_d2lz(uint64_t a) { return aeabi_f64_to_u64(a, 0); }
+uint64_t __aeabi_d2ulz(uint64_t a) { return aeabi_f64_to_u64(a, 1); }
+AEABI_ALIAS(__fixsfdi, __aeabi_f2lz)
+AEABI_ALIAS(__fixunssfdi, __aeabi_f2ulz)
+AEABI_ALIAS(__fixdfdi, __aeabi_d2lz)
+AEABI_ALIAS(__fixunsdfdi, __aeabi_d2ulz)
+
+/*
+* Comparisons. The 'cfcmp' helpers return their result in the APSR's
+* flags, as a 'vcmp' followed by 'vmrs APSR_nzcv, fpscr' would, and keep
+* r0-r3, so they are wrappers around a C function that gives the flags.
+* The GNU ones return an integer whose sign says how 'a' and 'b' compare,
+* with unordered operands giving whatever makes the comparison false.
+*/
+uint32_t __aeabi_fcmpeq(uint32_t a, uint32_t b) { return f32_compare_in(a, b, ROUND_NEAREST) == FLAGS_EQUAL; }
+uint32_t __aeabi_fcmplt(uint32_t a, uint32_t b) { return f32_compare_in(a, b, ROUND_NEAREST) == FLAGS_LESS; }
+uint32_t __aeabi_fcmpgt(uint32_t a, uint32_t b) { return f32_compare_in(a, b, ROUND_NEAREST) == FLAGS_GREATER; }
+
+uint32_t __aeabi_fcmple(uint32_t a, uint32_t b) {
+	uint32_t flags = f32_compare_in(a, b, ROUND_NEAREST);
+	return flags == FLAGS_LESS || flags == FLAGS_EQUAL;
+}
+
+uint32_t __aeabi_fcmpge(uint32_t a, uint32_t b) {
+	uint32_t flags = f32_compare_in(a, b, ROUND_NEAREST);
+	return flags == FLAGS_GREATER || flags == FLAGS_EQUAL;
+}
+
+// Returns -1, 0 or 1 as 'flags' say 'a' is less than, equal to or greater than 'b', or 'unordered'
+static inline int32_t aeabi_cmp_result(uint32_t flags, int32_t unordered) {
+	switch (flags) {
+		case FLAGS_LESS: return -1;
+		case FLAGS_EQUAL: return 0;
+		case FLAGS_GREATER: return 1;
+	}
+	return unordered;
+}
+
+int32_t __lesf2(uint32_t a, uint32_t b) { return aeabi_cmp_result(f32_compare_in(a, b, ROUND_NEAREST), 1); }
+int32_t __gesf2(uint32_t a, uint32_t b) { return aeabi_cmp_result(f32_compare_in(a, b, ROUND_NEAREST), -1); }
+AEABI_ALIAS(__ltsf2, __lesf2)
+AEABI_ALIAS(__eqsf2, __lesf2)
+AEABI_ALIAS(__nesf2, __lesf2)
+AEABI_ALIAS(__cmpsf2, __lesf2)
+AEABI_ALIAS(__gtsf2, __gesf2)
+
+__attribute__((visibility("hidden"))) uint32_t aeabi_cfcmp_flags(uint32_t a, uint32_t b) {
+	return f32_compare_in(a, b, ROUND_NEAREST);
+}
+
+__attribute__((naked)) void __aeabi_cfcmple(void) {
+	asm volatile (
+		"push {r0-r3, ip, lr}\n\t"
+		"bl aeabi_cfcmp_flags\n\t"
+		"msr APSR_nzcvq, r0\n\t"
+		"pop {r0-r3, ip, pc}");
+}
+
+__attribute__((naked)) void __aeabi_cfrcmple(void) {
+	asm volatile (
+		"push {r0-r3, ip, lr}\n\t"
+		"mov r0, r1\n\t"
+		"ldr r1, [sp]\n\t"
+		"bl aeabi_cfcmp_flags\n\t"
+		"msr APSR_nzcvq, r0\n\t"
+		"pop {r0-r3, ip, pc}");
+}
+
+// Comparisons don't signal here, so the quiet one is the same
+AEABI_ALIAS(__aeabi_cfcmpeq, __aeabi_cfcmple)
+
+uint32_t __aeabi_fcmpun(uint32_t a, uint32_t b) { return f32_compare_in(a, b, ROUND_NEAREST) == FLAGS_UNORDERED; }
+AEABI_ALIAS(__unordsf2, __aeabi_fcmpun)
+
+// Double precision addition and subtraction, with the conversions in libgcc's object
+uint64_t __aeabi_dadd(uint64_t a, uint64_t b) { return f64_add_in(a, b, ROUND_NEAREST); }
+uint64_t __aeabi_dsub(uint64_t a, uint64_t b) { return f64_sub_in(a, b, ROUND_NEAREST); }
+uint64_t __aeabi_drsub(uint64_t a, uint64_t b) { return f64_sub_in(b, a, ROUND_NEAREST); }
+uint64_t __aeabi_i2d(int32_t a) { return i32_to_f64(a); }
+uint64_t __aeabi_ui2d(uint32_t a) { return u32_to_f64(a); }
+uint64_t __aeabi_l2d(int64_t a) { return aeabi_u64_to_f64(a < 0 ? -(uint64_t) a : a, a < 0 ? F64_SIGN : 0); }
+uint64_t __aeabi_ul2d(uint64_t a) { return aeabi_u64_to_f64(a, 0); }
+uint64_t __aeabi_f2d(uint32_t a) { return f32_to_f64(a, 0); }
+AEABI_ALIAS(__adddf3, __aeabi_dadd)
+AEABI_ALIAS(__subdf3, __aeabi_dsub)
+AEABI_ALIAS(__floatsidf, __aeabi_i2d)
+AEABI_ALIAS(__floatunsidf, __aeabi_ui2d)
+AEABI_ALIAS(__floatdidf, __aeabi_l2d)
+AEABI_ALIAS(__floatundidf, __aeabi_ul2d)
+AEABI_ALIAS(__extendsfdf2, __aeabi_f2d)
+
+uint64_t __aeabi_dmul(uint64_t a, uint64_t b) { return f64_mul_in(a, b, ROUND_NEAREST); }
+uint64_t __aeabi_ddiv(uint64_t a, uint64_t b) { return f64_div_in(a, b, ROUND_NEAREST); }
+AEABI_ALIAS(__muldf3, __aeabi_dmul)
+AEABI_ALIAS(__divdf3, __aeabi_ddiv)
+
+uint64_t __aeabi_dneg(uint64_t a) { return a ^ F64_SIGN; }
+AEABI_ALIAS(__negdf2, __aeabi_dneg)
+
+uint32_t __aeabi_d2iz(uint64_t a) { return f64_to_i32(a, ROUND_ZERO); }
+uint32_t __aeabi_d2uiz(uint64_t a) { return f64_to_u32(a, ROUND_ZERO); }
+uint32_t __aeabi_d2f(uint64_t a) { return f64_to_f32(a, ROUND_NEAREST); }
+AEABI_ALIAS(__fixdfsi, __aeabi_d2iz)
+AEABI_ALIAS(__fixunsdfsi, __aeabi_d2uiz)
+AEABI_ALIAS(__truncdfsf2, __aeabi_d2f)
+
+uint32_t __aeabi_dcmpeq(uint64_t a, uint64_t b) { return f64_compare_in(a, b, ROUND_NEAREST) == FLAGS_EQUAL; }
+uint32_t __aeabi_dcmplt(uint64_t a, uint64_t b) { return f64_compare_in(a, b, ROUND_NEAREST) == FLAGS_LESS; }
+uint32_t __aeabi_dcmpgt(uint64_t a, uint64_t b) { return f64_compare_in(a, b, ROUND_NEAREST) == FLAGS_GREATER; }
+
+uint32_t __aeabi_dcmple(uint64_t a, uint64_t b) {
+	uint32_t flags = f64_compare_in(a, b, ROUND_NEAREST);
+	return flags == FLAGS_LESS || flags == FLAGS_EQUAL;
+}
+
+uint32_t __aeabi_dcmpge(uint64_t a, uint64_t b) {
+	uint32_t flags = f64_compare_in(a, b, ROUND_NEAREST);
+	return flags == FLAGS_GREATER || flags == FLAGS_EQUAL;
+}
+
+int32_t __ledf2(uint64_t a, uint64_t b) { return aeabi_cmp_result(f64_compare_in(a, b, ROUND_NEAREST), 1); }
+int32_t __gedf2(uint64_t a, uint64_t b) { return aeabi_cmp_result(f64_compare_in(a, b, ROUND_NEAREST), -1); }
+AEABI_ALIAS(__ltdf2, __ledf2)
+AEABI_ALIAS(__eqdf2, __ledf2)
+AEABI_ALIAS(__nedf2, __ledf2)
+AEABI_ALIAS(__cmpdf2, __ledf2)
+AEABI_ALIAS(__gtdf2, __gedf2)
+
+__attribute__((visibility("hidden"))) uint32_t aeabi_cdcmp_flags(uint64_t a, uint64_t b) {
+	return f64_compare_in(a, b, ROUND_NEAREST);
+}
+
+// The operands are in r0:r1 and r2:r3
+__attribute__((naked)) void __aeabi_cdcmple(void) {
+	asm volatile (
+		"push {r0-r3, ip, lr}\n\t"
+		"bl aeabi_cdcmp_flags\n\t"
+		"msr APSR_nzcvq, r0\n\t"
+		"pop {r0-r3, ip, pc}");
+}
+
+__attribute__((naked)) void __aeabi_cdrcmple(void) {
+	asm volatile (
+		"push {r0-r3, ip, lr}\n\t"
+		"mov r0, r2\n\t"
+		"mov r1, r3\n\t"
+		"ldrd r2, r3, [sp]\n\t"
+		"bl aeabi_cdcmp_flags\n\t"
+		"msr APSR_nzcvq, r0\n\t"
+		"pop {r0-r3, ip, pc}");
+}
+
+AEABI_ALIAS(__aeabi_cdcmpeq, __aeabi_cdcmple)
+
+uint32_t __aeabi_dcmpun(uint64_t a, uint64_t b) { return f64_compare_in(a, b, ROUND_NEAREST) == FLAGS_UNORDERED; }
+AEABI_ALIAS(__unorddf2, __aeabi_dcmpun)
+#endif
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for RTLD_NEXT
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,8 +11,21 @@
 #include "dso-meta.h"
 #include "relf.h"
 #include "debug-print.h"
+#include "stats.h"
 #include "rmaps.h"
 #include "assembly.h"
+#include "loadstore.h"
+#include "transfer.h"
+#include "thumb.h"
+#include "signals.h"
+#include "jit.h"
+#include "fusion.h"
+#include "region.h"
+#include "tiering.h"
+#include "peephole.h"
+#include "softfp.h"
+#include "libm.h"
+#include "aeabi.h"
 
 // Fixes undefined symbols at build stage: the --defsym compiler flag doesn't solve this.
 char* __private_strdup(const char *s) { return strdup(s); }
@@ -77,6 +93,97 @@ int try_set_mem_writable(struct maps_entry *maps_ent, void* seg_start, void* seg
 	}
 }
 
+/*
+* Adds the parts of an executable mapping that none of its file's sections
+* occupy to the slack space for islands (see island_alloc()): the gaps that
+* sections leave between them for alignment and the rest of the mapping
+* after the last one. Gaps before the first section hold the ELF headers.
+*/
+void add_mapping_slack(struct maps_entry *maps_ent, struct file_metadata* meta, ElfW(Addr) l_addr) {
+	int8_t* first = maps_ent->first;
+	int8_t* second = maps_ent->second;
+	for (int i = 0; i < meta->ehdr->e_shnum; i++) {
+		ElfW(Shdr)* shdr = &meta->shdrs[i];
+		int8_t* end = (int8_t*) (l_addr + shdr->sh_addr + shdr->sh_size);
+		if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_size == 0 || end <= first || end >= second) {
+			continue;
+		}
+		// The gap runs up to the next section, and is empty if another section covers its start
+		int8_t* gap_end = second;
+		for (int j = 0; j < meta->ehdr->e_shnum; j++) {
+			ElfW(Shdr)* other = &meta->shdrs[j];
+			int8_t* start = (int8_t*) (l_addr + other->sh_addr);
+			if (!(other->sh_flags & SHF_ALLOC) || other->sh_size == 0) {
+				continue;
+			}
+			if (start >= end && start < gap_end) {
+				gap_end = start;
+			} else if (start < end && start + other->sh_size > end) {
+				gap_end = end;
+			}
+		}
+		add_slack(end, gap_end);
+	}
+}
+
+#ifdef DO_SELECTIVE_EMULATION
+/*
+* Returns whether the VFP unit can run the ARM instruction at 'instr_addr'
+* itself, which is also the case for anything that isn't an FP instruction.
+*/
+int fpu_hw_runs_instr(void* instr_addr) {
+	cs_insn* disassembly = disassemble_instr(instr_addr);
+	if (disassembly == NULL) {
+		return 1;
+	}
+	uint32_t missing = fp_instr_features(disassembly, *(uint32_t*) instr_addr) & ~fpu_hw_caps;
+	free(disassembly);
+	return missing == 0;
+}
+
+/*
+* Instruments [from, to) on a CPU with a VFP unit. Only the instructions
+* that need a feature it lacks are replaced, each with a frame trampoline
+* that runs its routine on the hardware's registers (see fpu_hw_call()).
+* Blocks, regions, idioms and the JIT are left out: they would take in the
+* instructions around the missing one, which run faster on the hardware.
+*/
+void replace_missing_instrs_in_segment(struct maps_entry *maps_ent, void* from, void* to) {
+	int b_is_writable = 0;
+	int8_t* aligned_start = (int8_t*) (((uintptr_t) from + 3) & ~3);
+
+	printfdbg("Scanning through %p-%p for FP instructions the CPU lacks\n", from, to);
+	for (int8_t* instr = aligned_start; instr < (int8_t*) to - 4; instr += 4) {
+		if (fpu_hw_runs_instr(instr)) {
+			continue;
+		}
+		void* tramp = generate_mem_trampoline(instr);
+		if (tramp == NULL) {
+			tramp = generate_xfer_trampoline(instr);
+		}
+		if (tramp == NULL) {
+			struct emu_desc desc;
+			void* routine = decode_fp_instr(instr, &desc);
+			if (routine == NULL) {
+				printfdbg("WARNING: instruction at %p needs FP features the CPU lacks but isn't emulated\n", instr);
+				continue;
+			}
+			tramp = generate_frame_trampoline(instr, instr + 4, &desc, sizeof(desc), routine, 0);
+		}
+		if (tramp == NULL) {
+			printfdbg("ERROR: no trampoline for instruction at %p, leaving it in place\n", instr);
+			continue;
+		}
+		if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, maps_ent->first, maps_ent->second)) {
+			b_is_writable = 1;
+		}
+		if (insert_probe(instr, tramp, arm_cond(*(uint32_t*) instr)) != 0) {
+			printfdbg("WARNING: instruction at %p needs FP features the CPU lacks but can't be probed\n", instr);
+		}
+	}
+}
+#endif
+
 /*
 * Core of the instrumentation process.
 * Looks through a mapped region in memory and finds a floating-point instruction.
@@ -111,25 +218,208 @@ void replace_instrs_in_segment(struct maps_entry *maps_ent, void* from, void* to
 	assert(instrs_start >= seg_start && instrs_start <= seg_end);
 	assert(sections_end >= seg_start && sections_end <= seg_end);
 	
+	#ifdef DO_SELECTIVE_EMULATION
+	if (fpu_hw_present()) {
+		replace_missing_instrs_in_segment(maps_ent, instrs_start, sections_end);
+		return;
+	}
+	#endif
+
 	int b_is_writable = maps_ent->w == "w";
 	int b_did_perm_change = 0;
+	// ARM instructions are word-aligned; Thumb code is walked by replace_thumb_instrs_in_segment()
+	int8_t* aligned_start = (int8_t*) (((uintptr_t) instrs_start + 3) & ~3);
 		
-	printfdbg("Scanning through %p-%p for FP instructions\n", instrs_start, sections_end);
-	for (int8_t* instr = instrs_start; instr < sections_end-4; instr += 2) {
-		void* tramp = generate_trampoline(instr);
-		if (tramp == NULL) {
+	#ifdef DO_REGIONS
+	// Loops are translated first, while all of their instructions are still the originals
+	for (int8_t* instr = aligned_start; instr < sections_end-4; instr += 4) {
+		int8_t* head;
+		void* region = translate_loop(instr, aligned_start, &head);
+		if (region == NULL) {
+			continue;
+		}
+		if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, seg_start, seg_end)) {
+			b_is_writable = 1;
+			b_did_perm_change = 1;
+		}
+		// If the region can't be reached its loop is instrumented instruction by instruction below
+		insert_probe(head, region, COND_AL);
+	}
+	#endif
+
+	// FP instructions before this have already been emulated as part of a block
+	int8_t* run_end = NULL;
+
+	printfdbg("Scanning through %p-%p for FP instructions\n", aligned_start, sections_end);
+	for (int8_t* instr = aligned_start; instr < sections_end-4; instr += 4) {
+		#if defined(DO_PEEPHOLE) || defined(DO_SOFTFP_ELISION)
+		// Idioms are matched first so that their instructions aren't emulated one at a time
+		if (instr >= run_end) {
+			int8_t* pattern_end;
+			void* fused = NULL;
+			#ifdef DO_SOFTFP_ELISION
+			fused = generate_sandwich_trampoline(instr, sections_end, &pattern_end);
+			#endif
+			#ifdef DO_PEEPHOLE
+			if (fused == NULL) {
+				fused = generate_fused_trampoline(instr, sections_end, &pattern_end);
+			}
+			#endif
+			if (fused != NULL) {
+				if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, seg_start, seg_end)) {
+					b_is_writable = 1;
+					b_did_perm_change = 1;
+				}
+				// If the trampoline can't be reached the idiom's instructions are instrumented one by one
+				if (insert_probe(instr, fused, COND_AL) == 0) {
+					run_end = pattern_end;
+					continue;
+				}
+			}
+		}
+		#endif
+
+		// Instructions that need the guest's core registers get frame trampolines
+		void* frame_tramp = generate_mem_trampoline(instr);
+		if (frame_tramp == NULL) {
+			frame_tramp = generate_xfer_trampoline(instr);
+		}
+		if (frame_tramp != NULL) {
+			if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, seg_start, seg_end)) {
+				b_is_writable = 1;
+				b_did_perm_change = 1;
+			}
+			// If the trampoline can't be reached the instruction is left in place
+			insert_probe(instr, frame_tramp, arm_cond(*(uint32_t*) instr));
+			continue;
+		}
+
+		struct emu_desc desc;
+		void* routine = decode_fp_instr(instr, &desc);
+		if (routine == NULL) {
 			continue;
 		} else {
-			printfdbg("Trampoline written for FP instruction at %p in %p-%p\n", instr, instrs_start, sections_end);
+			void* tramp = NULL;
+			int tier0 = 0;
+			int8_t* prev_run_end = run_end;
+			#ifdef DO_TIERING
+			// Everything starts in tier 0; hot sites are recompiled later by tier_up()
+			tramp = tier0_generate_trampoline(instr, &desc, routine, sections_end, &run_end);
+			tier0 = tramp != NULL;
+			#else
+			#ifdef DO_BLOCK_FUSION
+			// Instructions inside a block keep their own trampolines for code branching into the middle
+			if (instr >= run_end) {
+				tramp = generate_block_trampoline(instr, sections_end, &run_end);
+			}
+			#endif
+			#ifdef DO_JIT
+			if (tramp == NULL) {
+				tramp = jit_generate_trampoline(instr, &desc, routine);
+			}
+			#endif
+			#endif
+			if (tramp == NULL) {
+				tramp = generate_trampoline(instr, &desc, routine);
+			}
+			if (tramp == NULL) {
+				printfdbg("ERROR: no trampoline for instruction at %p, leaving it in place\n", instr);
+				continue;
+			}
+
 			printfdbg(" - writing jump at the mentioned instr (%p)\n", instr);
 			if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, seg_start, seg_end)) {
 				b_is_writable = 1;
 				b_did_perm_change = 1;
 			}
-			insert_probe(instr, tramp);
+			if (insert_probe(instr, tramp, arm_cond(*(uint32_t*) instr)) != 0) {
+				// The run that starts here wasn't installed, so the next instruction may start one
+				run_end = prev_run_end;
+				#ifdef DO_TIERING
+				if (tier0) {
+					tier0_discard(tramp);
+				}
+				#endif
+				continue;
+			}
+			printfdbg("Trampoline written for FP instruction at %p in %p-%p\n", instr, instrs_start, sections_end);
+		}
+	}
+}
+
+#ifdef DO_THUMB
+/*
+* Instruments the Thumb code in [from, to), which must start at an
+* instruction boundary. It is walked an instruction at a time to follow
+* 'it' blocks: an FP instruction inside one is only replaced if it is the
+* block's last instruction, the only place a branch is allowed, where the
+* probe is made conditional by the block itself. Thumb sites always get
+* frame trampolines.
+*/
+void replace_thumb_instrs_in_segment(struct maps_entry *maps_ent, void* from, void* to) {
+	int b_is_writable = 0;
+	uint8_t it = 0;
+
+	printfdbg("Scanning through Thumb code %p-%p for FP instructions\n", from, to);
+	for (int8_t* instr = from; instr + 2 <= (int8_t*) to; ) {
+		uint16_t hw1 = *(uint16_t*) instr;
+		if (is_thumb_it(hw1)) {
+			it = hw1 & 0xFF;
+			instr += 2;
+			continue;
+		}
+		int size = thumb_instr_size(hw1);
+		int in_it = it != 0;
+		it = thumb_it_advance(it);
+		if (size == 4 && instr + 4 <= (int8_t*) to && (!in_it || it == 0)) {
+			uint32_t arm_instr = thumb_vfp_to_arm(instr);
+			#ifdef DO_SELECTIVE_EMULATION
+			if (arm_instr != 0 && fpu_hw_present() && fpu_hw_runs_instr(&arm_instr)) {
+				arm_instr = 0;
+			}
+			#endif
+			void* tramp = arm_instr == 0 ? NULL : generate_thumb_trampoline(instr, arm_instr);
+			if (tramp != NULL) {
+				if (!b_is_writable && 0 == try_set_mem_writable(maps_ent, maps_ent->first, maps_ent->second)) {
+					b_is_writable = 1;
+				}
+				insert_thumb_probe(instr, tramp);
+			}
+		}
+		instr += size;
+	}
+}
+
+/*
+* Splits [from, to) by the instruction set its file's symbols give each
+* part, instrumenting the ARM and Thumb parts and skipping data. Code
+* before the first change, or in a file without symbols, is taken as ARM.
+*/
+void replace_instrs_by_state(struct maps_entry *maps_ent, struct file_metadata* meta, ElfW(Addr) l_addr, void* from, void* to) {
+	struct state_change* changes = NULL;
+	int num_changes = read_state_changes(meta, l_addr, &changes);
+	int8_t* start = from;
+	int state = STATE_ARM;
+	for (int i = 0; i <= num_changes && start < (int8_t*) to; i++) {
+		int8_t* end = i == num_changes ? to : (int8_t*) changes[i].addr;
+		if (end > (int8_t*) to) {
+			end = to;
+		}
+		if (end > start) {
+			if (state == STATE_ARM) {
+				replace_instrs_in_segment(maps_ent, start, end);
+			} else if (state == STATE_THUMB) {
+				replace_thumb_instrs_in_segment(maps_ent, start, end);
+			}
+			start = end;
+		}
+		if (i < num_changes) {
+			state = changes[i].state;
 		}
 	}
+	free(changes);
 }
+#endif
 
 /*
 * Callback for librunt. 
@@ -149,6 +439,7 @@ static int handle_maps_entry(struct maps_entry *maps_ent, char *linebuf, void *a
 	// Tests for memory regions that don't need instrumenting.
 	// "[" is here to ensure stability by exercising overcaution, but in practice you'd want
 	// to be more specific like the rest of the search strings.
+	// The hottest libm functions are replaced by those of "libm.h", so libm itself is left alone.
 	char* to_skip[] = {"[", "[stack]", "[vvar]", "[sigpage]", "[vdso]", "[vectors]", "libm-2.31.so", "libkeystone.so.0", "libcapstone.so.4"};
 	for (int i = 0; i < sizeof(to_skip) / sizeof(to_skip[0]); i++) {
 		if (NULL != strstr(maps_ent->rest, to_skip[i])) {
@@ -194,8 +485,13 @@ static int handle_maps_entry(struct maps_entry *maps_ent, char *linebuf, void *a
 	printfdbg("%s\n", maps_ent->rest);
 	assert(maps_ent->first <= sections_from && sections_from <= sections_to && sections_to <= maps_ent->second);
 	printfdbg("Maps entry goes from (%p-)%p-%p(-%p)\n", maps_ent->first, sections_from, sections_to, maps_ent->second);
+	add_mapping_slack(maps_ent, meta, l_addr);
 	
+	#ifdef DO_THUMB
+	replace_instrs_by_state(maps_ent, meta, l_addr, sections_from, sections_to);
+	#else
 	replace_instrs_in_segment(maps_ent, sections_from, sections_to);
+	#endif
 	return 0;
 }
 
@@ -209,9 +505,15 @@ static int entrypoint(void) {
 	start_disasm_engine();
 	start_asm_engine();
 	emulator_init();
+	#ifdef DO_SELECTIVE_EMULATION
+	fpu_hw_init();
+	#endif
 	
 	// Replace instructions
 	process_all_lines(fd, handle_maps_entry);
+	#ifdef DO_TIERING
+	tier_init();
+	#endif
 
     close_maps();
     stop_disasm_engine();
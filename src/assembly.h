@@ -4,6 +4,8 @@
 #include <sys/mman.h>
 #include <stddef.h>
 #include "fpuemu.h"
+#include "neon.h"
+#include "hwcaps.h"
 #include <unistd.h>
 #include <stdlib.h>
 #define PAGE_SIZE sysconf(_SC_PAGE_SIZE)
@@ -16,35 +18,130 @@ int INT24_MAX = (1 << 23) - 1;
 /*
 * Template for the trampolines used to connect
 * a probe site and emulation routine at run-time.
+* The descriptor of the emulated instruction is stored directly after
+* the template, so a single PC-relative 'add' passes its address to the
+* emulation routine in r0. The 'bl' either reaches the routine directly
+* or, when it is out of range, a veneer in the same trampoline pool.
+* The guest's flags are kept in r4, which the routine preserves, as a
+* conditional instruction after the probe may depend on them.
 */
 int8_t template[] = {
 	0xFF, 0x5F, 0x2D, 0xE9, // push {r0-r12, r14}
-	0xAD, 0x5E, 0x0D, 0xE3, // movw r5, #0xdead
-	0x05, 0x58, 0xA0, 0xE1, // lsl r5, r5, #16
-	0xEF, 0x6E, 0x0B, 0xE3, // movw r6, #0xbeef
-	0x06, 0x50, 0x85, 0xE1, // orr r5, r5, r6
-	0x00, 0x00, 0xA0, 0xE3, // mov r0, #0
-	0x00, 0x10, 0xA0, 0xE3, // mov r1, #0
-	0x00, 0x20, 0xA0, 0xE3, // mov r2, #0
-	0x00, 0x30, 0xA0, 0xE3, // mov r3, #0
-	0x35, 0xFF, 0x2F, 0xE1, // blx r5
+	0x00, 0x40, 0x0F, 0xE1, // mrs r4, APSR
+	0x0C, 0x00, 0x8F, 0xE2, // add r0, pc, #12
+	0xFE, 0xFF, 0xFF, 0xEB, // bl #0
+	0x04, 0xF0, 0x28, 0xE1, // msr APSR_nzcvq, r4
 	0xFF, 0x5F, 0xBD, 0xE8, // pop {r0-r12, r14}
 	0xFE, 0xFF, 0xFF, 0xEA  // b #0
 };
 
 /*
 * Offsets of various instructions in the trampoline
-* template and the names of registers used.
+* template and of the descriptor that follows it.
 */
-int MOV_UPPER_OFFSET = 1 * 4;
-int MOV_LOWER_OFFSET = 3 * 4;
-int MOV_R0_OFFSET = 5 * 4;
-int MOV_R1_OFFSET = 6 * 4;
-int MOV_R2_OFFSET = 7 * 4;
-int MOV_R3_OFFSET = 8 * 4;
-int RET_OFFSET = 11 * 4;
-int REG_SCRATCH = 6;
-int REG_CALL = 5;
+int CALL_OFFSET = 3 * 4;
+int RET_OFFSET = 6 * 4;
+int DESC_OFFSET = 7 * 4;
+#define TRAMP_SIZE (sizeof(template) + sizeof(struct emu_desc))
+
+/*
+* The guest's registers as saved by trampolines whose routines need to
+* read or write them: 'push {r0-r12, r14}' followed by the flags and a
+* padding word that keeps the stack 8-byte aligned.
+* The routine gets a pointer to the frame as its second argument.
+*/
+struct tramp_frame {
+	uint32_t apsr;
+	uint32_t pad;
+	uint32_t r[13];
+	uint32_t lr;
+};
+
+/*
+* Returns the value core register 'reg' (a Capstone register name) had at
+* the probe site. The guest's SP is just above the frame.
+* The PC is excluded as its value depends on the instruction reading it.
+*/
+uint32_t frame_get_reg(struct tramp_frame* frame, arm_reg reg) {
+	if (ARM_REG_R0 <= reg && reg <= ARM_REG_R12) {
+		return frame->r[reg - ARM_REG_R0];
+	} else if (reg == ARM_REG_SP) {
+		return (uint32_t) (uintptr_t) (frame + 1);
+	}
+	assert(reg == ARM_REG_LR);
+	return frame->lr;
+}
+
+/*
+* Sets core register 'reg' (one of r0-r12 or lr) in the frame, so that it
+* has the new value when the trampoline restores the guest's registers.
+*/
+void frame_set_reg(struct tramp_frame* frame, arm_reg reg, uint32_t val) {
+	if (ARM_REG_R0 <= reg && reg <= ARM_REG_R12) {
+		frame->r[reg - ARM_REG_R0] = val;
+		return;
+	}
+	assert(reg == ARM_REG_LR);
+	frame->lr = val;
+}
+
+/*
+* Veneer placed in a trampoline pool when an emulation routine is too far
+* away for a 'bl'. The routine's address follows the instruction.
+*/
+int8_t veneer_template[] = {
+	0x04, 0xF0, 0x1F, 0xE5  // ldr pc, [pc, #-4]
+};
+#define VENEER_SIZE (sizeof(veneer_template) + sizeof(void*))
+
+/*
+* Trampolines are bump-allocated from pools of memory mapped near the
+* probe sites instead of each taking a page of their own. Each pool also
+* keeps the veneers that its trampolines use to reach distant routines.
+*/
+#define POOL_SIZE (16 * PAGE_SIZE)
+#define MAX_POOLS 64
+#define MAX_VENEERS 16
+
+struct veneer {
+	void* target;
+	void* code;
+};
+
+struct tramp_pool {
+	int8_t* base;
+	size_t used;
+	struct veneer veneers[MAX_VENEERS];
+	int num_veneers;
+};
+
+struct tramp_pool pools[MAX_POOLS];
+int num_pools = 0;
+
+/*
+* A site with no trampoline memory in range gets its trampoline from a pool
+* anywhere, which returns with an absolute load into the PC. The probe then
+* reaches it through an island: a veneer like the pools' ones, placed in
+* slack space of the instrumented files within range of the site, such as
+* the gaps left between sections for alignment and the rest of the last
+* page of a segment. Islands for Thumb sites use a Thumb 'ldr.w pc'.
+*/
+int8_t island_template[] = {
+	0x04, 0xF0, 0x1F, 0xE5  // ldr pc, [pc, #-4]
+};
+int8_t thumb_island_template[] = {
+	0xDF, 0xF8, 0x00, 0xF0  // ldr.w pc, [pc, #0]
+};
+#define ISLAND_SIZE (sizeof(island_template) + sizeof(void*))
+#define MAX_SLACK 256
+
+struct slack {
+	int8_t* next;
+	int8_t* end;
+};
+
+struct slack slack_areas[MAX_SLACK];
+int num_slack_areas = 0;
 
 /*
 * Capstone (disassembly framework) and 
@@ -61,7 +158,9 @@ void clobber(void* dst, void* src) {
 	printfdbg("clobbering\n");
 	make_writable(dst, dst + 4, NULL);
 	printfdbg(" - writing src into dst\n");
-	memcpy(dst, src, 4);
+	// A single aligned store, so a thread running through 'dst' sees the old or new instruction
+	__atomic_store_n((uint32_t*) dst, *(uint32_t*) src, __ATOMIC_RELEASE);
+	__builtin___clear_cache((char*) dst, (char*) dst + 4);
 }
 
 void start_asm_engine() {
@@ -146,6 +245,241 @@ int8_t* assemble_mov(uint8_t reg, uint16_t val) {
 	return outbuf;
 }
 
+/*
+* Returns whether an ARM 'b'/'bl' at 'from' can reach 'to'.
+* The 24-bit immediate is a word offset from the instruction's address + 8.
+*/
+int branch_in_range(void* from, void* to) {
+	ptrdiff_t offset = (int8_t*) to - ((int8_t*) from + 8);
+	return (offset & 0x3) == 0 && -(1 << 25) <= offset && offset < (1 << 25);
+}
+
+/*
+* Encodes an unconditional 'b' (or 'bl' if 'link' is set) placed at 'from'
+* that branches to 'to'. Targets with the Thumb bit set are encoded as a
+* 'blx' so that the callee runs in the right instruction set.
+* The caller must have checked the range with branch_in_range().
+*/
+uint32_t encode_branch(void* from, void* to, int link) {
+	uintptr_t target = (uintptr_t) to;
+	if (link && (target & 1)) {
+		ptrdiff_t offset = (int8_t*) (target & ~1) - ((int8_t*) from + 8);
+		return 0xFA000000 | ((offset & 0x2) << 23) | ((offset >> 2) & 0x00FFFFFF);
+	}
+	ptrdiff_t offset = (int8_t*) to - ((int8_t*) from + 8);
+	return (link ? 0xEB000000 : 0xEA000000) | ((offset >> 2) & 0x00FFFFFF);
+}
+
+/*
+* Returns whether a Thumb-2 'b.w' at 'from' can reach 'to'. Its immediate
+* is a halfword offset from the instruction's address + 4, of 25 bits.
+*/
+int thumb_branch_in_range(void* from, void* to) {
+	ptrdiff_t offset = (int8_t*) to - ((int8_t*) from + 4);
+	return (offset & 0x1) == 0 && -(1 << 24) <= offset && offset < (1 << 24);
+}
+
+/*
+* Encodes a Thumb-2 'b.w' (encoding T4) placed at 'from' that branches to
+* 'to', which must be in range. Returns the first halfword in the low half,
+* so the result can be stored as one little-endian word.
+*/
+uint32_t encode_thumb_branch(void* from, void* to) {
+	int32_t offset = (int8_t*) to - ((int8_t*) from + 4);
+	uint32_t s = (offset >> 24) & 1;
+	uint32_t j1 = ((offset >> 23) & 1) ^ !s;
+	uint32_t j2 = ((offset >> 22) & 1) ^ !s;
+	uint32_t hw1 = 0xF000 | (s << 10) | ((offset >> 12) & 0x3FF);
+	uint32_t hw2 = 0x9000 | (j1 << 13) | (j2 << 11) | ((offset >> 1) & 0x7FF);
+	return (hw2 << 16) | hw1;
+}
+
+// Returns whether 'instr' is an ARM 'b' or 'bl' (any condition but the unconditional space)
+int is_arm_branch(uint32_t instr) {
+	return (instr >> 28) != 0xF && ((instr >> 25) & 0x7) == 0x5;
+}
+
+// Returns whether the ARM branch 'instr' is a 'bl'
+int is_arm_branch_link(uint32_t instr) {
+	return (instr >> 24) & 1;
+}
+
+// Returns the address the ARM branch 'instr', located at 'at', goes to
+void* arm_branch_target(void* at, uint32_t instr) {
+	int32_t offset = ((int32_t) (instr << 8)) >> 6;
+	return (int8_t*) at + 8 + offset;
+}
+
+/*
+* Condition field values of ARM instructions. Capstone's 'arm_cc' values
+* are these plus one.
+*/
+#define COND_EQ 0x0
+#define COND_NE 0x1
+#define COND_HS 0x2
+#define COND_LO 0x3
+#define COND_HI 0x8
+#define COND_LS 0x9
+#define COND_GE 0xA
+#define COND_LT 0xB
+#define COND_AL 0xE
+
+/*
+* Returns the condition field of the ARM instruction 'instr', treating the
+* unconditional encoding space as AL.
+*/
+int arm_cond(uint32_t instr) {
+	int cond = instr >> 28;
+	return cond == 0xF ? COND_AL : cond;
+}
+
+/*
+* Hand-assembled ARM instructions used when generating trampoline code.
+* Each returns the machine-code word for condition AL; use with_cond()
+* to make it conditional. Immediates must already fit their fields.
+*/
+uint32_t with_cond(uint32_t instr, int cond) {
+	return (instr & 0x0FFFFFFF) | ((uint32_t) cond << 28);
+}
+
+uint32_t arm_push(uint16_t reglist) { return 0xE92D0000 | reglist; }
+uint32_t arm_pop(uint16_t reglist) { return 0xE8BD0000 | reglist; }
+uint32_t arm_mov_reg(int rd, int rm) { return 0xE1A00000 | (rd << 12) | rm; }
+uint32_t arm_blx_reg(int rm) { return 0xE12FFF30 | rm; }
+uint32_t arm_mrs_apsr(int rd) { return 0xE10F0000 | (rd << 12); }
+uint32_t arm_msr_apsr(int rn) { return 0xE128F000 | rn; } // msr APSR_nzcvq, rn
+uint32_t arm_add_imm(int rd, int rn, uint8_t imm) { return 0xE2800000 | (rn << 16) | (rd << 12) | imm; }
+uint32_t arm_sub_imm(int rd, int rn, uint8_t imm) { return 0xE2400000 | (rn << 16) | (rd << 12) | imm; }
+uint32_t arm_subs_imm(int rd, int rn, uint8_t imm) { return 0xE2500000 | (rn << 16) | (rd << 12) | imm; }
+uint32_t arm_cmp_imm(int rn, uint8_t imm) { return 0xE3500000 | (rn << 16) | imm; }
+
+uint32_t arm_ldr_imm(int rt, int rn, uint16_t offset) {
+	return 0xE5900000 | (rn << 16) | (rt << 12) | (offset & 0xFFF);
+}
+
+uint32_t arm_ldr_reg(int rt, int rn, int rm) {
+	return 0xE7900000 | (rn << 16) | (rt << 12) | rm;
+}
+
+uint32_t arm_mrc_tpidruro(int rt) {
+	return 0xEE1D0F70 | (rt << 12); // mrc p15, 0, rt, c13, c0, 3
+}
+
+uint32_t arm_str_imm(int rt, int rn, uint16_t offset) {
+	return 0xE5800000 | (rn << 16) | (rt << 12) | (offset & 0xFFF);
+}
+
+uint32_t arm_ldrex(int rt, int rn) {
+	return 0xE1900F9F | (rn << 16) | (rt << 12);
+}
+
+// 'rd' is set to 0 if the store succeeded
+uint32_t arm_strex(int rd, int rt, int rn) {
+	return 0xE1800F90 | (rn << 16) | (rd << 12) | rt;
+}
+
+uint32_t arm_movw(int rd, uint16_t imm) {
+	return 0xE3000000 | ((imm & 0xF000) << 4) | (rd << 12) | (imm & 0x0FFF);
+}
+
+uint32_t arm_movt(int rd, uint16_t imm) {
+	return 0xE3400000 | ((imm & 0xF000) << 4) | (rd << 12) | (imm & 0x0FFF);
+}
+
+uint32_t arm_ubfx(int rd, int rn, int lsb, int width) {
+	return 0xE7E00050 | ((width - 1) << 16) | (rd << 12) | (lsb << 7) | rn;
+}
+
+/*
+* Encodes 'val' as an ARM modified immediate: an 8-bit value rotated right
+* by an even amount. Returns -1 if 'val' can't be encoded that way.
+*/
+int encode_mod_imm(uint32_t val) {
+	for (int rot = 0; rot < 16; rot++) {
+		uint32_t imm8 = (val << (2 * rot)) | (val >> ((32 - 2 * rot) & 31));
+		if (imm8 <= 0xFF) {
+			return (rot << 8) | imm8;
+		}
+	}
+	return -1;
+}
+
+/*
+* Writes machine code sequentially into trampoline memory.
+*/
+struct emitter {
+	uint32_t* start;
+	uint32_t* pos;
+};
+
+void emit(struct emitter* e, uint32_t instr) {
+	*e->pos++ = instr;
+}
+
+// Loads a 32-bit constant into 'rd' with a 'movw'/'movt' pair.
+void emit_mov32(struct emitter* e, int rd, uint32_t val) {
+	emit(e, arm_movw(rd, val & 0xFFFF));
+	emit(e, arm_movt(rd, val >> 16));
+}
+
+/*
+* Puts the address 'addr' into 'rd', with a single PC-relative 'add'/'sub'
+* if the distance can be encoded and a 'movw'/'movt' pair otherwise.
+*/
+void emit_addr(struct emitter* e, int rd, void* addr) {
+	ptrdiff_t offset = (int8_t*) addr - ((int8_t*) e->pos + 8);
+	int imm = encode_mod_imm(offset >= 0 ? offset : -offset);
+	if (imm < 0) {
+		emit_mov32(e, rd, (uint32_t) (uintptr_t) addr);
+	} else if (offset >= 0) {
+		emit(e, 0xE28F0000 | (rd << 12) | imm); // add rd, pc, #imm
+	} else {
+		emit(e, 0xE24F0000 | (rd << 12) | imm); // sub rd, pc, #imm
+	}
+}
+
+/*
+* Saves the guest's registers as a 'struct tramp_frame', or restores them
+* from it including the flags. Saving leaves the frame's address in sp.
+*/
+void emit_frame_save(struct emitter* e) {
+	emit(e, arm_push(0x5FFF)); // {r0-r12, r14}
+	emit(e, arm_mrs_apsr(4));
+	emit(e, arm_push(0x0030)); // {r4, r5}
+}
+
+void emit_frame_restore(struct emitter* e) {
+	emit(e, arm_pop(0x0030));
+	emit(e, arm_msr_apsr(4));
+	emit(e, arm_pop(0x5FFF));
+}
+
+// Emits a 'b' or 'bl' to 'target', which must be in range.
+void emit_branch(struct emitter* e, void* target, int link) {
+	assert(branch_in_range(e->pos, (void*) ((uintptr_t) target & ~1)));
+	emit(e, encode_branch(e->pos, target, link));
+}
+
+/*
+* Emits an unconditional jump to the ARM code at 'target': a 'b' if it is in
+* range, otherwise an 'ldr' into the PC of the address, stored in the next
+* word. Takes up to JUMP_WORDS words.
+*/
+#define JUMP_WORDS 2
+void emit_jump(struct emitter* e, void* target) {
+	if (branch_in_range(e->pos, target)) {
+		emit_branch(e, target, 0);
+	} else {
+		emit(e, 0xE51FF004); // ldr pc, [pc, #-4]
+		emit(e, (uint32_t) (uintptr_t) target);
+	}
+}
+
+// Rewrites the branch at 'site' (emitted earlier) to go to 'target' if 'cond' holds.
+void patch_branch(uint32_t* site, void* target, int cond) {
+	*site = with_cond(encode_branch(site, target, 0), cond);
+}
+
 /*
 * Returns a struct that contains information about what instruction
 * exists at the provided pointer.
@@ -162,8 +496,11 @@ cs_insn* disassemble_instr(void* p_instr) {
     if (count == 0 || 0 == strcmp(instr[0].mnemonic, "") ) {
 		output = NULL;
 	} else {
-		cs_insn* insn_copy = malloc(sizeof(cs_insn));
+		// The detail is copied into the same allocation so one free() releases both
+		cs_insn* insn_copy = malloc(sizeof(cs_insn) + sizeof(cs_detail));
 		memcpy(insn_copy, &instr[0], sizeof(cs_insn));
+		insn_copy->detail = (cs_detail*) (insn_copy + 1);
+		memcpy(insn_copy->detail, instr[0].detail, sizeof(cs_detail));
 		output = insn_copy;
 		cs_free(instr, count);
 	}
@@ -188,87 +525,99 @@ char* instr_name(void* instr){
 	return out;
 }
 
+/*
+* Adds [start, end), memory in an instrumented file that the program never
+* uses, to the slack space islands are placed in.
+*/
+void add_slack(void* start, void* end) {
+	int8_t* next = (int8_t*) (((uintptr_t) start + 3) & ~3);
+	if (num_slack_areas == MAX_SLACK || next + ISLAND_SIZE > (int8_t*) end) {
+		return;
+	}
+	slack_areas[num_slack_areas].next = next;
+	slack_areas[num_slack_areas].end = end;
+	num_slack_areas++;
+	printfdbg("Slack space for islands at %p-%p\n", next, end);
+}
+
+/*
+* Writes an island that jumps to 'tramp' within range of the probe site
+* 'instr', which has bit 0 set if it is Thumb code, and returns it.
+* A Thumb site's trampoline starts in Thumb state, so its island's target
+* has bit 0 set too. Returns NULL if there is no slack space in range.
+*/
+void* island_alloc(void* instr, void* tramp) {
+	int thumb = (uintptr_t) instr & 1;
+	void* site = (void*) ((uintptr_t) instr & ~1);
+	uintptr_t target = (uintptr_t) tramp | thumb;
+	for (int i = 0; i < num_slack_areas; i++) {
+		int8_t* island = slack_areas[i].next;
+		if (island + ISLAND_SIZE > slack_areas[i].end
+			|| !(thumb ? thumb_branch_in_range(site, island) : branch_in_range(site, island))) {
+			continue;
+		}
+		slack_areas[i].next += ISLAND_SIZE;
+		make_writable(island, island + ISLAND_SIZE, NULL);
+		memcpy(island, thumb ? thumb_island_template : island_template, sizeof(island_template));
+		memcpy(island + sizeof(island_template), &target, sizeof(void*));
+		__builtin___clear_cache((char*) island, (char*) island + ISLAND_SIZE);
+		printfdbg("Island to %p written at %p for instruction %p\n", tramp, island, site);
+		stat_inc(STAT_ISLANDS);
+		return island;
+	}
+	return NULL;
+}
+
 /*
 * In the instrumentation stage, this method displaces the floating-point
 * instruction with a branch that points to the start of a pre-written trampoline.
-* The trampoline is also written to so that when it returns, it returns to just after
-* the displaced FP instruction.
+* Trampolines are generated already ending in a branch back to just after
+* the displaced FP instruction (see tramp_link_return()).
+* The branch is given the condition 'cond', normally that of the displaced
+* instruction, so a conditional instruction whose condition fails costs a
+* branch that isn't taken and never reaches its trampoline.
+* A trampoline out of range is reached through an island. If there is no
+* slack space for one the instruction is left in place and -1 returned.
 */
-int insert_probe(void* instr, void* tramp) {
+int insert_probe(void* instr, void* tramp, int cond) {
 	printfdbg("Inserting probe at %p to connect to trampoline at %p\n", instr, tramp);
 
-	// Calculate trampoline offset	
-	ptrdiff_t offset = ((int8_t*) tramp - (int8_t*) instr);
-	ptrdiff_t offset_reverse = (((int8_t*) instr + 4) - ((int8_t*) tramp + RET_OFFSET));
-	// Ensure trampoline is close enough for the offset to be written
-	assert(INT24_MIN <= offset && offset <= INT24_MAX);
-	assert(INT24_MIN <= offset_reverse && offset_reverse <= INT24_MAX);
-	
-	// Convert offset into a string to pass to the assembler
-	char str_offset[100];
-	char str_offset_reverse[100];
-	sprintf(str_offset, "%td", offset);		
-	sprintf(str_offset_reverse, "%td", offset_reverse);		
-	int8_t* probe_site_to_tramp = assemble_branch(str_offset); 
-	int8_t* tramp_to_probe_site = assemble_branch(str_offset_reverse); 
+	if (!branch_in_range(instr, tramp)) {
+		tramp = island_alloc(instr, tramp);
+		if (tramp == NULL) {
+			printfdbg("ERROR: no island in range of instruction %p, leaving it in place\n", instr);
+			stat_inc(STAT_PROBES_FAILED);
+			return -1;
+		}
+	}
+	uint32_t probe_site_to_tramp = with_cond(encode_branch(instr, tramp, 0), cond);
 	
 	#ifdef DO_DBG_PRINT
 	char* before = instr_name(instr);
-	char* after = instr_name(probe_site_to_tramp);
-	char* back_again = instr_name(tramp_to_probe_site);
+	char* after = instr_name(&probe_site_to_tramp);
 
 	printfdbg(" - writing tramp branch into instr at %p\n", instr);
-	printfdbg("     - instr: %02x%02x%02x%02x", 
-		*((int8_t*) instr)&0xff, 
-		*((int8_t*) instr + 1) & 0xff, 
-		*((int8_t*) instr + 2) & 0xff, 
-		*((int8_t*) instr + 3) & 0xff);
-	printfdbg(" (%s)\n", before);
-	printfdbg("     - assembly: %02x%02x%02x%02x", 
-		*((int8_t*) probe_site_to_tramp)&0xff, 
-		*((int8_t*) probe_site_to_tramp + 1) & 0xff, 
-		*((int8_t*) probe_site_to_tramp + 2) & 0xff, 
-		*((int8_t*) probe_site_to_tramp + 3) & 0xff);
-	printfdbg(" (%s)\n", after);
-	
-	printfdbg(" - writing return branch into tramp at %p\n", (int8_t*) tramp + RET_OFFSET);
-	printfdbg("     - instr: %02x%02x%02x%02x", 
-		*((int8_t*) tramp + RET_OFFSET)&0xff, 
-		*((int8_t*) tramp + RET_OFFSET + 1) & 0xff, 
-		*((int8_t*) tramp + RET_OFFSET + 2) & 0xff, 
-		*((int8_t*) tramp + RET_OFFSET + 3) & 0xff);
-	printfdbg(" (%s)\n", before);
-	printfdbg("     - assembly: %02x%02x%02x%02x", 
-		*((int8_t*) probe_site_to_tramp) & 0xff, 
-		*((int8_t*) probe_site_to_tramp + 1) & 0xff, 
-		*((int8_t*) probe_site_to_tramp + 2) & 0xff, 
-		*((int8_t*) probe_site_to_tramp + 3) & 0xff);
-	printfdbg(" (%s)\n", after);
+	printfdbg("     - instr: %08x (%s)\n", *(uint32_t*) instr, before);
+	printfdbg("     - assembly: %08x (%s)\n", probe_site_to_tramp, after);
 	#endif
 	
 	// Replace FP instruction with branch
-	clobber(instr, probe_site_to_tramp);
-
-	// Add return branch to the end of the trampoline
-	clobber((int8_t*)tramp + RET_OFFSET, tramp_to_probe_site);
+	clobber(instr, &probe_site_to_tramp);
 	
 	#ifdef DO_DBG_PRINT
 	printfdbg(" - branch written\n");	
 	printfdbg(" - Therefore, '%s' replaced with '%s' at %p\n", before, after, instr);
 	free(before);
 	free(after);
-	free(back_again);
 	#endif 
-
-	ks_free(probe_site_to_tramp);
-	ks_free(tramp_to_probe_site);
+	return 0;
 }
 
 /*
-* Finds and reserves a page of memory near 'instr_addr'. 
-* Returns a pointer to the start of this page.
+* Finds and reserves 'len' bytes of memory near 'instr_addr'. 
+* Returns a pointer to the start of this region.
 */
-void* mmap_nearby(void* instr_addr) {
+void* mmap_nearby(void* instr_addr, size_t len) {
 	unsigned int perms = PROT_EXEC | PROT_READ | PROT_WRITE;
 	unsigned int flags = MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS;
 
@@ -290,8 +639,8 @@ void* mmap_nearby(void* instr_addr) {
 	void* map_region = NULL;
 	printfdbg("Searching from %p to %p\n", search_from, search_to);
 	for (int page_start = search_from; page_start < search_to; page_start += PAGE_SIZE) {
-		printfdbg("mmap(%p, %d, ...) = ", page_start, sizeof(template));
-		map_region = mmap(page_start, sizeof(template), perms, flags, -1, 0);
+		printfdbg("mmap(%p, %d, ...) = ", page_start, len);
+		map_region = mmap(page_start, len, perms, flags, -1, 0);
 		printfdbg("%p (should be %p)\n", map_region, page_start);
 		if (map_region == page_start) {  // request accepted
 			break;
@@ -311,15 +660,102 @@ void* mmap_nearby(void* instr_addr) {
 }
 
 /*
-* Reserves a page of memory and writes the trampoline template to it.
+* Returns whether the region [start, start+len) can be reached by, and can
+* branch back to, the instruction at 'instr_addr'.
+* A Thumb site is marked by setting bit 0 of 'instr_addr', as for a Thumb
+* function's address. Its trampolines return with an absolute load into
+* the PC, so only the 'b.w' into the region has to reach.
+*/
+int region_in_range(void* instr_addr, void* start, size_t len) {
+	if ((uintptr_t) instr_addr & 1) {
+		return thumb_branch_in_range((void*) ((uintptr_t) instr_addr & ~1), start);
+	}
+	return branch_in_range(instr_addr, start) 
+		&& branch_in_range((int8_t*) start + len, (int8_t*) instr_addr + 4);
+}
+
+/*
+* Allocates 'len' bytes of trampoline memory within branching range of
+* 'instr_addr', mapping a new pool if none of the existing ones fit.
+* Returns NULL if there is no space in range. If 'instr_addr' is NULL the
+* memory can be anywhere, for trampolines reached through an island.
 */
-void* gen_template_tramp(void* instr_addr) {
-	void* p_template = mmap_nearby(instr_addr);
+void* tramp_alloc(void* instr_addr, size_t len, struct tramp_pool** pool_out) {
+	len = (len + 3) & ~3;
+	for (int i = 0; i < num_pools; i++) {
+		struct tramp_pool* pool = &pools[i];
+		int8_t* start = pool->base + pool->used;
+		if (pool->used + len <= POOL_SIZE && (instr_addr == NULL || region_in_range(instr_addr, start, len))) {
+			pool->used += len;
+			if (pool_out != NULL) *pool_out = pool;
+			return start;
+		}
+	}
+
+	if (num_pools == MAX_POOLS) {
+		printfdbg("ERROR: all %d trampoline pools are in use\n", MAX_POOLS);
+		return NULL;
+	}
+	int8_t* base;
+	if (instr_addr == NULL) {
+		base = mmap(NULL, POOL_SIZE, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		base = base == MAP_FAILED ? NULL : base;
+	} else {
+		base = mmap_nearby(instr_addr, POOL_SIZE);
+	}
+	if (base == NULL || (instr_addr != NULL && !region_in_range(instr_addr, base, len))) {
+		return NULL;
+	}
+	struct tramp_pool* pool = &pools[num_pools++];
+	pool->base = base;
+	pool->used = len;
+	pool->num_veneers = 0;
+	printfdbg("New trampoline pool at %p-%p\n", base, base + POOL_SIZE);
+	if (pool_out != NULL) *pool_out = pool;
+	return base;
+}
+
+/*
+* Returns something a 'bl' at 'from' (inside 'pool') can call to reach 'func':
+* either 'func' itself or a veneer in the pool that loads its address into pc.
+*/
+void* pool_call_target(struct tramp_pool* pool, void* from, void* func) {
+	if (branch_in_range(from, (void*) ((uintptr_t) func & ~1))) {
+		return func;
+	}
+	for (int i = 0; i < pool->num_veneers; i++) {
+		if (pool->veneers[i].target == func) {
+			return pool->veneers[i].code;
+		}
+	}
+	if (pool->used + VENEER_SIZE > POOL_SIZE) {
+		printfdbg("ERROR: no room for a veneer to %p in pool %p\n", func, pool->base);
+		return NULL;
+	}
+	int8_t* veneer = pool->base + pool->used;
+	pool->used += VENEER_SIZE;
+	memcpy(veneer, veneer_template, sizeof(veneer_template));
+	memcpy(veneer + sizeof(veneer_template), &func, sizeof(void*));
+	__builtin___clear_cache((char*) veneer, (char*) veneer + VENEER_SIZE);
+	// Once the table is full, later calls to other routines get veneers of their own
+	if (pool->num_veneers < MAX_VENEERS) {
+		pool->veneers[pool->num_veneers].target = func;
+		pool->veneers[pool->num_veneers].code = veneer;
+		pool->num_veneers++;
+	}
+	printfdbg("Veneer to %p written at %p\n", func, veneer);
+	return veneer;
+}
+
+/*
+* Allocates trampoline memory and writes the trampoline template to it.
+* If 'instr_addr' is NULL the trampoline is a distant one, with room after
+* the descriptor for the address it returns to.
+*/
+void* gen_template_tramp(void* instr_addr, struct tramp_pool** pool_out) {
+	void* p_template = tramp_alloc(instr_addr, instr_addr == NULL ? TRAMP_SIZE + sizeof(void*) : TRAMP_SIZE, pool_out);
 	if (p_template == NULL) {
-		printfdbg("ERROR: no space for trampoline near instruction %p (see mmap error below)\n", instr_addr);
-		#ifdef DO_DBG_PRINT
-  		perror("mmap");
-		#endif
+		printfdbg("ERROR: no space for trampoline near instruction %p\n", instr_addr);
 		return NULL;
 	}
 	memcpy(p_template, &template, sizeof(template));
@@ -334,91 +770,377 @@ void insert_tramp_instr(void* trampoline, void* instr, int offset) {
 }
 
 /*
-* Inserts the emulation routine arguments into a trampoline.
+* Writes the pre-decoded descriptor of the emulated instruction into a trampoline.
 */
-void tramp_insert_emu_args(void* trampoline, int arg1, int arg2, int arg3, int arg4) {
-	int8_t* mov_r0 = assemble_mov(0, arg1);
-	int8_t* mov_r1 = assemble_mov(1, arg2);
-	int8_t* mov_r2 = assemble_mov(2, arg3);
-	int8_t* mov_r3 = assemble_mov(3, arg4);
-	insert_tramp_instr(trampoline, mov_r0, MOV_R0_OFFSET);	
-	insert_tramp_instr(trampoline, mov_r1, MOV_R1_OFFSET);	
-	insert_tramp_instr(trampoline, mov_r2, MOV_R2_OFFSET);	
-	insert_tramp_instr(trampoline, mov_r3, MOV_R3_OFFSET);	
-	free(mov_r0);
-	free(mov_r1);
-	free(mov_r2);
-	free(mov_r3);
+void tramp_insert_emu_desc(void* trampoline, struct emu_desc* desc) {
+	memcpy(((int8_t*)trampoline) + DESC_OFFSET, desc, sizeof(struct emu_desc));
 }
 
 /*
-* Writes the address of the emulation routine into the trampoline for 
-* branching later. As described in the report, the address is divided and 
-* loaded in two parts into a register by instructions in the trampoline.
+* Writes the call to the emulation routine into the trampoline. A direct 'bl'
+* is used when the routine is in range, otherwise the 'bl' goes through a
+* veneer in the trampoline's pool. Returns -1 if the pool has no room left
+* for the veneer.
 */
-void link_tramp_to_emu(void* trampoline, void* func_address) {
-	// Split address into two two-byte pieces.
-	int16_t word_lower = ((int32_t) func_address) & 0x0000FFFF;
-	int16_t word_upper = (((int32_t) func_address) & 0xFFFF0000) >> 16;
-		
-	int8_t* mov_instr0 = assemble_mov(REG_CALL, word_upper);
-	int8_t* mov_instr1 = assemble_mov(REG_SCRATCH, word_lower);
+int link_tramp_to_emu(void* trampoline, struct tramp_pool* pool, void* func_address) {
+	int8_t* call_site = (int8_t*) trampoline + CALL_OFFSET;
+	void* target = pool_call_target(pool, call_site, func_address);
 	
-	if (mov_instr0 == NULL || mov_instr1 == NULL) {
-		printfdbg("ERROR: couldn't assemble func address into mov");
-		exit(1);
+	if (target == NULL) {
+		printfdbg("ERROR: couldn't link trampoline %p to routine %p\n", trampoline, func_address);
+		return -1;
 	}
 	
-	insert_tramp_instr(trampoline, mov_instr0, MOV_UPPER_OFFSET);
-	insert_tramp_instr(trampoline, mov_instr1, MOV_LOWER_OFFSET);
+	uint32_t bl = encode_branch(call_site, target, 1);
+	insert_tramp_instr(trampoline, &bl, CALL_OFFSET);
+	return 0;
+}
 
-	free(mov_instr0);
-	free(mov_instr1);
+/*
+* Writes the branch at 'ret_site' in a trampoline that returns execution to
+* 'resume', the instruction after the one the trampoline replaces.
+*/
+void tramp_link_return(void* ret_site, void* resume) {
+	assert(branch_in_range(ret_site, resume));
+	uint32_t b = encode_branch(ret_site, resume, 0);
+	memcpy(ret_site, &b, sizeof(b));
 }
 
 /*
-* Returns a pointer to the beginning of the trampoline or NULL if failed.
-* In three places there is a hard-coded check for the 'vadd.f32' instruction as
-* it is the only instruction emulated so far in the emulator. In a full solution,
-* these checks would be removed.
+* Writes the return of a distant template trampoline, which can't branch
+* back: an 'ldr' into the PC of 'resume', stored just after the descriptor.
 */
-void* generate_trampoline(void* instr_addr) {
-	cs_insn* disassembly = disassemble_instr(instr_addr);
+void tramp_link_far_return(void* trampoline, void* resume) {
+	int8_t* ret_site = (int8_t*) trampoline + RET_OFFSET;
+	uint32_t ldr = arm_ldr_imm(15, 15, TRAMP_SIZE - RET_OFFSET - 8);
+	memcpy(ret_site, &ldr, sizeof(ldr));
+	memcpy((int8_t*) trampoline + TRAMP_SIZE, &resume, sizeof(void*));
+}
 
-	if (disassembly == NULL) {
+/*
+* Emulation routines of the VFP data-processing instructions, indexed by
+* instruction ID, with one routine per precision (NULL where a precision
+* isn't emulated) and the number of operands: three for 'Sd, Sn, Sm' and
+* two for 'Sd, Sm'. Together the ID and the '.f32'/'.f64' data type of an
+* instruction select its routine without searching.
+*/
+struct fp_instr {
+	int num_ops;
+	void* f32;
+	void* f64;
+};
+
+struct fp_instr fp_dispatch[ARM_INS_ENDING] = {
+	[ARM_INS_VADD] = { 3, &vadd_f32, &vadd_f64 },
+	[ARM_INS_VSUB] = { 3, &vsub_f32, &vsub_f64 },
+	[ARM_INS_VMUL] = { 3, &vmul_f32, &vmul_f64 },
+	[ARM_INS_VNMUL] = { 3, &vnmul_f32, &vnmul_f64 },
+	[ARM_INS_VDIV] = { 3, &vdiv_f32, &vdiv_f64 },
+	[ARM_INS_VMLA] = { 3, &vmla_f32, &vmla_f64 },
+	[ARM_INS_VMLS] = { 3, &vmls_f32, &vmls_f64 },
+	[ARM_INS_VNMLA] = { 3, &vnmla_f32, &vnmla_f64 },
+	[ARM_INS_VNMLS] = { 3, &vnmls_f32, &vnmls_f64 },
+	[ARM_INS_VFMA] = { 3, &vfma_f32, NULL },
+	[ARM_INS_VFMS] = { 3, &vfms_f32, NULL },
+	[ARM_INS_VFNMA] = { 3, &vfnma_f32, NULL },
+	[ARM_INS_VFNMS] = { 3, &vfnms_f32, NULL },
+	[ARM_INS_VSQRT] = { 2, &vsqrt_f32, &vsqrt_f64 },
+	[ARM_INS_VABS] = { 2, &vabs_f32, &vabs_f64 },
+	[ARM_INS_VNEG] = { 2, &vneg_f32, &vneg_f64 },
+	[ARM_INS_VMOV] = { 2, &vmov_f32, &vmov_f64 },
+	[ARM_INS_VCMP] = { 2, &vcmp_f32, &vcmp_f64 },
+	[ARM_INS_VCMPE] = { 2, &vcmpe_f32, &vcmpe_f64 },
+};
+
+/*
+* Returns whether 'op' is a register of the given precision, setting 'index'
+* to its bank index (that of the low half of a D register).
+*/
+int is_fp_reg_op(cs_arm_op* op, int is_f64, uint8_t* index) {
+	if (op->type != ARM_OP_REG) {
+		return 0;
+	}
+	if (is_f64) {
+		if (op->reg < ARM_REG_D0 || op->reg > ARM_REG_D31) {
+			return 0;
+		}
+		*index = dreg_to_bank_index(op->reg);
+	} else {
+		if (op->reg < ARM_REG_S0 || op->reg > ARM_REG_S31) {
+			return 0;
+		}
+		*index = sreg_to_bank_index(op->reg);
+	}
+	return 1;
+}
+
+/*
+* Returns the emulation routine of the VFP data-processing instruction
+* 'insn', whose encoding is 'instr', filling in 'desc'.
+* Returns NULL if it isn't one that is emulated. Requiring the '.f32' or
+* '.f64' data type keeps out NEON instructions with the same IDs, as does
+* requiring S registers for '.f32'.
+*/
+void* decode_data_instr(cs_insn* insn, uint32_t instr, struct emu_desc* desc) {
+	cs_arm* arm = &(insn->detail->arm);
+	if (insn->id >= ARM_INS_ENDING) {
 		return NULL;
-	} else if (disassembly->id != ARM_INS_VADD) {
-		free(disassembly);
+	}
+	int is_f64;
+	if (arm->vector_data == ARM_VECTORDATA_F32) {
+		is_f64 = 0;
+	} else if (arm->vector_data == ARM_VECTORDATA_F64) {
+		is_f64 = 1;
+	} else {
+		return NULL;
+	}
+	struct fp_instr* f = &fp_dispatch[insn->id];
+	void* routine = is_f64 ? f->f64 : f->f32;
+	if (routine == NULL || arm->op_count != f->num_ops || !is_fp_reg_op(&arm->operands[0], is_f64, &desc->d)) {
+		return NULL;
+	}
+	desc->flags = 0;
+
+	if (f->num_ops == 3) {
+		if (!is_fp_reg_op(&arm->operands[1], is_f64, &desc->n) || !is_fp_reg_op(&arm->operands[2], is_f64, &desc->m)) {
+			return NULL;
+		}
+		return routine;
+	}
+	desc->n = 0;
+	if (arm->operands[1].type == ARM_OP_FP || arm->operands[1].type == ARM_OP_IMM) {
+		if (insn->id == ARM_INS_VCMP || insn->id == ARM_INS_VCMPE) {
+			// The only immediate 'vcmp' takes is zero
+			desc->m = EMU_ZERO;
+			return routine;
+		}
+		if (insn->id == ARM_INS_VMOV) {
+			// Capstone gives the constant as a double, so it is taken from the encoding: imm4H:imm4L
+			desc->n = ((instr >> 12) & 0xF0) | (instr & 0xF);
+			return is_f64 ? (void*) &vmov_imm_f64 : (void*) &vmov_imm_f32;
+		}
+		return NULL;
+	}
+	if (!is_fp_reg_op(&arm->operands[1], is_f64, &desc->m)) {
+		return NULL;
+	}
+	return routine;
+}
+
+/*
+* Returns the emulation routine of the VFP conversion encoded in 'instr',
+* filling in 'desc', or NULL if it isn't one. Capstone's operands differ
+* between the many forms of 'vcvt', so they are decoded from the encoding,
+* cond 1110 1D11 opc2 Vd 101 sz op 1 M 0 Vm, where opc2 picks the form.
+* The unconditional space holds ARMv8's conversions, which aren't emulated.
+*/
+void* decode_cvt_instr(uint32_t instr, struct emu_desc* desc) {
+	if ((instr & 0x0FB00E50) != 0x0EB00A40 || (instr >> 28) == 0xF) {
+		return NULL;
+	}
+	int opc2 = (instr >> 16) & 0xF;
+	int is_f64 = (instr >> 8) & 1;
+	int op = (instr >> 7) & 1;
+	// Bank indices of the operands as S registers (Vd:D, Vm:M) and as D registers (D:Vd, M:Vm)
+	uint8_t sd = ((instr >> 11) & 0x1E) | ((instr >> 22) & 1);
+	uint8_t sm = ((instr << 1) & 0x1E) | ((instr >> 5) & 1);
+	uint8_t dd = (((instr >> 18) & 0x10) | ((instr >> 12) & 0xF)) * 2;
+	uint8_t dm = (((instr >> 1) & 0x10) | (instr & 0xF)) * 2;
+	desc->n = 0;
+	desc->flags = 0;
+
+	switch (opc2) {
+		case 0x2:
+		case 0x3:
+			// 'vcvtb' and 'vcvtt' (op is T) from and to half precision; the double precision forms are ARMv8's
+			if (is_f64) {
+				return NULL;
+			}
+			desc->d = sd;
+			desc->m = sm;
+			desc->flags = op ? CVT_TOP : 0;
+			return (opc2 & 1) ? (void*) &vcvt_f32_to_f16 : (void*) &vcvt_f16_to_f32;
+		case 0x7:
+			// Between precisions, from the one 'sz' gives
+			if (!op) {
+				return NULL;
+			}
+			desc->d = is_f64 ? sd : dd;
+			desc->m = is_f64 ? dm : sm;
+			return is_f64 ? (void*) &vcvt_f64_to_f32 : (void*) &vcvt_f32_to_f64;
+		case 0x8:
+			// From a 32-bit integer in an S register, signed if op is set
+			desc->d = is_f64 ? dd : sd;
+			desc->m = sm;
+			desc->flags = op ? 0 : CVT_UNSIGNED;
+			return is_f64 ? (void*) &vcvt_fixed_to_f64 : (void*) &vcvt_fixed_to_f32;
+		case 0xC:
+		case 0xD:
+			// To an integer in an S register, signed for 0xD; op clear is 'vcvtr'
+			desc->d = sd;
+			desc->m = is_f64 ? dm : sm;
+			desc->flags = ((opc2 & 1) ? 0 : CVT_UNSIGNED) | (op ? CVT_ROUND_ZERO : 0);
+			return is_f64 ? (void*) &vcvt_f64_to_int : (void*) &vcvt_f32_to_fixed;
+		case 0xA:
+		case 0xB:
+		case 0xE:
+		case 0xF: {
+			// Fixed point in place: opc2 is 1 to_fixed 1 U, op gives the size, imm4:i the size minus the fraction bits
+			int size = op ? 32 : 16;
+			int frac_bits = size - (int) (((instr & 0xF) << 1) | ((instr >> 5) & 1));
+			if (frac_bits < 0) {
+				return NULL;
+			}
+			desc->d = desc->m = is_f64 ? dd : sd;
+			desc->n = frac_bits;
+			desc->flags = ((opc2 & 1) ? CVT_UNSIGNED : 0) | (op ? 0 : CVT_16BIT);
+			if (opc2 & 0x4) {
+				desc->flags |= CVT_ROUND_ZERO;
+				return is_f64 ? (void*) &vcvt_f64_to_fixed : (void*) &vcvt_f32_to_fixed;
+			}
+			return is_f64 ? (void*) &vcvt_fixed_to_f64 : (void*) &vcvt_fixed_to_f32;
+		}
+	}
+	return NULL;
+}
+
+/*
+* Decodes the instruction at 'instr_addr'. If it can be emulated, fills in
+* its descriptor and returns the emulation routine, otherwise returns NULL.
+*/
+void* decode_fp_instr(void* instr_addr, struct emu_desc* desc) {
+	cs_insn* disassembly = disassemble_instr(instr_addr);
+	if (disassembly == NULL) {
 		return NULL;
 	}
-		
-	// Get which S registers are used
-	cs_arm* arm = &(disassembly->detail->arm);
-	int Sd = arm->operands[0].reg;
-	int Sn = arm->operands[1].reg;
-	int Sm = arm->operands[2].reg;
-	
-	if (Sd != ARM_REG_S0 || Sn != ARM_REG_S0 || Sm != ARM_REG_S1 || arm->cc != ARM_CC_AL) return NULL;
-	printfdbg("%s %s\n", disassembly->mnemonic, disassembly->op_str);
-	printfdbg("This vadd (CC=%d) instruction uses the registers %d, %d, %d %d %d\n", arm->cc, Sd, Sn, Sm, arm->operands[3].reg, arm->operands[4].reg);
-	assert(ARM_REG_S0 <= Sd  && Sd <= ARM_REG_S31);
-	assert(ARM_REG_S0 <= Sn  && Sn <= ARM_REG_S31);
-	assert(ARM_REG_S0 <= Sm  && Sm <= ARM_REG_S31);
 
+	void* routine = decode_cvt_instr(*(uint32_t*) instr_addr, desc);
+	#ifdef DO_NEON
+	if (routine == NULL) {
+		routine = decode_neon_instr(*(uint32_t*) instr_addr, desc);
+	}
+	#endif
+	if (routine == NULL) {
+		routine = decode_data_instr(disassembly, *(uint32_t*) instr_addr, desc);
+	}
+	if (routine != NULL) {
+		printfdbg("%s %s: Sd:%d Sn:%d Sm:%d\n", disassembly->mnemonic, disassembly->op_str, desc->d, desc->n, desc->m);
+	}
+	free(disassembly);
+	return routine;
+}
+
+/*
+* Returns a pointer to the beginning of a template trampoline that calls
+* 'routine' with 'desc', or NULL if failed. Without memory in range of
+* 'instr_addr' it is a distant one, which insert_probe() reaches through
+* an island.
+*/
+void* generate_trampoline(void* instr_addr, struct emu_desc* desc, void* routine) {
 	// Make trampoline
-	int8_t* tramp = gen_template_tramp(instr_addr);
+	struct tramp_pool* pool;
+	int far = 0;
+	int8_t* tramp = gen_template_tramp(instr_addr, &pool);
 	if (tramp == NULL) {
+		far = 1;
+		tramp = gen_template_tramp(NULL, &pool);
+	}
+	if (tramp == NULL || link_tramp_to_emu(tramp, pool, routine) != 0) {
 		printfdbg("ERROR: failed to generate template trampoline\n");
-		exit(1);
+		return NULL;
 	}	
 	
-	// 'vadd_f32' is connected here as it is the only emulation routine present
-	// but in practice you'd want to check the dissassembly above - the variable 'disassembly'.
-	link_tramp_to_emu(tramp, &vadd_f32);
-	
-	// Put the args (names of S registers) into r0-r2
-	tramp_insert_emu_args(tramp, Sd, Sn, Sm, 0); 
+	tramp_insert_emu_desc(tramp, desc);
+	if (far) {
+		tramp_link_far_return(tramp, (int8_t*) instr_addr + 4);
+	} else {
+		tramp_link_return(tramp + RET_OFFSET, (int8_t*) instr_addr + 4);
+	}
+	__builtin___clear_cache((char*) tramp, (char*) tramp + TRAMP_SIZE + far * sizeof(void*));
 
 	printfdbg("Trampoline made for  instruction.");
+	stat_inc(STAT_TEMPLATE_TRAMPS);
 	return tramp;
-}
\ No newline at end of file
+}
+
+/*
+* Generates a trampoline that calls 'routine' with a copy of the descriptor
+* 'desc' ('desc_size' bytes) and the saved register frame, then restores
+* the guest's registers, including any the routine changed in the frame,
+* and continues at 'resume'. The descriptor is stored before the code,
+* which starts at the returned address.
+* For instructions that push onto or pop off the guest's stack, a negative
+* 'sp_adjust' is subtracted from the SP before the frame is saved and a
+* positive one is added after it is restored, so the frame, which sits just
+* below the SP, never overlaps the data being pushed or popped.
+* If 'resume' has bit 0 set it is Thumb code, and so is the probe site,
+* marked the same way in 'instr_addr': the trampoline then starts with a
+* Thumb 'bx pc' that switches to ARM state and returns with a load into the
+* PC, which switches back.
+* On a CPU with a VFP unit the routine is called through fpu_hw_call().
+* Without space near 'instr_addr' the trampoline is a distant one, which
+* returns the way Thumb ones do and is reached through an island.
+* Returns NULL if there is no space for it at all.
+*/
+void* generate_frame_trampoline(void* instr_addr, void* resume, void* desc, size_t desc_size, void* routine, int sp_adjust) {
+	// Thumb entry, adjusting the SP, saving and restoring the frame, the two arguments, the call and the return
+	size_t max_words = 1 + 1 + 3 + 3 + 2 + 1 + 1 + 2;
+	#ifdef DO_SELECTIVE_EMULATION
+	// With a VFP unit the routine is called by fpu_hw_call(), on the hardware's registers
+	uint32_t call_space[(sizeof(struct hw_call) + desc_size + 3) / 4];
+	if (fpu_hw_present()) {
+		struct hw_call* call = (struct hw_call*) call_space;
+		call->routine = routine;
+		memcpy(call->desc, desc, desc_size);
+		desc = call;
+		desc_size += sizeof(struct hw_call);
+		routine = &fpu_hw_call;
+	}
+	#endif
+	int thumb = (uintptr_t) resume & 1;
+	size_t desc_space = (desc_size + 3) & ~3;
+	struct tramp_pool* pool;
+	int8_t* mem = tramp_alloc(instr_addr, desc_space + max_words * 4, &pool);
+	int far = mem == NULL;
+	if (far) {
+		mem = tramp_alloc(NULL, desc_space + max_words * 4, &pool);
+	}
+	if (mem == NULL) {
+		printfdbg("ERROR: no space for frame trampoline for instruction %p\n", instr_addr);
+		return NULL;
+	}
+	void* tramp_desc = mem;
+	uint32_t* code = (uint32_t*) (mem + desc_space);
+	memcpy(tramp_desc, desc, desc_size);
+
+	struct emitter e = { code, code };
+	if (thumb) {
+		emit(&e, 0x46C04778); // bx pc; nop (Thumb), continuing in ARM state at the next word
+	}
+	if (sp_adjust < 0) {
+		emit(&e, arm_sub_imm(13, 13, -sp_adjust));
+	}
+	emit_frame_save(&e);
+	emit_addr(&e, 0, tramp_desc);
+	emit(&e, arm_mov_reg(1, 13)); // mov r1, sp
+	void* target = pool_call_target(pool, e.pos, routine);
+	if (target == NULL) {
+		printfdbg("ERROR: couldn't link frame trampoline %p to routine %p\n", code, routine);
+		return NULL;
+	}
+	emit_branch(&e, target, 1);
+	emit_frame_restore(&e);
+	if (sp_adjust > 0) {
+		emit(&e, arm_add_imm(13, 13, sp_adjust));
+	}
+	if (thumb || far) {
+		emit(&e, 0xE51FF004); // ldr pc, [pc, #-4]
+		emit(&e, (uint32_t) (uintptr_t) resume);
+	} else {
+		emit_branch(&e, resume, 0);
+	}
+
+	assert(e.pos - e.start <= max_words);
+	__builtin___clear_cache((char*) mem, (char*) e.pos);
+	return code;
+}
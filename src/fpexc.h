@@ -0,0 +1,563 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* keeping the cumulative exception flags of the FPSCR (IOC, DZC, OFC, UFC
+* and IXC) up to date as instructions are emulated.
+*/
+#define DO_FP_EXCEPTIONS
+
+/*
+* Uncommenting/commenting this 'define' statement chooses between working
+* out the exception flags of every operation as it happens (eager) and
+* only when they could change the FPSCR (lazy, see fp_note_lazy()).
+*/
+#define DO_LAZY_FP_EXCEPTIONS
+
+// Cumulative exception flags of the FPSCR
+#define FPSCR_IOC (1 << 0)	// invalid operation
+#define FPSCR_DZC (1 << 1)	// division by zero
+#define FPSCR_OFC (1 << 2)	// overflow
+#define FPSCR_UFC (1 << 3)	// underflow
+#define FPSCR_IXC (1 << 4)	// inexact
+#define FPSCR_IDC (1 << 7)	// input denormal, flushed to zero in FZ mode
+
+/*
+* Operations whose exceptions are worked out from their operands and
+* result. FP_OP_F64 is OR-ed in for double precision, and the arithmetic
+* mode the operation ran in (FP_MODE_*) is kept above FP_OP_MODE_SHIFT.
+*/
+#define FP_OP_NONE 0
+#define FP_OP_ADD 1
+#define FP_OP_SUB 2
+#define FP_OP_MUL 3
+#define FP_OP_DIV 4
+#define FP_OP_SQRT 5	// of 'a'
+#define FP_OP_FMA 6	// 'c' + 'a' * 'b', single precision only
+#define FP_OP_CMP 7
+#define FP_OP_CMPE 8	// as FP_OP_CMP, but quiet NaNs are invalid too
+#define FP_OP_F64 0x80
+#define FP_OP_KIND 0x7F
+#define FP_OP_MODE_SHIFT 8
+#define FP_OP_FZ (FP_MODE_FZ << FP_OP_MODE_SHIFT)
+
+// One operation: what it was, its operands and its result, as raw bits
+struct fp_record {
+	uint32_t op;
+	uint32_t pad;
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+	uint64_t r;
+};
+
+/*
+* Classification of the raw bits 'x' of a value of either precision.
+* Single precision values are in the low 32 bits.
+*/
+static inline int fp_exp_field(uint64_t x, int is_f64) {
+	return is_f64 ? F64_EXP(x) : F32_EXP((uint32_t) x);
+}
+
+static inline int fp_is_nan(uint64_t x, int is_f64) {
+	return is_f64 ? f64_is_nan(x) : f32_is_nan((uint32_t) x);
+}
+
+static inline int fp_is_snan(uint64_t x, int is_f64) {
+	return is_f64 ? f64_is_snan(x) : f32_is_snan((uint32_t) x);
+}
+
+static inline int fp_is_inf(uint64_t x, int is_f64) {
+	return is_f64 ? (x & ~F64_SIGN) == F64_INF : ((uint32_t) x & ~F32_SIGN) == F32_INF;
+}
+
+static inline int fp_is_zero(uint64_t x, int is_f64) {
+	return is_f64 ? (x & ~F64_SIGN) == 0 : ((uint32_t) x & ~F32_SIGN) == 0;
+}
+
+static inline int fp_is_subnormal(uint64_t x, int is_f64) {
+	return fp_exp_field(x, is_f64) == 0 && !fp_is_zero(x, is_f64);
+}
+
+// Returns whether 'x' is the smallest normal value of its sign
+static inline int fp_is_min_normal(uint64_t x, int is_f64) {
+	return is_f64 ? (x & ~F64_SIGN) == 0x0010000000000000ULL : ((uint32_t) x & ~F32_SIGN) == 0x00800000;
+}
+
+// Returns whether 'x' is the largest finite value of its sign
+static inline int fp_is_max_finite(uint64_t x, int is_f64) {
+	return is_f64 ? (x & ~F64_SIGN) == 0x7FEFFFFFFFFFFFFFULL : ((uint32_t) x & ~F32_SIGN) == 0x7F7FFFFF;
+}
+
+// Returns the zero of the sign of 'x'
+static inline uint64_t fp_signed_zero(uint64_t x, int is_f64) {
+	return is_f64 ? x & F64_SIGN : x & F32_SIGN;
+}
+
+/*
+* Unpacks the finite non-zero value 'x' into a significand with its
+* leading bit at bit 'frac_bits' (23 or 52) and an unbiased exponent, so
+* that its magnitude is sig * 2^(exp - frac_bits).
+*/
+static void fp_unpack(uint64_t x, int is_f64, uint64_t* sig, int32_t* exp) {
+	int frac_bits = is_f64 ? 52 : 23;
+	int bias = is_f64 ? 1023 : 127;
+	uint64_t frac = x & (((uint64_t) 1 << frac_bits) - 1);
+	int32_t exp_field = fp_exp_field(x, is_f64);
+	if (exp_field == 0) {
+		int shift = __builtin_clzll(frac) - (63 - frac_bits);
+		*sig = frac << shift;
+		*exp = 1 - bias - shift;
+	} else {
+		*sig = frac | ((uint64_t) 1 << frac_bits);
+		*exp = exp_field - bias;
+	}
+}
+
+/*
+* Returns the sign (-1, 0 or 1) of |x| * |y| - |z| for unpacked (see
+* fp_unpack()) finite non-zero values, exactly. The product of two
+* significands is at most 106 bits, so it is compared with 'z' shifted to
+* the same scale as a 128-bit pair.
+*/
+static int fp_compare_unpacked(uint64_t sx, int32_t ex, uint64_t sy, int32_t ey, uint64_t sz, int32_t ez, int is_f64) {
+	int f = is_f64 ? 52 : 23;
+	// The product has its leading bit at bit 2f or 2f + 1, 'z' on the same scale at bit f + k
+	int32_t k = ez - ex - ey + f;
+	if (k > f + 1) {
+		return -1;
+	}
+	if (k < f) {
+		return 1;
+	}
+	uint64_t p_lo;
+	uint64_t p_hi = mul64_to_128(sx, sy, &p_lo);
+	uint64_t z_lo = sz << k;
+	uint64_t z_hi = k == 0 ? 0 : sz >> (64 - k);
+	if (p_hi != z_hi) {
+		return p_hi > z_hi ? 1 : -1;
+	}
+	return p_lo > z_lo ? 1 : p_lo < z_lo ? -1 : 0;
+}
+
+static int fp_compare_product(uint64_t x, uint64_t y, uint64_t z, int is_f64) {
+	uint64_t sx, sy, sz;
+	int32_t ex, ey, ez;
+	fp_unpack(x, is_f64, &sx, &ex);
+	fp_unpack(y, is_f64, &sy, &ey);
+	fp_unpack(z, is_f64, &sz, &ez);
+	return fp_compare_unpacked(sx, ex, sy, ey, sz, ez, is_f64);
+}
+
+// Widens a finite single precision value to double precision, exactly
+static uint64_t fp_widen(uint32_t a) {
+	uint64_t sign = (uint64_t) (a & F32_SIGN) << 32;
+	if ((a & ~F32_SIGN) == 0) {
+		return sign;
+	}
+	uint64_t sig;
+	int32_t exp;
+	fp_unpack(a, 0, &sig, &exp);
+	return sign | ((uint64_t) (exp + 1023) << 52) | ((sig << 29) & ~F64_HIDDEN);
+}
+
+/*
+* Returns the sign of the exact sum 'a' + 'b' minus its rounded value 's',
+* from the error term of Knuth's TwoSum, which the kernels compute exactly.
+*/
+static int fp_sum_error_sign(uint64_t a, uint64_t b, uint64_t s, int is_f64) {
+	uint64_t err;
+	if (is_f64) {
+		uint64_t bb = f64_sub(s, a);
+		err = f64_add(f64_sub(a, f64_sub(s, bb)), f64_sub(b, bb));
+	} else {
+		uint32_t bb = f32_sub(s, a);
+		err = f32_add(f32_sub(a, f32_sub(s, bb)), f32_sub(b, bb));
+	}
+	if (fp_is_zero(err, is_f64)) {
+		return 0;
+	}
+	return (err >> (is_f64 ? 63 : 31)) & 1 ? -1 : 1;
+}
+
+/*
+* Returns whether the exact result of a finite operation is at least
+* 2^(emax + 1) in magnitude, i.e. overflows even when rounding towards
+* zero, which gives the largest finite value rather than infinity.
+*/
+static int fp_exceeds_range(int op, uint64_t a, uint64_t b, uint64_t c, int is_f64) {
+	int f = is_f64 ? 52 : 23;
+	int32_t limit_exp = is_f64 ? 1024 : 128;
+	uint64_t sa, sb;
+	int32_t ea, eb;
+	switch (op) {
+		case FP_OP_ADD:
+		case FP_OP_SUB: {
+			// Compare half the sum with 2^emax; halving is exact unless an operand is too small to matter
+			if (fp_exp_field(a, is_f64) < 2 || fp_exp_field(b, is_f64) < 2) {
+				return 0;
+			}
+			uint64_t one = (uint64_t) 1 << f;
+			uint64_t half_a = a - one;
+			uint64_t half_b = (op == FP_OP_SUB ? b ^ ((uint64_t) 1 << (is_f64 ? 63 : 31)) : b) - one;
+			uint64_t sum = is_f64 ? f64_add(half_a, half_b) : f32_add(half_a, half_b);
+			uint64_t limit = (uint64_t) ((is_f64 ? 1023 : 127) + limit_exp - 1) << f;
+			uint64_t mag = sum & ~((uint64_t) 1 << (is_f64 ? 63 : 31));
+			if (mag != limit) {
+				return mag > limit;
+			}
+			int error = fp_sum_error_sign(half_a, half_b, sum, is_f64);
+			return (sum == mag) ? error >= 0 : error <= 0;
+		}
+		case FP_OP_MUL:
+			if (fp_is_zero(a, is_f64) || fp_is_zero(b, is_f64)) {
+				return 0;
+			}
+			fp_unpack(a, is_f64, &sa, &ea);
+			fp_unpack(b, is_f64, &sb, &eb);
+			return fp_compare_unpacked(sa, ea, sb, eb, (uint64_t) 1 << f, limit_exp, is_f64) >= 0;
+		case FP_OP_DIV:
+			// |a| / |b| >= 2^limit_exp when |b| * 2^limit_exp <= |a|
+			if (fp_is_zero(a, is_f64)) {
+				return 0;
+			}
+			fp_unpack(a, is_f64, &sa, &ea);
+			fp_unpack(b, is_f64, &sb, &eb);
+			return fp_compare_unpacked(sb, eb, (uint64_t) 1 << f, limit_exp, sa, ea, is_f64) <= 0;
+		case FP_OP_FMA: {
+			uint64_t product = f64_mul(fp_widen(a), fp_widen(b));
+			uint64_t c64 = fp_widen(c);
+			uint64_t sum = f64_add(product, c64);
+			uint64_t mag = sum & ~F64_SIGN;
+			uint64_t limit = (uint64_t) (1023 + limit_exp) << 52;
+			if (mag != limit) {
+				return mag > limit;
+			}
+			int error = fp_sum_error_sign(product, c64, sum, 1);
+			return (sum == mag) ? error >= 0 : error <= 0;
+		}
+	}
+	return 0;
+}
+
+/*
+* Returns the flags raised by operation 'op' on finite or infinite
+* operands, none of them NaNs, giving result 'r'. In FZ mode the operands
+* have already been flushed, and a result that was tiny before rounding is
+* zero, which raises UFC alone.
+*/
+static uint32_t fp_exceptions_of(int op, int mode, int is_f64, uint64_t a, uint64_t b, uint64_t c, uint64_t r) {
+	int num_ops = op == FP_OP_SQRT ? 1 : op == FP_OP_FMA ? 3 : 2;
+	uint32_t flushed = (mode & FP_MODE_FZ) ? FPSCR_UFC : FPSCR_UFC | FPSCR_IXC;
+
+	// A NaN from numbers is the default NaN of an invalid operation, such as 0 * inf
+	if (fp_is_nan(r, is_f64)) {
+		return FPSCR_IOC;
+	}
+	if (op == FP_OP_DIV && fp_is_zero(b, is_f64) && !fp_is_inf(a, is_f64)) {
+		return FPSCR_DZC;
+	}
+	int any_inf = fp_is_inf(a, is_f64) || (num_ops > 1 && fp_is_inf(b, is_f64)) || (num_ops > 2 && fp_is_inf(c, is_f64));
+	if (fp_is_inf(r, is_f64)) {
+		return any_inf ? 0 : FPSCR_OFC | FPSCR_IXC;
+	}
+	if (any_inf) {
+		return 0;
+	}
+
+	// Everything is finite: find the sign of the exact result minus 'r', in magnitude
+	int error;
+	switch (op) {
+		case FP_OP_ADD:
+		case FP_OP_SUB: {
+			// A sum that is tiny is exact, so sums only underflow by being flushed
+			uint64_t b_signed = op == FP_OP_SUB ? b ^ (is_f64 ? F64_SIGN : F32_SIGN) : b;
+			error = fp_sum_error_sign(a, b_signed, r, is_f64);
+			if (error != 0 && fp_is_zero(r, is_f64)) {
+				return FPSCR_UFC;
+			}
+			if (error != 0 && fp_is_max_finite(r, is_f64) && fp_exceeds_range(op, a, b, c, is_f64)) {
+				return FPSCR_OFC | FPSCR_IXC;
+			}
+			return error != 0 ? FPSCR_IXC : 0;
+		}
+		case FP_OP_MUL:
+			if (fp_is_zero(a, is_f64) || fp_is_zero(b, is_f64)) {
+				return 0;
+			}
+			if (fp_is_zero(r, is_f64)) {
+				return flushed;
+			}
+			error = fp_compare_product(a, b, r, is_f64);
+			break;
+		case FP_OP_DIV:
+			if (fp_is_zero(a, is_f64)) {
+				return 0;
+			}
+			if (fp_is_zero(r, is_f64)) {
+				return flushed;
+			}
+			// |r| * |b| - |a| has the sign of |r| - |a / b|
+			error = -fp_compare_product(r, b, a, is_f64);
+			break;
+		case FP_OP_SQRT:
+			if (fp_is_zero(a, is_f64)) {
+				return 0;
+			}
+			return fp_compare_product(r, r, a, is_f64) != 0 ? FPSCR_IXC : 0;
+		case FP_OP_FMA: {
+			// The product of two singles is exact as a double, and so is TwoSum's error of adding 'c'
+			uint64_t product = f64_mul(fp_widen(a), fp_widen(b));
+			uint64_t c64 = fp_widen(c);
+			uint64_t sum = f64_add(product, c64);
+			int sum_error = fp_sum_error_sign(product, c64, sum, 1);
+			uint64_t diff = f64_sub(sum, fp_widen(r));
+			int signed_error = fp_is_zero(diff, 1) ? sum_error : (diff >> 63) ? -1 : 1;
+			if (signed_error == 0) {
+				return 0;
+			}
+			if (fp_is_zero(r, 0)) {
+				return flushed;
+			}
+			error = (r >> 31) & 1 ? -signed_error : signed_error;
+			break;
+		}
+		default:
+			return 0;
+	}
+	if (error == 0) {
+		return 0;
+	}
+	// Rounding towards zero turns an overflow into the largest finite value
+	if (error > 0 && fp_is_max_finite(r, is_f64) && fp_exceeds_range(op, a, b, c, is_f64)) {
+		return FPSCR_OFC | FPSCR_IXC;
+	}
+	// Tiny before rounding: a subnormal result, or the smallest normal one rounded up to
+	int tiny = fp_exp_field(r, is_f64) == 0 || (fp_is_min_normal(r, is_f64) && error < 0);
+	return tiny ? FPSCR_UFC | FPSCR_IXC : FPSCR_IXC;
+}
+
+/*
+* Returns the cumulative exception flags raised by the operation 'rec',
+* following the ARM rules: tininess is detected before rounding and, with
+* underflow exceptions untrapped, underflow is only flagged when the result
+* is also inexact. In FZ mode subnormal operands raise IDC and are used as
+* zeros, as the kernels use them.
+*/
+uint32_t fp_exceptions(const struct fp_record* rec) {
+	int is_f64 = (rec->op & FP_OP_F64) != 0;
+	int op = rec->op & FP_OP_KIND;
+	int mode = (rec->op >> FP_OP_MODE_SHIFT) & (NUM_FP_MODES - 1);
+	uint64_t a = rec->a, b = rec->b, c = rec->c;
+	int num_ops = op == FP_OP_SQRT ? 1 : op == FP_OP_FMA ? 3 : 2;
+	uint32_t flags = 0;
+
+	if (mode & FP_MODE_FZ) {
+		if (fp_is_subnormal(a, is_f64)) {
+			a = fp_signed_zero(a, is_f64);
+			flags = FPSCR_IDC;
+		}
+		if (num_ops > 1 && fp_is_subnormal(b, is_f64)) {
+			b = fp_signed_zero(b, is_f64);
+			flags = FPSCR_IDC;
+		}
+		if (num_ops > 2 && fp_is_subnormal(c, is_f64)) {
+			c = fp_signed_zero(c, is_f64);
+			flags = FPSCR_IDC;
+		}
+	}
+	if (op == FP_OP_CMP) {
+		return flags | (fp_is_snan(a, is_f64) || fp_is_snan(b, is_f64) ? FPSCR_IOC : 0);
+	}
+	if (op == FP_OP_CMPE) {
+		return flags | (fp_is_nan(a, is_f64) || fp_is_nan(b, is_f64) ? FPSCR_IOC : 0);
+	}
+	if (fp_is_snan(a, is_f64) || (num_ops > 1 && fp_is_snan(b, is_f64)) || (num_ops > 2 && fp_is_snan(c, is_f64))) {
+		return flags | FPSCR_IOC;
+	}
+	if (fp_is_nan(a, is_f64) || (num_ops > 1 && fp_is_nan(b, is_f64)) || (num_ops > 2 && fp_is_nan(c, is_f64))) {
+		return flags;
+	}
+	return flags | fp_exceptions_of(op, mode, is_f64, a, b, c, rec->r);
+}
+
+/*
+* The exceptions of conversions, which are worked out at once as each
+* only takes a few tests. In FZ mode a subnormal single or double
+* precision operand raises IDC and converts as a zero.
+*/
+
+// Returns whether the finite 'x' times 2^'frac_bits' has bits below the binary point
+static int fp_has_fraction(uint64_t x, int is_f64, int frac_bits) {
+	if (fp_is_zero(x, is_f64)) {
+		return 0;
+	}
+	uint64_t sig;
+	int32_t exp;
+	fp_unpack(x, is_f64, &sig, &exp);
+	int below = (is_f64 ? 52 : 23) - exp - frac_bits;
+	if (below <= 0) {
+		return 0;
+	}
+	return below >= 64 || (sig & (((uint64_t) 1 << below) - 1)) != 0;
+}
+
+/*
+* Returns the flags raised by converting 'a' to fixed point as
+* f32_to_fixed() or f64_to_fixed() do: IOC for a NaN or a value that
+* rounds to outside the range and is saturated, otherwise IXC if it
+* wasn't already an integer.
+*/
+uint32_t fp_to_fixed_exceptions(uint64_t a, int is_f64, int frac_bits, int size, int is_unsigned, int mode) {
+	uint32_t flags = 0;
+	if ((mode & FP_MODE_FZ) && fp_is_subnormal(a, is_f64)) {
+		a = fp_signed_zero(a, is_f64);
+		flags = FPSCR_IDC;
+	}
+	if (fp_is_nan(a, is_f64)) {
+		return flags | FPSCR_IOC;
+	}
+	int rmode = mode & FP_MODE_RMODE;
+	int sign = (a >> (is_f64 ? 63 : 31)) & 1;
+	uint64_t mag = is_f64 ? f64_round_to_int_mag(a, frac_bits, rmode) : f32_round_to_int_mag((uint32_t) a, frac_bits, rmode);
+	uint64_t max_mag = is_unsigned ? (sign ? 0 : ((uint64_t) 1 << size) - 1) : ((uint64_t) 1 << (size - 1)) - !sign;
+	if (mag > max_mag) {
+		return flags | FPSCR_IOC;
+	}
+	return flags | (fp_has_fraction(a, is_f64, frac_bits) ? FPSCR_IXC : 0);
+}
+
+/*
+* Returns the flags raised by converting fixed point 'a' to single
+* precision: it is only inexact with more than 24 significant bits. Every
+* fixed-point number is exact in double precision.
+*/
+uint32_t fp_fixed_to_f32_exceptions(uint32_t a, int size, int is_unsigned) {
+	uint32_t mag = !is_unsigned && (int32_t) a < 0 ? -a : a;
+	if (size == 16 || mag == 0) {
+		return 0;
+	}
+	return (mag >> __builtin_ctz(mag)) >= 0x01000000 ? FPSCR_IXC : 0;
+}
+
+/*
+* Returns the flags raised by rounding the finite double precision 'x' to
+* a narrower format with exponents from 'emin' to 'emax', giving 'r',
+* widened exactly to double precision unless it is infinite ('r_is_inf').
+* With 'flush', results that are tiny before rounding are zeros, which
+* raise UFC alone.
+*/
+static uint32_t fp_narrowing_exceptions(uint64_t x, uint64_t r, int r_is_inf, int32_t emin, int32_t emax, int flush) {
+	uint64_t mag = x & ~F64_SIGN;
+	if (r_is_inf || mag >= (uint64_t) (1023 + emax + 1) << 52) {
+		return FPSCR_OFC | FPSCR_IXC;
+	}
+	if (r == x) {
+		return 0;
+	}
+	if (mag < (uint64_t) (1023 + emin) << 52) {
+		return flush ? FPSCR_UFC : FPSCR_UFC | FPSCR_IXC;
+	}
+	return FPSCR_IXC;
+}
+
+uint32_t fp_f64_to_f32_exceptions(uint64_t a, uint32_t r, int mode) {
+	if ((mode & FP_MODE_FZ) && fp_is_subnormal(a, 1)) {
+		return FPSCR_IDC;
+	}
+	if (f64_is_nan(a)) {
+		return f64_is_snan(a) ? FPSCR_IOC : 0;
+	}
+	if (fp_is_inf(a, 1)) {
+		return 0;
+	}
+	int r_is_inf = fp_is_inf(r, 0);
+	return fp_narrowing_exceptions(a, r_is_inf ? 0 : fp_widen(r), r_is_inf, -126, 127, mode & FP_MODE_FZ);
+}
+
+uint32_t fp_f32_to_f64_exceptions(uint32_t a, int mode) {
+	if ((mode & FP_MODE_FZ) && fp_is_subnormal(a, 0)) {
+		return FPSCR_IDC;
+	}
+	return f32_is_snan(a) ? FPSCR_IOC : 0;
+}
+
+// Half precision results 'h' are never flushed
+uint32_t fp_f32_to_f16_exceptions(uint32_t a, uint32_t h, int mode) {
+	if ((mode & FP_MODE_FZ) && fp_is_subnormal(a, 0)) {
+		return FPSCR_IDC;
+	}
+	if (f32_is_nan(a)) {
+		return f32_is_snan(a) ? FPSCR_IOC : 0;
+	}
+	if (fp_is_inf(a, 0)) {
+		return 0;
+	}
+	int r_is_inf = (h & 0x7FFF) == 0x7C00;
+	return fp_narrowing_exceptions(fp_widen(a), r_is_inf ? 0 : fp_widen(f16_to_f32(h, 0)), r_is_inf, -14, 15, 0);
+}
+
+uint32_t fp_f16_to_f32_exceptions(uint32_t h) {
+	return (h & 0x7C00) == 0x7C00 && (h & 0x03FF) && !(h & 0x0200) ? FPSCR_IOC : 0;
+}
+
+/*
+* Returns whether result 'r' of 'op' shows that the operation can only
+* have raised IXC: it is a normal number too small to be the largest
+* finite value and too large to have underflowed, so no operand was a NaN
+* or infinite and nothing overflowed or was divided by zero. In FZ mode the
+* operands mustn't be subnormal either, unless IDC is already in 'status'.
+*/
+static inline int fp_is_ordinary(uint32_t status, uint32_t op, uint64_t a, uint64_t b, uint64_t c, uint64_t r) {
+	int is_f64 = (op & FP_OP_F64) != 0;
+	int exp_field = fp_exp_field(r, is_f64);
+	if (exp_field < 2 || exp_field >= (is_f64 ? 0x7FE : 0xFE)) {
+		return 0;
+	}
+	if ((op & FP_OP_FZ) && !(status & FPSCR_IDC)) {
+		return !fp_is_subnormal(a, is_f64) && !fp_is_subnormal(b, is_f64) && !fp_is_subnormal(c, is_f64);
+	}
+	return 1;
+}
+
+/*
+* Records an operation's exceptions in 'fpscr' by working them out at once.
+* 'pending' isn't used; it is there so both modes take the same arguments.
+*/
+static inline void fp_note_eager(uint32_t* status, struct fp_record* pending, uint32_t op, uint64_t a, uint64_t b, uint64_t c, uint64_t r) {
+	struct fp_record rec = { op, 0, a, b, c, r };
+	*status |= fp_exceptions(&rec);
+}
+
+/*
+* Records an operation's exceptions lazily. The flags are sticky, so once
+* IXC is set an ordinary result can't change the FPSCR and nothing is done,
+* which after the first inexact operation is almost always the case.
+* Otherwise the operation is kept in 'pending' and its flags are worked out
+* when another one replaces it or when the FPSCR is read (fp_settle()).
+*/
+static inline void fp_note_lazy(uint32_t* status, struct fp_record* pending, uint32_t op, uint64_t a, uint64_t b, uint64_t c, uint64_t r) {
+	if (__builtin_expect((*status & FPSCR_IXC) && fp_is_ordinary(*status, op, a, b, c, r), 1)) {
+		return;
+	}
+	if (pending->op != FP_OP_NONE) {
+		*status |= fp_exceptions(pending);
+	}
+	pending->op = op;
+	pending->a = a;
+	pending->b = b;
+	pending->c = c;
+	pending->r = r;
+}
+
+// Brings 'fpscr' up to date with a pending operation before it is read
+static inline void fp_settle(uint32_t* status, struct fp_record* pending) {
+	if (pending->op != FP_OP_NONE) {
+		*status |= fp_exceptions(pending);
+		pending->op = FP_OP_NONE;
+	}
+}
+
+#ifdef DO_LAZY_FP_EXCEPTIONS
+  #define fp_note fp_note_lazy
+#else
+  #define fp_note fp_note_eager
+#endif
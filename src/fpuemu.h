@@ -1,4 +1,7 @@
 #include <math.h>
+#include <pthread.h>
+#include "softfloat.h"
+#include "fpexc.h"
 
 /* 
 * 64 single precision registers 	= s0 to s63 
@@ -6,7 +9,277 @@
 * This is twice that needed by my test hardware (VFPv3-D16).
 */
 #define NUM_SINGLE_PREC_REGS 64
-int32_t fpu_registers[NUM_SINGLE_PREC_REGS]; 
+
+/*
+* The kernels of one arithmetic mode (see FP_MODE_*), which also record the
+* exceptions they raise. '_cmpe' is the comparison of 'vcmpe', for which
+* quiet NaNs are invalid too.
+*/
+struct fp_kernels {
+	uint32_t (*f32_add)(uint32_t, uint32_t);
+	uint32_t (*f32_sub)(uint32_t, uint32_t);
+	uint32_t (*f32_mul)(uint32_t, uint32_t);
+	uint32_t (*f32_div)(uint32_t, uint32_t);
+	uint32_t (*f32_sqrt)(uint32_t);
+	uint32_t (*f32_mul_add)(uint32_t, uint32_t, uint32_t);
+	uint32_t (*f32_cmp)(uint32_t, uint32_t);
+	uint32_t (*f32_cmpe)(uint32_t, uint32_t);
+	uint64_t (*f64_add)(uint64_t, uint64_t);
+	uint64_t (*f64_sub)(uint64_t, uint64_t);
+	uint64_t (*f64_mul)(uint64_t, uint64_t);
+	uint64_t (*f64_div)(uint64_t, uint64_t);
+	uint64_t (*f64_sqrt)(uint64_t);
+	uint32_t (*f64_cmp)(uint64_t, uint64_t);
+	uint32_t (*f64_cmpe)(uint64_t, uint64_t);
+};
+
+/*
+* The emulated FPU of one thread: its registers, its floating-point
+* status and control register, the last operation whose exceptions
+* haven't been added to the FPSCR yet (see fp_note_lazy()) and the kernels
+* of the FPSCR's mode, which only change when the FPSCR is written. The
+* bank comes first, so the state's address is also the bank's, which the
+* generated code relies on.
+*/
+struct fpu_state {
+	int32_t regs[NUM_SINGLE_PREC_REGS];
+	uint32_t fpscr;
+	struct fp_record pending;
+	const struct fp_kernels* kernels;
+};
+
+/*
+* Each thread has its own FPU state, allocated on its first FP instruction.
+* The pointer to it is in this library's static TLS block ('initial-exec'),
+* which is at the same offset from every thread's TPIDRURO thread pointer,
+* so generated code reaches it with an 'mrc' and an 'ldr' and no locking.
+*/
+__thread struct fpu_state* fpu_state_tls __attribute__((tls_model("initial-exec")));
+uint32_t fpu_state_tls_offset;
+pthread_key_t fpu_state_key;
+
+// Depth of the signal handlers the calling thread is running (see fpu_signal_wrapper())
+__thread int fpu_in_signal __attribute__((tls_model("initial-exec")));
+
+/*
+* Records the exceptions of an operation in the calling thread's FPSCR.
+* Kernels are only called once the thread has a state.
+*/
+#ifdef DO_FP_EXCEPTIONS
+static inline void fpu_note(uint32_t op, uint64_t a, uint64_t b, uint64_t c, uint64_t r) {
+	struct fpu_state* state = fpu_state_tls;
+	fp_note(&state->fpscr, &state->pending, op, a, b, c, r);
+}
+
+/*
+* A comparison can only raise IOC, with a NaN operand, or IDC in FZ mode,
+* so its exceptions are worked out at once when it may have raised them.
+*/
+static inline void fpu_note_compare(uint32_t op, uint64_t a, uint64_t b) {
+	int is_f64 = (op & FP_OP_F64) != 0;
+	if (__builtin_expect(fp_is_nan(a, is_f64) || fp_is_nan(b, is_f64)
+		|| ((op & FP_OP_FZ) && (fp_is_subnormal(a, is_f64) || fp_is_subnormal(b, is_f64))), 0)) {
+		struct fp_record rec = { op, 0, a, b, 0, 0 };
+		fpu_state_tls->fpscr |= fp_exceptions(&rec);
+	}
+}
+#else
+  #define fpu_note(op, a, b, c, r)
+  #define fpu_note_compare(op, a, b)
+#endif
+
+/*
+* Defines the kernel set 'name' for arithmetic mode 'mode'. For a constant
+* mode, the kernels' mode tests and those of the lazy exception checks are
+* resolved at compile time.
+*/
+#define FPU_KERNELS(name, mode) \
+	static uint32_t name##_f32_add(uint32_t a, uint32_t b) { \
+		uint32_t r = f32_add_in(a, b, mode); \
+		fpu_note(FP_OP_ADD | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_sub(uint32_t a, uint32_t b) { \
+		uint32_t r = f32_sub_in(a, b, mode); \
+		fpu_note(FP_OP_SUB | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_mul(uint32_t a, uint32_t b) { \
+		uint32_t r = f32_mul_in(a, b, mode); \
+		fpu_note(FP_OP_MUL | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_div(uint32_t a, uint32_t b) { \
+		uint32_t r = f32_div_in(a, b, mode); \
+		fpu_note(FP_OP_DIV | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_sqrt(uint32_t a) { \
+		uint32_t r = f32_sqrt_in(a, mode); \
+		fpu_note(FP_OP_SQRT | (mode) << FP_OP_MODE_SHIFT, a, 0, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_mul_add(uint32_t c, uint32_t a, uint32_t b) { \
+		uint32_t r = f32_mul_add_in(c, a, b, mode); \
+		fpu_note(FP_OP_FMA | (mode) << FP_OP_MODE_SHIFT, a, b, c, r); \
+		return r; \
+	} \
+	static uint32_t name##_f32_cmp(uint32_t a, uint32_t b) { \
+		fpu_note_compare(FP_OP_CMP | (mode) << FP_OP_MODE_SHIFT, a, b); \
+		return f32_compare_in(a, b, mode); \
+	} \
+	static uint32_t name##_f32_cmpe(uint32_t a, uint32_t b) { \
+		fpu_note_compare(FP_OP_CMPE | (mode) << FP_OP_MODE_SHIFT, a, b); \
+		return f32_compare_in(a, b, mode); \
+	} \
+	static uint64_t name##_f64_add(uint64_t a, uint64_t b) { \
+		uint64_t r = f64_add_in(a, b, mode); \
+		fpu_note(FP_OP_ADD | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint64_t name##_f64_sub(uint64_t a, uint64_t b) { \
+		uint64_t r = f64_sub_in(a, b, mode); \
+		fpu_note(FP_OP_SUB | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint64_t name##_f64_mul(uint64_t a, uint64_t b) { \
+		uint64_t r = f64_mul_in(a, b, mode); \
+		fpu_note(FP_OP_MUL | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint64_t name##_f64_div(uint64_t a, uint64_t b) { \
+		uint64_t r = f64_div_in(a, b, mode); \
+		fpu_note(FP_OP_DIV | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b, 0, r); \
+		return r; \
+	} \
+	static uint64_t name##_f64_sqrt(uint64_t a) { \
+		uint64_t r = f64_sqrt_in(a, mode); \
+		fpu_note(FP_OP_SQRT | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, 0, 0, r); \
+		return r; \
+	} \
+	static uint32_t name##_f64_cmp(uint64_t a, uint64_t b) { \
+		fpu_note_compare(FP_OP_CMP | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b); \
+		return f64_compare_in(a, b, mode); \
+	} \
+	static uint32_t name##_f64_cmpe(uint64_t a, uint64_t b) { \
+		fpu_note_compare(FP_OP_CMPE | FP_OP_F64 | (mode) << FP_OP_MODE_SHIFT, a, b); \
+		return f64_compare_in(a, b, mode); \
+	} \
+	const struct fp_kernels name = { \
+		&name##_f32_add, &name##_f32_sub, &name##_f32_mul, &name##_f32_div, \
+		&name##_f32_sqrt, &name##_f32_mul_add, &name##_f32_cmp, &name##_f32_cmpe, \
+		&name##_f64_add, &name##_f64_sub, &name##_f64_mul, &name##_f64_div, \
+		&name##_f64_sqrt, &name##_f64_cmp, &name##_f64_cmpe, \
+	};
+
+/*
+* Kernels specialised for the modes programs use: the default, the
+* directed rounding modes and RunFast. The other combinations of FZ, DN
+* and rounding share a set that reads the mode from the FPSCR every time.
+*/
+FPU_KERNELS(fp_kernels_nearest, ROUND_NEAREST)
+FPU_KERNELS(fp_kernels_plus_inf, ROUND_PLUS_INF)
+FPU_KERNELS(fp_kernels_minus_inf, ROUND_MINUS_INF)
+FPU_KERNELS(fp_kernels_zero, ROUND_ZERO)
+FPU_KERNELS(fp_kernels_runfast, FP_MODE_RUNFAST)
+FPU_KERNELS(fp_kernels_any, (int) (fpu_state_tls->fpscr >> FP_MODE_SHIFT) & (NUM_FP_MODES - 1))
+
+// The kernel set of each mode
+const struct fp_kernels* fp_kernel_sets[NUM_FP_MODES] = {
+	[0 ... NUM_FP_MODES - 1] = &fp_kernels_any,
+	[ROUND_NEAREST] = &fp_kernels_nearest,
+	[ROUND_PLUS_INF] = &fp_kernels_plus_inf,
+	[ROUND_MINUS_INF] = &fp_kernels_minus_inf,
+	[ROUND_ZERO] = &fp_kernels_zero,
+	[FP_MODE_RUNFAST] = &fp_kernels_runfast,
+};
+
+// Frees the state of a thread that is exiting
+void fpu_state_free(void* state) {
+	fpu_state_tls = NULL;
+	munmap(state, sizeof(struct fpu_state));
+}
+
+/*
+* Allocates the calling thread's FPU state, with every register zero, and
+* returns it. Called by the emulation routines and by generated code when
+* a thread hasn't got one yet. A signal handler's FP instruction may be
+* the thread's first; if one of those allocates a state while this runs,
+* its state is kept.
+* The state is registered with 'fpu_state_key' so that it is freed when the
+* thread exits, but pthread_setspecific() isn't async-signal-safe, so a
+* state allocated inside a handler isn't: fpu_signal_wrapper() frees it
+* when the handler returns. Handlers installed without going through
+* 'sigaction' or 'signal' (e.g. by a raw system call) aren't wrapped, and
+* their thread's first FP instruction still calls pthread_setspecific().
+*/
+struct fpu_state* fpu_state_alloc(void) {
+	struct fpu_state* state = mmap(NULL, sizeof(struct fpu_state), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED) {
+		printfdbg("ERROR: couldn't allocate FPU state\n");
+		abort();
+	}
+	if (fpu_state_tls != NULL) {
+		munmap(state, sizeof(struct fpu_state));
+		return fpu_state_tls;
+	}
+	state->kernels = fp_kernel_sets[0];
+	fpu_state_tls = state;
+	if (fpu_in_signal == 0) {
+		pthread_setspecific(fpu_state_key, state);
+	}
+	printfdbg("FPU state allocated at %p\n", state);
+	return state;
+}
+
+// Returns the calling thread's FPU state, allocating it if needed
+static inline struct fpu_state* fpu_state(void) {
+	struct fpu_state* state = fpu_state_tls;
+	if (__builtin_expect(state == NULL, 0)) {
+		state = fpu_state_alloc();
+	}
+	return state;
+}
+
+/*
+* The calling thread's bank and FPSCR. They are used like variables by the
+* emulation routines, which don't have to know the state is per-thread.
+*/
+#define fpu_registers (fpu_state()->regs)
+#define fpscr (fpu_state()->fpscr)
+
+// The kernels of the calling thread's FPSCR mode
+#define fpu_kernels (fpu_state()->kernels)
+
+// Brings the calling thread's FPSCR up to date, before it is read
+static inline void fpu_settle(void) {
+	#ifdef DO_FP_EXCEPTIONS
+	fp_settle(&fpscr, &fpu_state()->pending);
+	#endif
+}
+
+/*
+* Writes the calling thread's FPSCR, switching to the kernels of its mode.
+* The exceptions of a pending operation are overwritten with the flags.
+*/
+void fpu_set_fpscr(uint32_t value) {
+	fpscr = value;
+	fpu_state()->pending.op = FP_OP_NONE;
+	fpu_kernels = fp_kernel_sets[(value >> FP_MODE_SHIFT) & (NUM_FP_MODES - 1)];
+}
+
+// The current mode's binary kernels, for tables of kernels called from C
+uint32_t fpu_f32_add(uint32_t a, uint32_t b) {
+	return fpu_kernels->f32_add(a, b);
+}
+
+uint32_t fpu_f32_sub(uint32_t a, uint32_t b) {
+	return fpu_kernels->f32_sub(a, b);
+}
+
+uint32_t fpu_f32_mul(uint32_t a, uint32_t b) {
+	return fpu_kernels->f32_mul(a, b);
+}
 
 /*
 * Converts a single precision register number, 
@@ -18,6 +291,15 @@ int32_t* sreg_to_bank_ptr(arm_reg reg) {
 	return (int32_t*)fpu_registers + (reg - ARM_REG_S0);
 }
 
+/*
+* Converts a single precision register, such as ARM_REG_S5, to its index
+* in 'fpu_registers'. Used at rewrite time so that emulation routines
+* never have to validate or translate register names themselves.
+*/
+uint8_t sreg_to_bank_index(arm_reg reg) {
+	return (uint8_t) (sreg_to_bank_ptr(reg) - fpu_registers);
+}
+
 // Sets a emulated floating-point register to the given 32-bit value
 void set_sreg(arm_reg reg, int32_t val) {
 	*sreg_to_bank_ptr(reg) = val;
@@ -28,9 +310,56 @@ int32_t get_sreg(arm_reg reg) {
 	return *sreg_to_bank_ptr(reg);
 }
 
-// Initialise emulator by setting the emulated registers to zero.
+/*
+* Converts a double precision register, such as ARM_REG_D5, to the index in
+* 'fpu_registers' of its low half. D0-D15 overlap S0-S31 as on hardware
+* (D5 is S10 and S11); D16-D31 only exist as double precision registers,
+* for VFPv3-D32 code.
+*/
+uint8_t dreg_to_bank_index(arm_reg reg) {
+	assert(ARM_REG_D0 <= reg && reg <= ARM_REG_D31);
+	return (uint8_t) ((reg - ARM_REG_D0) * 2);
+}
+
+// Returns the double precision value whose low half is at bank index 'index'
+static inline uint64_t get_dbank(uint8_t index) {
+	return ((uint64_t) (uint32_t) fpu_registers[index + 1] << 32) | (uint32_t) fpu_registers[index];
+}
+
+static inline void set_dbank(uint8_t index, uint64_t val) {
+	fpu_registers[index] = (int32_t) val;
+	fpu_registers[index + 1] = (int32_t) (val >> 32);
+}
+
+/*
+* Pre-decoded operands of one emulated instruction.
+* A descriptor is written into each trampoline when it is generated and
+* its address is the only argument passed to the emulation routine, so
+* the fields hold bank indices rather than Capstone register names.
+*/
+struct emu_desc {
+	uint8_t d;	// destination register (index into 'fpu_registers')
+	uint8_t n;	// first operand register
+	uint8_t m;	// second operand register
+	uint8_t flags;	// the form of a conversion (CVT_*)
+};
+
+// Marks a 'vcmp' against zero in the 'm' field of a descriptor
+#define EMU_ZERO 0xFF
+
+// Forms of conversions
+#define CVT_UNSIGNED 0x1	// from or to an unsigned integer or fixed-point number
+#define CVT_16BIT 0x2	// fixed point held in 16 bits rather than 32
+#define CVT_ROUND_ZERO 0x4	// rounds towards zero rather than in the FPSCR's rounding mode
+#define CVT_TOP 0x8	// the half precision value is in the top half of the register
+
+/*
+* Initialise emulator. Threads' registers start as zero when their states
+* are allocated; this finds where the pointer to them is kept.
+*/
 void emulator_init() {
-	memset(fpu_registers, 0, NUM_SINGLE_PREC_REGS * sizeof(int32_t));
+	pthread_key_create(&fpu_state_key, &fpu_state_free);
+	fpu_state_tls_offset = (uint8_t*) &fpu_state_tls - (uint8_t*) __builtin_thread_pointer();
 }
 
 /*
@@ -38,28 +367,309 @@ void emulator_init() {
 * This is the emulation routine for the 'vadd.f32' instruction and will
 * be called from a 'vadd.f32' trampoline. No C code calls this method as 
 * the machine code in the trampolines are generated at run-time.
+* 'desc' points at the descriptor stored in the calling trampoline.
 */
-void vadd_f32(int32_t Sd, int32_t Sn, int32_t Sm) {
-	float a, b;
-
+void vadd_f32(const struct emu_desc* desc) {
 	/* 
 	* Copy register values into local variables
 	* which are either on the stack or in scratch registers
 	* that are restored by the trampoline after this method returns.
 	*/ 
-	int32_t Sn_val = get_sreg(Sn);
-	int32_t Sm_val = get_sreg(Sm);
-	memcpy(&a, &Sn_val, sizeof(int32_t));
-	memcpy(&b, &Sm_val, sizeof(int32_t));
+	uint32_t Sn_val = fpu_registers[desc->n];
+	uint32_t Sm_val = fpu_registers[desc->m];
 
-	// Perform the addition
-	float c = a + b;  
-	int32_t result;
+	// Perform the addition with the integer kernel rather than host 'float',
+	// which on a soft-float build would call libgcc's '__aeabi_fadd'
+	uint32_t result = fpu_kernels->f32_add(Sn_val, Sm_val);
 
 	// Store the result back in a register
-	memcpy(&result, &c, sizeof(int32_t));
-	set_sreg(Sd, result);
+	fpu_registers[desc->d] = result;
 
-	printfdbg("vadd.f32 Sd:%d Sn:%d Sm:%d: %f + %f = %f\n", Sd, Sn, Sm, a, b, c);
+	printfdbg("vadd.f32 Sd:%d Sn:%d Sm:%d: %08x + %08x = %08x\n", desc->d, desc->n, desc->m, Sn_val, Sm_val, result);
 	return;
-}
\ No newline at end of file
+}
+
+/*
+* Emulation routines for the other single precision data-processing
+* instructions, which work like 'vadd_f32'. Single operand instructions
+* use 'd' and 'm'. As on hardware, 'vmla' and its relatives round the
+* product before accumulating, while the VFPv4 'vfma' family rounds once.
+*/
+
+void vsub_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_sub(fpu_registers[desc->n], fpu_registers[desc->m]);
+}
+
+void vmul_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]);
+}
+
+void vnmul_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]) ^ F32_SIGN;
+}
+
+void vdiv_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_div(fpu_registers[desc->n], fpu_registers[desc->m]);
+}
+
+void vsqrt_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_sqrt(fpu_registers[desc->m]);
+}
+
+// 'vabs', 'vneg' and 'vmov' only move bits, even those of a NaN
+void vabs_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_registers[desc->m] & ~F32_SIGN;
+}
+
+void vneg_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_registers[desc->m] ^ F32_SIGN;
+}
+
+void vmov_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_registers[desc->m];
+}
+
+// Sd = Sd + Sn * Sm
+void vmla_f32(const struct emu_desc* desc) {
+	uint32_t product = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]);
+	fpu_registers[desc->d] = fpu_kernels->f32_add(fpu_registers[desc->d], product);
+}
+
+// Sd = Sd - Sn * Sm
+void vmls_f32(const struct emu_desc* desc) {
+	uint32_t product = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]);
+	fpu_registers[desc->d] = fpu_kernels->f32_add(fpu_registers[desc->d], product ^ F32_SIGN);
+}
+
+// Sd = -Sd - Sn * Sm
+void vnmla_f32(const struct emu_desc* desc) {
+	uint32_t product = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]);
+	fpu_registers[desc->d] = fpu_kernels->f32_add(fpu_registers[desc->d] ^ F32_SIGN, product ^ F32_SIGN);
+}
+
+// Sd = -Sd + Sn * Sm
+void vnmls_f32(const struct emu_desc* desc) {
+	uint32_t product = fpu_kernels->f32_mul(fpu_registers[desc->n], fpu_registers[desc->m]);
+	fpu_registers[desc->d] = fpu_kernels->f32_add(fpu_registers[desc->d] ^ F32_SIGN, product);
+}
+
+void vfma_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul_add(fpu_registers[desc->d], fpu_registers[desc->n], fpu_registers[desc->m]);
+}
+
+void vfms_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul_add(fpu_registers[desc->d], fpu_registers[desc->n] ^ F32_SIGN, fpu_registers[desc->m]);
+}
+
+void vfnma_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul_add(fpu_registers[desc->d] ^ F32_SIGN, fpu_registers[desc->n] ^ F32_SIGN, fpu_registers[desc->m]);
+}
+
+void vfnms_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = fpu_kernels->f32_mul_add(fpu_registers[desc->d] ^ F32_SIGN, fpu_registers[desc->n], fpu_registers[desc->m]);
+}
+
+// 'vcmp' and 'vcmpe' set the FPSCR flags; 'vcmpe' also finds quiet NaNs invalid
+void vcmp_f32(const struct emu_desc* desc) {
+	uint32_t m = desc->m == EMU_ZERO ? 0 : fpu_registers[desc->m];
+	fpscr = (fpscr & 0x0FFFFFFF) | fpu_kernels->f32_cmp(fpu_registers[desc->d], m);
+}
+
+void vcmpe_f32(const struct emu_desc* desc) {
+	uint32_t m = desc->m == EMU_ZERO ? 0 : fpu_registers[desc->m];
+	fpscr = (fpscr & 0x0FFFFFFF) | fpu_kernels->f32_cmpe(fpu_registers[desc->d], m);
+}
+
+/*
+* 'vmov' of an immediate keeps the instruction's 8-bit encoded constant in
+* 'n'. These expand it as the VFPExpandImm() pseudocode does: a sign bit,
+* three bits of exponent and four of fraction.
+*/
+static inline uint32_t vfp_expand_imm32(uint8_t imm8) {
+	return ((uint32_t) (imm8 & 0x80) << 24) | ((imm8 & 0x40) ? 0x3E000000 : 0x40000000)
+		| ((uint32_t) (imm8 & 0x3F) << 19);
+}
+
+static inline uint64_t vfp_expand_imm64(uint8_t imm8) {
+	return ((uint64_t) (imm8 & 0x80) << 56) | ((imm8 & 0x40) ? 0x3FC0000000000000ULL : 0x4000000000000000ULL)
+		| ((uint64_t) (imm8 & 0x3F) << 48);
+}
+
+void vmov_imm_f32(const struct emu_desc* desc) {
+	fpu_registers[desc->d] = vfp_expand_imm32(desc->n);
+}
+
+/*
+* Emulation routines for double precision instructions. The descriptor's
+* fields are bank indices of the low halves of the D registers, and each
+* routine computes what its single precision counterpart does.
+*/
+
+void vadd_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_add(get_dbank(desc->n), get_dbank(desc->m)));
+}
+
+void vsub_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_sub(get_dbank(desc->n), get_dbank(desc->m)));
+}
+
+void vmul_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m)));
+}
+
+void vdiv_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_div(get_dbank(desc->n), get_dbank(desc->m)));
+}
+
+void vsqrt_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_sqrt(get_dbank(desc->m)));
+}
+
+void vnmul_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m)) ^ F64_SIGN);
+}
+
+void vabs_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, get_dbank(desc->m) & ~F64_SIGN);
+}
+
+void vneg_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, get_dbank(desc->m) ^ F64_SIGN);
+}
+
+void vmov_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, get_dbank(desc->m));
+}
+
+void vmov_imm_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, vfp_expand_imm64(desc->n));
+}
+
+void vmla_f64(const struct emu_desc* desc) {
+	uint64_t product = fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m));
+	set_dbank(desc->d, fpu_kernels->f64_add(get_dbank(desc->d), product));
+}
+
+void vmls_f64(const struct emu_desc* desc) {
+	uint64_t product = fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m));
+	set_dbank(desc->d, fpu_kernels->f64_add(get_dbank(desc->d), product ^ F64_SIGN));
+}
+
+void vnmla_f64(const struct emu_desc* desc) {
+	uint64_t product = fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m));
+	set_dbank(desc->d, fpu_kernels->f64_add(get_dbank(desc->d) ^ F64_SIGN, product ^ F64_SIGN));
+}
+
+void vnmls_f64(const struct emu_desc* desc) {
+	uint64_t product = fpu_kernels->f64_mul(get_dbank(desc->n), get_dbank(desc->m));
+	set_dbank(desc->d, fpu_kernels->f64_add(get_dbank(desc->d) ^ F64_SIGN, product));
+}
+
+void vcmp_f64(const struct emu_desc* desc) {
+	uint64_t m = desc->m == EMU_ZERO ? 0 : get_dbank(desc->m);
+	fpscr = (fpscr & 0x0FFFFFFF) | fpu_kernels->f64_cmp(get_dbank(desc->d), m);
+}
+
+void vcmpe_f64(const struct emu_desc* desc) {
+	uint64_t m = desc->m == EMU_ZERO ? 0 : get_dbank(desc->m);
+	fpscr = (fpscr & 0x0FFFFFFF) | fpu_kernels->f64_cmpe(get_dbank(desc->d), m);
+}
+
+/*
+* Emulation routines for conversions. The FPSCR's mode is read as they run
+* rather than picking a kernel set, and the descriptor's 'flags' (CVT_*)
+* tell their forms apart, with 'n' holding the number of fraction bits of
+* fixed point. Integers are fixed point without fraction bits, and the
+* fixed-point forms convert a register in place, so 'd' and 'm' are the
+* same. Their exceptions are worked out at once.
+*/
+#ifdef DO_FP_EXCEPTIONS
+  #define fpu_note_convert(flags) (fpscr |= (flags))
+#else
+  #define fpu_note_convert(flags)
+#endif
+
+// The mode a conversion rounds in: towards zero for 'vcvt' to fixed point, otherwise the FPSCR's
+static inline int cvt_mode(const struct emu_desc* desc) {
+	int mode = (fpscr >> FP_MODE_SHIFT) & (NUM_FP_MODES - 1);
+	return (desc->flags & CVT_ROUND_ZERO) ? (mode & ~FP_MODE_RMODE) | ROUND_ZERO : mode;
+}
+
+static inline int cvt_size(const struct emu_desc* desc) {
+	return (desc->flags & CVT_16BIT) ? 16 : 32;
+}
+
+void vcvt_f32_to_fixed(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	int is_unsigned = desc->flags & CVT_UNSIGNED;
+	uint32_t a = fpu_registers[desc->m];
+	fpu_registers[desc->d] = f32_to_fixed(a, desc->n, cvt_size(desc), is_unsigned, mode);
+	fpu_note_convert(fp_to_fixed_exceptions(a, 0, desc->n, cvt_size(desc), is_unsigned, mode));
+}
+
+// 'vcvt' of a D register to an integer writes an S register
+void vcvt_f64_to_int(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	int is_unsigned = desc->flags & CVT_UNSIGNED;
+	uint64_t a = get_dbank(desc->m);
+	fpu_registers[desc->d] = f64_to_fixed(a, 0, 32, is_unsigned, mode);
+	fpu_note_convert(fp_to_fixed_exceptions(a, 1, 0, 32, is_unsigned, mode));
+}
+
+// ...but to fixed point, the whole D register, sign or zero extended
+void vcvt_f64_to_fixed(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	int is_unsigned = desc->flags & CVT_UNSIGNED;
+	uint64_t a = get_dbank(desc->m);
+	uint32_t r = f64_to_fixed(a, desc->n, cvt_size(desc), is_unsigned, mode);
+	set_dbank(desc->d, is_unsigned ? (uint64_t) r : (uint64_t) (int64_t) (int32_t) r);
+	fpu_note_convert(fp_to_fixed_exceptions(a, 1, desc->n, cvt_size(desc), is_unsigned, mode));
+}
+
+/*
+* From fixed point, 'm' is an S register or the low half of the D register
+* converted in place, which is at the same bank index.
+*/
+void vcvt_fixed_to_f32(const struct emu_desc* desc) {
+	int is_unsigned = desc->flags & CVT_UNSIGNED;
+	uint32_t a = fpu_registers[desc->m];
+	fpu_registers[desc->d] = fixed_to_f32(a, desc->n, cvt_size(desc), is_unsigned, cvt_mode(desc));
+	fpu_note_convert(fp_fixed_to_f32_exceptions(a, cvt_size(desc), is_unsigned));
+}
+
+void vcvt_fixed_to_f64(const struct emu_desc* desc) {
+	set_dbank(desc->d, fixed_to_f64(fpu_registers[desc->m], desc->n, cvt_size(desc), desc->flags & CVT_UNSIGNED));
+}
+
+void vcvt_f32_to_f64(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	uint32_t a = fpu_registers[desc->m];
+	set_dbank(desc->d, f32_to_f64(a, mode));
+	fpu_note_convert(fp_f32_to_f64_exceptions(a, mode));
+}
+
+void vcvt_f64_to_f32(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	uint64_t a = get_dbank(desc->m);
+	uint32_t r = f64_to_f32(a, mode);
+	fpu_registers[desc->d] = r;
+	fpu_note_convert(fp_f64_to_f32_exceptions(a, r, mode));
+}
+
+// 'vcvtb' and 'vcvtt' use the bottom or the top half of the register with the half precision value
+void vcvt_f16_to_f32(const struct emu_desc* desc) {
+	int shift = (desc->flags & CVT_TOP) ? 16 : 0;
+	uint32_t h = ((uint32_t) fpu_registers[desc->m] >> shift) & 0xFFFF;
+	fpu_registers[desc->d] = f16_to_f32(h, cvt_mode(desc));
+	fpu_note_convert(fp_f16_to_f32_exceptions(h));
+}
+
+// The other half of the destination is left as it was
+void vcvt_f32_to_f16(const struct emu_desc* desc) {
+	int mode = cvt_mode(desc);
+	int shift = (desc->flags & CVT_TOP) ? 16 : 0;
+	uint32_t a = fpu_registers[desc->m];
+	uint32_t h = f32_to_f16(a, mode);
+	fpu_registers[desc->d] = (fpu_registers[desc->d] & ~(0xFFFFu << shift)) | (h << shift);
+	fpu_note_convert(fp_f32_to_f16_exceptions(a, h, mode));
+}
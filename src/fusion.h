@@ -0,0 +1,255 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* fusing runs of FP instructions into a single block trampoline.
+*/
+#define DO_BLOCK_FUSION
+
+/*
+* Limits on the length of a run emulated by one block trampoline.
+* Longer runs are split into several blocks.
+*/
+#define MAX_BLOCK_FP_INSTRS 16
+#define MAX_BLOCK_INSTRS 32
+
+/*
+* Upper bounds on the number of instructions emitted into a block trampoline
+* for entering/leaving the emulation context, for each FP instruction
+* (including any slow path) and for each relocated integer instruction.
+*/
+#define BLOCK_ENTER_WORDS (2 + JIT_LOAD_BANK_WORDS)
+#define BLOCK_LEAVE_WORDS (2 + JIT_NUM_ALLOC_REGS)
+#define BLOCK_FP_WORDS 30
+#define BLOCK_ALU_WORDS (BLOCK_LEAVE_WORDS + 1 + BLOCK_ENTER_WORDS)
+
+/*
+* Integer instructions that can be copied into a block trampoline and
+* executed there unchanged, provided they don't use the PC.
+*/
+unsigned int relocatable_alu_ids[] = {
+	ARM_INS_ADD, ARM_INS_ADC, ARM_INS_SUB, ARM_INS_SBC, ARM_INS_RSB, ARM_INS_RSC,
+	ARM_INS_AND, ARM_INS_ORR, ARM_INS_EOR, ARM_INS_BIC, ARM_INS_MOV, ARM_INS_MVN,
+	ARM_INS_MOVW, ARM_INS_MOVT, ARM_INS_CMP, ARM_INS_CMN, ARM_INS_TST, ARM_INS_TEQ,
+	ARM_INS_LSL, ARM_INS_LSR, ARM_INS_ASR, ARM_INS_ROR, ARM_INS_MUL, ARM_INS_MLA,
+	ARM_INS_MLS, ARM_INS_UBFX, ARM_INS_SBFX, ARM_INS_BFI, ARM_INS_BFC, ARM_INS_UXTB,
+	ARM_INS_UXTH, ARM_INS_SXTB, ARM_INS_SXTH, ARM_INS_CLZ
+};
+
+/*
+* One instruction of a run. 'routine' is NULL for integer instructions
+* that are relocated into the block rather than emulated.
+*/
+struct block_instr {
+	void* addr;
+	uint32_t instr;		// the original instruction
+	void* routine;
+	struct emu_desc desc;
+};
+
+/*
+* Returns whether the instruction at 'instr_addr' is one of 'ids' and
+* doesn't use the PC, so it behaves the same when executed from a trampoline.
+*/
+int is_relocatable(void* instr_addr, unsigned int* ids, int num_ids) {
+	cs_insn* disassembly = disassemble_instr(instr_addr);
+	if (disassembly == NULL) {
+		return 0;
+	}
+
+	int relocatable = 0;
+	for (int i = 0; i < num_ids; i++) {
+		if (disassembly->id == ids[i]) {
+			relocatable = 1;
+			break;
+		}
+	}
+
+	// Anything reading or writing the PC depends on where it is executed
+	cs_arm* arm = &(disassembly->detail->arm);
+	for (int i = 0; relocatable && i < arm->op_count; i++) {
+		cs_arm_op* op = &arm->operands[i];
+		if ((op->type == ARM_OP_REG && op->reg == ARM_REG_PC)
+			|| (op->type == ARM_OP_MEM && (op->mem.base == ARM_REG_PC || op->mem.index == ARM_REG_PC))) {
+			relocatable = 0;
+		}
+	}
+	free(disassembly);
+	return relocatable;
+}
+
+// Returns whether the instruction at 'instr_addr' is a relocatable integer data-processing instruction
+int is_relocatable_alu(void* instr_addr) {
+	return is_relocatable(instr_addr, relocatable_alu_ids, sizeof(relocatable_alu_ids) / sizeof(relocatable_alu_ids[0]));
+}
+
+/*
+* Collects the straight-line run of emulatable FP instructions starting with
+* the FP instruction at 'head', allowing relocatable integer instructions in
+* between. The run stops before 'end' and always ends with an FP instruction.
+* Returns the number of instructions in the run and sets 'num_fp'.
+*/
+int find_fp_run(int8_t* head, int8_t* end, struct block_instr* run, int* num_fp) {
+	int len = 0;
+	int last_fp = 0;
+	*num_fp = 0;
+	for (int8_t* instr = head; instr + 4 <= end && len < MAX_BLOCK_INSTRS && *num_fp < MAX_BLOCK_FP_INSTRS; instr += 4) {
+		run[len].addr = instr;
+		run[len].instr = *(uint32_t*) instr;
+		run[len].routine = decode_fp_instr(instr, &run[len].desc);
+		if (run[len].routine != NULL) {
+			(*num_fp)++;
+			last_fp = len;
+		} else if (!is_relocatable_alu(instr)) {
+			break;
+		}
+		len++;
+	}
+	return last_fp + 1;
+}
+
+/*
+* Saves the guest's registers and flags and sets up the registers the
+* JIT'd fast paths expect. From here until the block is left, emulated
+* registers are cached in core registers as described by 'ra'.
+* Leaving writes them back and restores the guest's registers.
+* Entering returns -1 if the code can't be generated (see jit_emit_call()).
+*/
+int block_emit_enter(struct emitter* e, struct tramp_pool* pool, struct reg_alloc* ra) {
+	emit(e, arm_push(0x5FFF)); // {r0-r12, r14}
+	emit(e, arm_mrs_apsr(JIT_REG_APSR));
+	ra_reset(ra);
+	return jit_emit_load_bank(e, pool, JIT_REG_BANK);
+}
+
+void block_emit_leave(struct emitter* e, struct reg_alloc* ra) {
+	ra_emit_flush(e, ra);
+	ra_reset(ra);
+	emit(e, arm_msr_apsr(JIT_REG_APSR));
+	emit(e, arm_pop(0x5FFF));
+}
+
+/*
+* Emits the emulation of one FP instruction inside a block, as a JIT'd fast
+* path if its routine has a kernel (adding its slow path to 'slow') or as a
+* call to the routine otherwise. 'desc' is the copy in trampoline memory.
+* Routines read and write the bank, so cached registers are written back
+* before calling one and aren't trusted afterwards.
+* An instruction with a condition 'cond' other than AL is always a routine
+* call, skipped if the guest's flags (kept in JIT_REG_APSR) fail the
+* condition. Flushing first leaves the cache in the same state whichever
+* way it goes.
+* Returns -1 if the routine can't be reached.
+*/
+int block_emit_fp_instr(struct emitter* e, struct tramp_pool* pool, void* routine, struct emu_desc* desc, int cond, struct jit_slow_path* slow, int* num_slow, struct reg_alloc* ra) {
+	int kernel = -1;
+	#ifdef DO_JIT
+	kernel = jit_find_kernel(routine);
+	#endif
+	if (cond != COND_AL) {
+		ra_emit_flush(e, ra);
+		ra_reset(ra);
+		emit(e, arm_msr_apsr(JIT_REG_APSR));
+		uint32_t* skip = e->pos;
+		emit(e, 0);
+		emit_addr(e, 0, desc);
+		if (jit_emit_call(e, pool, routine) != 0) {
+			return -1;
+		}
+		patch_branch(skip, e->pos, cond ^ 1);
+	} else if (kernel >= 0) {
+		jit_emit_binop(e, pool, desc, kernel, &slow[*num_slow], ra);
+		slow[*num_slow].desc = desc;
+		slow[*num_slow].routine = routine;
+		slow[*num_slow].resume = e->pos;
+		(*num_slow)++;
+	} else {
+		ra_emit_flush(e, ra);
+		emit_addr(e, 0, desc);
+		if (jit_emit_call(e, pool, routine) != 0) {
+			return -1;
+		}
+		ra_reset(ra);
+	}
+	return 0;
+}
+
+/*
+* Generates one trampoline that emulates a run found by find_fp_run() and
+* returns to just after its last instruction. The run's instructions are
+* taken from 'run', so they may have been overwritten by probes since.
+* Relocated integer instructions run natively between the emulated ones,
+* with the guest's registers restored around them.
+* The descriptors of the run are stored before the code, which starts at
+* the returned address. Returns NULL if there is no space for it or a
+* routine it calls can't be reached from it.
+*/
+void* emit_block_trampoline(struct block_instr* run, int len, int num_fp) {
+	int8_t* head = run[0].addr;
+	int8_t* run_end = (int8_t*) run[len - 1].addr + 4;
+	size_t max_words = BLOCK_ENTER_WORDS + BLOCK_LEAVE_WORDS + JUMP_WORDS
+		+ num_fp * BLOCK_FP_WORDS + (len - num_fp) * BLOCK_ALU_WORDS;
+	size_t descs_size = num_fp * sizeof(struct emu_desc);
+	struct tramp_pool* pool;
+	int8_t* mem = tramp_alloc(head, descs_size + max_words * 4, &pool);
+	if (mem == NULL) {
+		printfdbg("ERROR: no space for block trampoline near instruction %p\n", head);
+		return NULL;
+	}
+	struct emu_desc* descs = (struct emu_desc*) mem;
+	uint32_t* code = (uint32_t*) (mem + descs_size);
+
+	struct emitter e = { code, code };
+	struct jit_slow_path slow[MAX_BLOCK_FP_INSTRS];
+	struct reg_alloc ra;
+	int num_slow = 0;
+	int num_descs = 0;
+	if (block_emit_enter(&e, pool, &ra) != 0) {
+		return NULL;
+	}
+	for (int i = 0; i < len; i++) {
+		if (run[i].routine == NULL) {
+			block_emit_leave(&e, &ra);
+			emit(&e, run[i].instr);
+			if (block_emit_enter(&e, pool, &ra) != 0) {
+				return NULL;
+			}
+			continue;
+		}
+
+		struct emu_desc* desc = &descs[num_descs++];
+		memcpy(desc, &run[i].desc, sizeof(struct emu_desc));
+		if (block_emit_fp_instr(&e, pool, run[i].routine, desc, arm_cond(run[i].instr), slow, &num_slow, &ra) != 0) {
+			return NULL;
+		}
+	}
+	block_emit_leave(&e, &ra);
+	// The pool was only checked to be in range of 'head', so 'run_end' may be out of reach
+	emit_jump(&e, run_end);
+	for (int i = 0; i < num_slow; i++) {
+		if (jit_emit_slow_path(&e, pool, &slow[i]) != 0) {
+			return NULL;
+		}
+	}
+
+	assert(e.pos - e.start <= max_words);
+	__builtin___clear_cache((char*) mem, (char*) e.pos);
+	printfdbg("Block trampoline made at %p for %d instructions (%d FP) at %p-%p\n", code, len, num_fp, head, run_end);
+	stat_inc(STAT_BLOCK_TRAMPS);
+	return code;
+}
+
+/*
+* Generates one trampoline that emulates the whole run of FP instructions
+* starting at 'head' (see emit_block_trampoline()).
+* Sets 'run_end' to just after the run, even when no block is made.
+* Returns NULL if the run has fewer than two FP instructions.
+*/
+void* generate_block_trampoline(int8_t* head, int8_t* end, int8_t** run_end) {
+	struct block_instr run[MAX_BLOCK_INSTRS];
+	int num_fp;
+	int len = find_fp_run(head, end, run, &num_fp);
+	*run_end = (int8_t*) run[len - 1].addr + 4;
+	if (num_fp < 2) {
+		return NULL;
+	}
+	return emit_block_trampoline(run, len, num_fp);
+}
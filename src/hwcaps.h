@@ -0,0 +1,136 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* selective emulation: on a CPU with a VFP unit, only the FP instructions
+* it can't run are instrumented, and the rest run on the hardware.
+* On such a CPU it supersedes everything else: the JIT, blocks, regions,
+* tiering, idioms and softfp elision are all skipped, and the libm
+* replacements forward to libm. It is off by default so that those are
+* used, and measured, on every CPU.
+*/
+//#define DO_SELECTIVE_EMULATION
+
+#include <sys/auxv.h>
+
+struct tramp_frame;
+
+/*
+* The FP features of the CPU, as the kernel reports them in the AT_HWCAP
+* auxiliary vector entry. glibc only defines these names in <bits/hwcap.h>
+* when building for ARM, so they are given here for the other cases.
+*/
+#ifndef HWCAP_ARM_VFP
+#define HWCAP_ARM_VFP (1 << 6)
+#define HWCAP_ARM_NEON (1 << 12)
+#define HWCAP_ARM_VFPv3 (1 << 13)
+#define HWCAP_ARM_VFPv3D16 (1 << 14)
+#define HWCAP_ARM_VFPv4 (1 << 16)
+#define HWCAP_ARM_VFPD32 (1 << 19)
+#endif
+
+/*
+* What an FP instruction needs of the hardware to run on it natively.
+* Half precision conversions are optional in VFPv3 and the kernel has no
+* separate bit for them, so only VFPv4, which always has them, counts.
+*/
+#define FP_FEAT_VFP HWCAP_ARM_VFP	// any VFP instruction
+#define FP_FEAT_VFPV3 HWCAP_ARM_VFPv3	// 'vmov' of an immediate, fixed-point 'vcvt'
+#define FP_FEAT_VFPV4 HWCAP_ARM_VFPv4	// fused multiply-accumulate
+#define FP_FEAT_FP16 HWCAP_ARM_VFPv4	// 'vcvtb' and 'vcvtt'
+#define FP_FEAT_D32 HWCAP_ARM_VFPD32	// D16-D31
+#define FP_FEAT_NEON HWCAP_ARM_NEON	// Advanced SIMD
+
+// The CPU's FP features, read once at startup by fpu_hw_init()
+uint32_t fpu_hw_caps = 0;
+
+void fpu_hw_init() {
+	fpu_hw_caps = (uint32_t) getauxval(AT_HWCAP);
+	printfdbg("HWCAP %08x: VFP %d, VFPv3 %d, VFPv4 %d, D32 %d, NEON %d\n", fpu_hw_caps,
+		(fpu_hw_caps & HWCAP_ARM_VFP) != 0, (fpu_hw_caps & HWCAP_ARM_VFPv3) != 0, (fpu_hw_caps & HWCAP_ARM_VFPv4) != 0,
+		(fpu_hw_caps & HWCAP_ARM_VFPD32) != 0, (fpu_hw_caps & HWCAP_ARM_NEON) != 0);
+}
+
+// Returns whether there is a VFP unit, in which case only what it lacks is emulated
+static inline int fpu_hw_present(void) {
+	return (fpu_hw_caps & HWCAP_ARM_VFP) != 0;
+}
+
+/*
+* Returns the FP_FEAT_* bits the ARM instruction 'instr', disassembled as
+* 'insn', needs. Registers are taken from Capstone's operands, which list
+* every register of a 'vldm' or 'vld1', so any form touching D16-D31 or
+* Q8-Q15 is found. The forms are told apart by their encodings, as the
+* same Capstone IDs are shared between VFP and NEON.
+*/
+uint32_t fp_instr_features(const cs_insn* insn, uint32_t instr) {
+	uint32_t features = FP_FEAT_VFP;
+	cs_arm* arm = &(insn->detail->arm);
+	for (int i = 0; i < arm->op_count; i++) {
+		arm_reg reg = arm->operands[i].reg;
+		if (arm->operands[i].type == ARM_OP_REG
+			&& ((ARM_REG_D16 <= reg && reg <= ARM_REG_D31) || (ARM_REG_Q8 <= reg && reg <= ARM_REG_Q15))) {
+			features |= FP_FEAT_D32;
+		}
+	}
+	if ((instr & 0xFE000000) == 0xF2000000 || (instr & 0xFF100000) == 0xF4000000) {
+		return features | FP_FEAT_NEON;
+	}
+	if (insn->id == ARM_INS_VFMA || insn->id == ARM_INS_VFMS || insn->id == ARM_INS_VFNMA || insn->id == ARM_INS_VFNMS) {
+		features |= FP_FEAT_VFPV4;
+	} else if ((instr & 0x0FBE0F50) == 0x0EB20A40) {
+		features |= FP_FEAT_FP16;
+	} else if ((instr & 0x0FB00EF0) == 0x0EB00A00 || (instr & 0x0FBA0E50) == 0x0EBA0A40) {
+		features |= FP_FEAT_VFPV3;
+	}
+	return features;
+}
+
+/*
+* Moves the hardware's registers and FPSCR into the calling thread's bank
+* and back. With a VFP unit the hardware's registers are the real ones and
+* the bank only holds those it hasn't got, D16-D31 on a VFPv3-D16, so an
+* emulated instruction works on a copy made just before it. This library
+* is built for soft float, so its own code never touches the VFP registers
+* in between. The '.fpu' directives let the assembler accept them anyway.
+*/
+void fpu_hw_load(struct fpu_state* state) {
+	uint32_t value;
+	asm volatile (".fpu vfpv3-d16\n\tvstmia %0, {d0-d15}" : : "r" (state->regs) : "memory");
+	if (fpu_hw_caps & HWCAP_ARM_VFPD32) {
+		asm volatile (".fpu vfpv3\n\tvstmia %0, {d16-d31}" : : "r" (state->regs + 32) : "memory");
+	}
+	asm volatile (".fpu vfpv3-d16\n\tvmrs %0, fpscr" : "=r" (value));
+	fpu_set_fpscr(value);
+}
+
+void fpu_hw_store(struct fpu_state* state) {
+	uint32_t value = fpscr;
+	asm volatile (".fpu vfpv3-d16\n\tvldmia %0, {d0-d15}" : : "r" (state->regs) : "memory");
+	if (fpu_hw_caps & HWCAP_ARM_VFPD32) {
+		asm volatile (".fpu vfpv3\n\tvldmia %0, {d16-d31}" : : "r" (state->regs + 32) : "memory");
+	}
+	asm volatile (".fpu vfpv3-d16\n\tvmsr fpscr, %0" : : "r" (value));
+}
+
+/*
+* The descriptor of a frame trampoline made on a CPU with a VFP unit: the
+* instruction's routine followed by its own descriptor, which fpu_hw_call()
+* passes on to it.
+*/
+struct hw_call {
+	void (*routine)(const void*, struct tramp_frame*);
+	uint32_t desc[];
+};
+
+/*
+* Calls the routine of 'call' on the hardware's registers. Routines that
+* take only a descriptor ignore the frame, which is passed in r1 anyway.
+* The FPSCR is settled first so that the hardware gets the exceptions of
+* the emulated instruction.
+*/
+void fpu_hw_call(const struct hw_call* call, struct tramp_frame* frame) {
+	struct fpu_state* state = fpu_state();
+	fpu_hw_load(state);
+	call->routine(call->desc, frame);
+	fpu_settle();
+	fpu_hw_store(state);
+}
@@ -0,0 +1,323 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* the JIT backend. Without it every probe site gets a template trampoline.
+*/
+#define DO_JIT
+
+/*
+* Integer kernels the JIT can call in place of a generic emulation routine,
+* given by their offset in a 'struct fp_kernels': the generated code calls
+* the one of the thread's current mode. A kernel takes the raw bits of two
+* single precision operands in r0 and r1 and returns the raw bits of the
+* result in r0, without touching the bank.
+*/
+struct jit_kernel {
+	void* routine;
+	int kernel;
+};
+
+struct jit_kernel jit_kernels[] = {
+	{ &vadd_f32, offsetof(struct fp_kernels, f32_add) },
+	{ &vsub_f32, offsetof(struct fp_kernels, f32_sub) },
+	{ &vmul_f32, offsetof(struct fp_kernels, f32_mul) },
+	{ &vdiv_f32, offsetof(struct fp_kernels, f32_div) },
+};
+
+/*
+* Registers used by the generated code. Both are callee-saved so they
+* survive the calls into kernels and emulation routines.
+*/
+int JIT_REG_BANK = 4;
+int JIT_REG_APSR = 5;
+uint16_t JIT_SAVED_REGS = 0x503F; // {r0-r5, r12, lr}
+
+/*
+* Upper bound on the number of instructions in a specialised binary
+* operation trampoline. Its descriptor, used by the slow path, follows the
+* space for the code.
+*/
+#define JIT_BINOP_WORDS 28
+#define JIT_BINOP_SIZE (JIT_BINOP_WORDS * 4 + sizeof(struct emu_desc))
+
+// Returns the offset of the integer kernel for an emulation routine or -1 if there isn't one
+int jit_find_kernel(void* routine) {
+	for (int i = 0; i < sizeof(jit_kernels) / sizeof(jit_kernels[0]); i++) {
+		if (jit_kernels[i].routine == routine) {
+			return jit_kernels[i].kernel;
+		}
+	}
+	return -1;
+}
+
+/*
+* Emits a 'bl' to 'func', going through a veneer in 'pool' if needed.
+* Returns -1, having emitted nothing, if the pool has no room left for the
+* veneer; the code being generated must then be given up.
+*/
+int jit_emit_call(struct emitter* e, struct tramp_pool* pool, void* func) {
+	void* target = pool_call_target(pool, e->pos, func);
+	if (target == NULL) {
+		printfdbg("ERROR: JIT couldn't reach %p from %p\n", func, e->pos);
+		return -1;
+	}
+	emit_branch(e, target, 1);
+	return 0;
+}
+
+// Upper bound on the number of instructions emitted by jit_emit_load_bank()
+#define JIT_LOAD_BANK_WORDS 7
+
+/*
+* Loads the address of the calling thread's bank into 'rd' (one of r4-r11):
+* the thread pointer from TPIDRURO, then the pointer to its FPU state at a
+* fixed offset from it. A thread's first FP instruction finds that NULL and
+* allocates the state, clobbering r0-r3, r12 and lr like any call.
+* The flags are changed, so the guest's must have been saved first.
+* Returns -1 if fpu_state_alloc() can't be reached (see jit_emit_call()).
+*/
+int jit_emit_load_bank(struct emitter* e, struct tramp_pool* pool, int rd) {
+	emit(e, arm_mrc_tpidruro(rd));
+	if (fpu_state_tls_offset < 0x1000) {
+		emit(e, arm_ldr_imm(rd, rd, fpu_state_tls_offset));
+	} else {
+		emit_mov32(e, 0, fpu_state_tls_offset);
+		emit(e, arm_ldr_reg(rd, rd, 0));
+	}
+	emit(e, arm_cmp_imm(rd, 0));
+	if (jit_emit_call(e, pool, &fpu_state_alloc) != 0) {
+		return -1;
+	}
+	e->pos[-1] = with_cond(e->pos[-1], COND_EQ);
+	emit(e, with_cond(arm_mov_reg(rd, 0), COND_EQ));
+	return 0;
+}
+
+/*
+* Core registers that hold emulated FP registers inside blocks, where all of
+* the guest's registers have been saved. They are callee-saved, so values
+* in them survive the calls into kernels and emulation routines.
+*/
+#define JIT_NUM_ALLOC_REGS 6
+int jit_alloc_regs[JIT_NUM_ALLOC_REGS] = { 6, 7, 8, 9, 10, 11 };
+
+/*
+* State of the register allocator at the current point of emission.
+* Each slot is one of 'jit_alloc_regs' and caches the bank entry
+* 'bank_index' (or -1), which is 'dirty' if the bank hasn't got its value yet.
+*/
+struct reg_alloc {
+	int bank_index[JIT_NUM_ALLOC_REGS];
+	int dirty[JIT_NUM_ALLOC_REGS];
+	int last_use[JIT_NUM_ALLOC_REGS];
+	int clock;
+};
+
+// Forgets every cached value, e.g. when the registers are given back to the guest
+void ra_reset(struct reg_alloc* ra) {
+	for (int i = 0; i < JIT_NUM_ALLOC_REGS; i++) {
+		ra->bank_index[i] = -1;
+		ra->dirty[i] = 0;
+		ra->last_use[i] = 0;
+	}
+	ra->clock = 0;
+}
+
+// Returns the slot caching bank entry 'index' or -1
+int ra_find(struct reg_alloc* ra, int index) {
+	for (int i = 0; i < JIT_NUM_ALLOC_REGS; i++) {
+		if (ra->bank_index[i] == index) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Writes every dirty cached value back to the bank
+void ra_emit_flush(struct emitter* e, struct reg_alloc* ra) {
+	for (int i = 0; i < JIT_NUM_ALLOC_REGS; i++) {
+		if (ra->dirty[i]) {
+			emit(e, arm_str_imm(jit_alloc_regs[i], JIT_REG_BANK, ra->bank_index[i] * 4));
+			ra->dirty[i] = 0;
+		}
+	}
+}
+
+/*
+* Returns the slot for bank entry 'index', giving it a free slot or the least
+* recently used one (written back first if dirty) if it isn't cached yet.
+* A newly allocated slot doesn't hold the value; the caller loads or sets it.
+*/
+int ra_alloc(struct emitter* e, struct reg_alloc* ra, int index) {
+	int slot = ra_find(ra, index);
+	if (slot < 0) {
+		slot = 0;
+		for (int i = 0; i < JIT_NUM_ALLOC_REGS; i++) {
+			if (ra->bank_index[i] < 0) {
+				slot = i;
+				break;
+			}
+			if (ra->last_use[i] < ra->last_use[slot]) {
+				slot = i;
+			}
+		}
+		if (ra->dirty[slot]) {
+			emit(e, arm_str_imm(jit_alloc_regs[slot], JIT_REG_BANK, ra->bank_index[slot] * 4));
+		}
+		ra->bank_index[slot] = index;
+		ra->dirty[slot] = 0;
+	}
+	ra->last_use[slot] = ++ra->clock;
+	return slot;
+}
+
+// Copies bank entry 'index' into core register 'rd', caching it if it isn't already
+void ra_emit_read(struct emitter* e, struct reg_alloc* ra, int index, int rd) {
+	int slot = ra_find(ra, index);
+	if (slot < 0) {
+		slot = ra_alloc(e, ra, index);
+		emit(e, arm_ldr_imm(jit_alloc_regs[slot], JIT_REG_BANK, index * 4));
+	} else {
+		ra->last_use[slot] = ++ra->clock;
+	}
+	emit(e, arm_mov_reg(rd, jit_alloc_regs[slot]));
+}
+
+/*
+* A slow path that was branched to but not emitted yet. Slow paths are
+* placed after the end of the fast code so the fast path runs straight through.
+* The generic routine works on the bank, so the slow path writes back the
+* registers that were dirty at the branch and afterwards refreshes the
+* register allocated to the result.
+*/
+struct jit_slow_path {
+	uint32_t* branch;	// conditional branch to patch
+	void* desc;		// descriptor passed to the routine
+	void* routine;		// generic emulation routine
+	uint32_t* resume;	// where to continue afterwards
+	int num_flush;
+	int flush_reg[JIT_NUM_ALLOC_REGS];
+	int flush_index[JIT_NUM_ALLOC_REGS];
+	int reload_reg;		// -1 if the result isn't kept in a register
+	int reload_index;
+};
+
+/*
+* Emits the fast path of one binary operation, which expects the address of
+* the bank in JIT_REG_BANK. The operands are read from the bank at the
+* offsets given by 'desc' (or from the registers caching them if 'ra' is
+* given) and, if neither is zero, subnormal, infinite or NaN, passed to the
+* integer kernel at offset 'kernel' in the thread's kernel set. The result
+* is stored straight back to the bank, or only into its allocated register
+* if 'ra' is given.
+* The branch taken for special values is recorded in 'slow', whose 'desc',
+* 'routine' and 'resume' the caller fills in.
+*/
+void jit_emit_binop(struct emitter* e, struct tramp_pool* pool, struct emu_desc* desc, int kernel, struct jit_slow_path* slow, struct reg_alloc* ra) {
+	int dest_slot = -1;
+	slow->num_flush = 0;
+	slow->reload_reg = -1;
+	if (ra == NULL) {
+		emit(e, arm_ldr_imm(0, JIT_REG_BANK, desc->n * 4));
+		emit(e, arm_ldr_imm(1, JIT_REG_BANK, desc->m * 4));
+	} else {
+		ra_emit_read(e, ra, desc->n, 0);
+		ra_emit_read(e, ra, desc->m, 1);
+		dest_slot = ra_alloc(e, ra, desc->d);
+		for (int i = 0; i < JIT_NUM_ALLOC_REGS; i++) {
+			if (ra->dirty[i]) {
+				slow->flush_reg[slow->num_flush] = jit_alloc_regs[i];
+				slow->flush_index[slow->num_flush] = ra->bank_index[i];
+				slow->num_flush++;
+			}
+		}
+		slow->reload_reg = jit_alloc_regs[dest_slot];
+		slow->reload_index = desc->d;
+	}
+
+	// Take the slow path unless both biased exponents are in 1..254
+	emit(e, arm_ubfx(2, 0, 23, 8));
+	emit(e, arm_ubfx(3, 1, 23, 8));
+	emit(e, arm_sub_imm(2, 2, 1));
+	emit(e, arm_sub_imm(3, 3, 1));
+	emit(e, arm_cmp_imm(2, 254));
+	emit(e, with_cond(arm_cmp_imm(3, 254), COND_LO));
+	slow->branch = e->pos;
+	emit(e, 0);
+
+	emit(e, arm_ldr_imm(12, JIT_REG_BANK, offsetof(struct fpu_state, kernels)));
+	emit(e, arm_ldr_imm(12, 12, kernel));
+	emit(e, arm_blx_reg(12));
+	if (ra == NULL) {
+		emit(e, arm_str_imm(0, JIT_REG_BANK, desc->d * 4));
+	} else {
+		emit(e, arm_mov_reg(jit_alloc_regs[dest_slot], 0));
+		ra->dirty[dest_slot] = 1;
+	}
+}
+
+/*
+* Emits a slow path recorded by jit_emit_binop(): the generic emulation
+* routine is called with the instruction's descriptor, then execution
+* continues in the fast code. Returns -1 if the routine can't be reached.
+*/
+int jit_emit_slow_path(struct emitter* e, struct tramp_pool* pool, struct jit_slow_path* slow) {
+	patch_branch(slow->branch, e->pos, COND_HS);
+	for (int i = 0; i < slow->num_flush; i++) {
+		emit(e, arm_str_imm(slow->flush_reg[i], JIT_REG_BANK, slow->flush_index[i] * 4));
+	}
+	emit_addr(e, 0, slow->desc);
+	if (jit_emit_call(e, pool, slow->routine) != 0) {
+		return -1;
+	}
+	if (slow->reload_reg >= 0) {
+		emit(e, arm_ldr_imm(slow->reload_reg, JIT_REG_BANK, slow->reload_index * 4));
+	}
+	emit_branch(e, slow->resume, 0);
+	return 0;
+}
+
+/*
+* Generates a trampoline specialised for one instruction (see jit_emit_binop()).
+* Only the registers the AAPCS lets a call clobber are saved, plus the
+* flags that the operand checks overwrite.
+* Returns NULL if there is no kernel for 'routine' or the code can't be
+* generated.
+*/
+void* jit_generate_trampoline(void* instr_addr, struct emu_desc* desc, void* routine) {
+	int kernel = jit_find_kernel(routine);
+	if (kernel < 0) {
+		return NULL;
+	}
+
+	struct tramp_pool* pool;
+	uint32_t* tramp = tramp_alloc(instr_addr, JIT_BINOP_SIZE, &pool);
+	if (tramp == NULL) {
+		printfdbg("ERROR: no space for JIT trampoline near instruction %p\n", instr_addr);
+		return NULL;
+	}
+	struct emu_desc* tramp_desc = (struct emu_desc*) (tramp + JIT_BINOP_WORDS);
+	memcpy(tramp_desc, desc, sizeof(struct emu_desc));
+
+	struct emitter e = { tramp, tramp };
+	struct jit_slow_path slow = { .desc = tramp_desc, .routine = routine };
+	emit(&e, arm_push(JIT_SAVED_REGS));
+	emit(&e, arm_mrs_apsr(JIT_REG_APSR));
+	if (jit_emit_load_bank(&e, pool, JIT_REG_BANK) != 0) {
+		return NULL;
+	}
+	jit_emit_binop(&e, pool, desc, kernel, &slow, NULL);
+	slow.resume = e.pos;
+	emit(&e, arm_msr_apsr(JIT_REG_APSR));
+	emit(&e, arm_pop(JIT_SAVED_REGS));
+	tramp_link_return(e.pos, (int8_t*) instr_addr + 4);
+	e.pos++;
+	if (jit_emit_slow_path(&e, pool, &slow) != 0) {
+		return NULL;
+	}
+
+	assert(e.pos - e.start <= JIT_BINOP_WORDS);
+	__builtin___clear_cache((char*) tramp, (char*) tramp + JIT_BINOP_SIZE);
+	printfdbg("JIT trampoline made at %p for instruction at %p\n", tramp, instr_addr);
+	stat_inc(STAT_JIT_TRAMPS);
+	return tramp;
+}
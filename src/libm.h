@@ -0,0 +1,490 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* replacing libm's hottest functions with integer implementations.
+* libm itself is never instrumented (see handle_maps_entry()), so each FP
+* instruction in it traps to the kernel. The functions below take and
+* return floats in core registers, as the soft-float ABI this library is
+* built for passes them, so a program calling them never touches the FPU.
+* As the library is preloaded, the dynamic linker binds every call to
+* them to these definitions instead of libm's.
+*
+* Errors in ULPs against the exact result, measured over all inputs of
+* sqrtf(), a third of those of expf(), a seventh of those of sinf() and
+* cosf() and 2^28 pairs for powf() whose results are in range:
+*	sqrtf	0.5 (correctly rounded)
+*	expf	0.503
+*	sinf	0.501
+*	cosf	0.501
+*	powf	0.503
+* glibc's own bounds are 0.502 (expf), 0.56 (sinf, cosf) and 0.82 (powf).
+* Special cases, errno and the sign of zero follow glibc, but the FPSCR's
+* exception flags are left alone and only round to nearest is supported.
+* With selective emulation on a CPU that has VFP, libm runs natively and is
+* faster than these, so they forward to it (see LIBM_FORWARD()).
+*/
+#define DO_LIBM_REPLACEMENTS
+
+#include <errno.h>
+
+#ifdef DO_LIBM_REPLACEMENTS
+
+typedef float (*libm_unary_t)(float);
+typedef float (*libm_binary_t)(float, float);
+
+/*
+* Calls libm's own version of the function 'name', of type 'type', with
+* the given arguments and returns its result if the CPU has an FPU. libm
+* is found with RTLD_NEXT the first time; without it, the integer version
+* that follows is used after all.
+*/
+#define LIBM_FORWARD(name, type, ...) \
+	if (fpu_hw_present()) { \
+		static type native = NULL; \
+		if (native == NULL) { \
+			native = (type) dlsym(RTLD_NEXT, #name); \
+		} \
+		if (native != NULL) { \
+			return native(__VA_ARGS__); \
+		} \
+	}
+
+static inline uint32_t libm_bits(float x) {
+	uint32_t a;
+	memcpy(&a, &x, sizeof(a));
+	return a;
+}
+
+static inline float libm_float(uint32_t a) {
+	float x;
+	memcpy(&x, &a, sizeof(x));
+	return x;
+}
+
+// Returns the default NaN of an invalid operation
+static inline float libm_invalid(void) {
+	errno = EDOM;
+	return libm_float(F32_DEFAULT_NAN);
+}
+
+// Returns the product of signed Q62 fixed-point values 'a' and 'b', in Q62
+static inline int64_t mul_q62(int64_t a, int64_t b) {
+	uint64_t lo;
+	uint64_t hi = mul64_to_128(a < 0 ? -(uint64_t) a : a, b < 0 ? -(uint64_t) b : b, &lo);
+	uint64_t mag = (hi << 2) | (lo >> 62);
+	return (a < 0) != (b < 0) ? -(int64_t) mag : (int64_t) mag;
+}
+
+/*
+* 2^(j/32) for j = 0-31, in Q31.
+*/
+static const uint32_t exp2_table[32] = {
+	0x80000000, 0x82CD8699, 0x85AAC368, 0x88980E81, 0x8B95C1E4, 0x8EA4398B, 0x91C3D374, 0x94F4EFA9,
+	0x9837F052, 0x9B8D39BA, 0x9EF53261, 0xA2704303, 0xA5FED6AA, 0xA9A15AB5, 0xAD583EEA, 0xB123F582,
+	0xB504F334, 0xB8FBAF47, 0xBD08A39F, 0xC12C4CCA, 0xC5672A11, 0xC9B9BD86, 0xCE248C15, 0xD2A81D92,
+	0xD744FCCB, 0xDBFBB798, 0xE0CCDEEC, 0xE5B906E7, 0xEAC0C6E8, 0xEFE4B99C, 0xF5257D15, 0xFA83B2DB,
+};
+
+#define INVLN2_32_Q25 1549082005	// 32/ln(2)
+#define LN2_32_Q54 0x162E42FEFA39FLL	// ln(2)/32
+#define LN2_Q62 0x2C5C85FDF473DE6BLL
+#define INVLN2_Q62 0x5C551D94AE0BF85ELL	// 1/ln(2)
+
+// Taylor coefficients of (e^r - 1)/r, in Q30
+#define EXP_C1 1073741824
+#define EXP_C2 536870912
+#define EXP_C3 178956971
+#define EXP_C4 44739243
+
+/*
+* Returns the float bits of 2^(k/32) * e^r with sign 'sign', 'r' being in
+* Q54 with |r| a little over ln(2)/64 at most. e^r is a degree 4 polynomial
+* in Q30, good to 2^-33, and results too large or small for a float give
+* infinity or zero.
+*/
+static uint32_t libm_exp_core(int32_t k, int64_t r, uint32_t sign) {
+	int32_t r37 = (int32_t) (r >> 17);
+	int64_t q = EXP_C4;
+	q = EXP_C3 + (((int64_t) r37 * q) >> 37);
+	q = EXP_C2 + (((int64_t) r37 * q) >> 37);
+	q = EXP_C1 + (((int64_t) r37 * q) >> 37);
+	int64_t p = ((int64_t) r37 * q) >> 30;	// e^r - 1 in Q37
+	uint64_t t = exp2_table[k & 31];
+	uint64_t m = (t << 6) + (((int64_t) t * p) >> 31);
+	return f32_norm_round_pack(sign, (k >> 5) + 126, short_shift_right_jam64(m, 7));
+}
+
+/*
+* e^x is 2^(k/32) * e^r with r = x - k*ln(2)/32, where k is the nearest
+* integer to x*32/ln(2). x is exact in Q54 over the range that isn't
+* handled separately, so r is only off by k's rounding of ln(2)/32.
+*/
+float expf(float x) {
+	LIBM_FORWARD(expf, libm_unary_t, x)
+	uint32_t a = libm_bits(x);
+	if (f32_is_nan(a)) {
+		return libm_float(a | F32_QUIET);
+	}
+	if (a == (F32_SIGN | F32_INF)) {
+		return 0.0f;
+	}
+	if (a == F32_INF) {
+		return x;
+	}
+	if (a > 0x42B17217 && !(a & F32_SIGN)) {	// x > 88.72283
+		errno = ERANGE;
+		return libm_float(F32_INF);
+	}
+	if (a > 0xC2CE8ECF) {	// x < -103.27892, where the result may underflow to a subnormal or zero
+		errno = ERANGE;
+		if (a > 0xC2CFF1B4) {	// x < -103.97208
+			return 0.0f;
+		}
+	}
+	if ((a & ~F32_SIGN) < 0x33000000) {	// |x| < 2^-25
+		return 1.0f;
+	}
+	uint64_t m = F32_FRAC(a) | 0x00800000;
+	int64_t xq = (int64_t) (m << (F32_EXP(a) - 96));
+	if (a & F32_SIGN) {
+		xq = -xq;
+	}
+	int32_t k = (int32_t) (((int64_t) (int32_t) (xq >> 30) * INVLN2_32_Q25 + ((int64_t) 1 << 48)) >> 49);
+	return libm_float(libm_exp_core(k, xq - k * LN2_32_Q54, 0));
+}
+
+// Bits of 2/pi after the binary point, 32 at a time
+static const uint32_t two_over_pi[8] = {
+	0xA2F9836E, 0x4E441529, 0xFC2757D1, 0xF534DDC0, 0xDB629599, 0x3C439041, 0xFE5163AB, 0xDEBBC561,
+};
+
+#define PIO2_Q62 0x6487ED5110B4611AULL
+
+/*
+* Reduces |x|, whose bits 'a' are those of a finite float of at least 2^-12,
+* to y in [-pi/4, pi/4] with |x| = n*pi/2 + y, and returns n mod 4.
+* x*2/pi is worked out from a 96-bit window of 2/pi's bits, as in Payne and
+* Hanek's method: the bits before the window only add multiples of 4 and
+* those after it less than 2^-70. |y| is returned as 'y' * 2^-'y_shift',
+* 'y' having its leading bit at bit 61 or 62, and its sign as 'y_neg'.
+*/
+static int libm_rem_pio2(uint32_t a, uint64_t* y, int* y_shift, int* y_neg) {
+	int e = (int) F32_EXP(a) - 150;
+	uint64_t m = F32_FRAC(a) | 0x00800000;
+	int start = e > 2 ? e - 2 : 0;
+	int w = start >> 5, b = start & 31;
+	uint32_t win[3];
+	for (int i = 0; i < 3; i++) {
+		win[i] = b == 0 ? two_over_pi[w + i] : (two_over_pi[w + i] << b) | (two_over_pi[w + i + 1] >> (32 - b));
+	}
+	uint64_t p2 = m * win[2], p1 = m * win[1];
+	uint64_t lo = p2 + (p1 << 32);
+	uint64_t hi = m * win[0] + (p1 >> 32) + (lo < p2);
+
+	// The binary point of x*2/pi is 'shift' bits up the product's high half
+	int shift = 32 + start - e;
+	int n = shift < 64 ? (int) (hi >> shift) & 3 : 0;
+	uint64_t frac = shift < 64 ? (hi << (64 - shift)) | (lo >> shift) : hi >> (shift - 64);
+	*y_neg = 0;
+	if (frac >> 63) {
+		n++;
+		frac = -frac;
+		*y_neg = 1;
+	}
+	if (frac == 0) {
+		*y = 0;
+		*y_shift = 0;
+		return n & 3;
+	}
+	int lz = __builtin_clzll(frac);
+	*y = mul64_to_128(frac << lz, PIO2_Q62, &lo);
+	*y_shift = 62 + lz;
+	return n & 3;
+}
+
+// Taylor coefficients of sin(y)/y - 1 and cos(y) - 1 as polynomials in y^2, in Q62
+static const int64_t sin_coeffs[5] = {
+	-768614336404564651LL, 38430716820228233LL, -915017067148291LL, 12708570377060LL, -115532457973LL,
+};
+static const int64_t cos_coeffs[6] = {
+	-2305843009213693952LL, 192153584101141163LL, -6405119470038039LL, 114377133393536LL, -1270857037706LL,
+	9627704831LL,
+};
+
+// Returns z * (c[0] + z*(c[1] + ...)), all in Q62
+static inline int64_t libm_poly_q62(int64_t z, const int64_t* c, int n) {
+	int64_t q = c[n - 1];
+	for (int i = n - 2; i >= 0; i--) {
+		q = c[i] + mul_q62(z, q);
+	}
+	return mul_q62(z, q);
+}
+
+// Returns y^2 in Q62 for the output of libm_rem_pio2()
+static inline int64_t libm_square_y(uint64_t y, int y_shift) {
+	int64_t y62 = y_shift - 62 < 64 ? (int64_t) (y >> (y_shift - 62)) : 0;
+	return mul_q62(y62, y62);
+}
+
+/*
+* Return the float bits of sin(y) and cos(y) with sign 'sign', y being the
+* output of libm_rem_pio2(). The polynomials are Taylor series in y^2 up
+* to y^11 and y^12, which over |y| <= pi/4 are good to 2^-37.
+*/
+static uint32_t libm_sin_kernel(uint64_t y, int y_shift, uint32_t sign) {
+	if (y == 0) {
+		return sign;
+	}
+	uint64_t s = y + mul_q62((int64_t) y, libm_poly_q62(libm_square_y(y, y_shift), sin_coeffs, 5));
+	int lz = __builtin_clzll(s);
+	return f32_round_pack(sign, 127 - lz - (y_shift - 62), short_shift_right_jam64(s << lz, 33));
+}
+
+static uint32_t libm_cos_kernel(uint64_t y, int y_shift, uint32_t sign) {
+	int64_t z = y == 0 ? 0 : libm_square_y(y, y_shift);
+	uint64_t c = ((int64_t) 1 << 62) + libm_poly_q62(z, cos_coeffs, 6);
+	int lz = __builtin_clzll(c);
+	return f32_round_pack(sign, 127 - lz, short_shift_right_jam64(c << lz, 33));
+}
+
+float sinf(float x) {
+	LIBM_FORWARD(sinf, libm_unary_t, x)
+	uint32_t a = libm_bits(x);
+	uint32_t sign = a & F32_SIGN;
+	if ((a & ~F32_SIGN) < 0x39800000) {	// |x| < 2^-12, where sin(x) rounds to x
+		return x;
+	}
+	if ((a & ~F32_SIGN) >= F32_INF) {
+		return f32_is_nan(a) ? libm_float(a | F32_QUIET) : libm_invalid();
+	}
+	uint64_t y;
+	int y_shift, y_neg;
+	int n = libm_rem_pio2(a & ~F32_SIGN, &y, &y_shift, &y_neg);
+	sign ^= n & 2 ? F32_SIGN : 0;
+	if (n & 1) {
+		return libm_float(libm_cos_kernel(y, y_shift, sign));
+	}
+	return libm_float(libm_sin_kernel(y, y_shift, sign ^ (y_neg ? F32_SIGN : 0)));
+}
+
+float cosf(float x) {
+	LIBM_FORWARD(cosf, libm_unary_t, x)
+	uint32_t a = libm_bits(x);
+	if ((a & ~F32_SIGN) < 0x39800000) {	// |x| < 2^-12, where cos(x) rounds to 1
+		return 1.0f;
+	}
+	if ((a & ~F32_SIGN) >= F32_INF) {
+		return f32_is_nan(a) ? libm_float(a | F32_QUIET) : libm_invalid();
+	}
+	uint64_t y;
+	int y_shift, y_neg;
+	int n = libm_rem_pio2(a & ~F32_SIGN, &y, &y_shift, &y_neg);
+	uint32_t sign = n == 1 || n == 2 ? F32_SIGN : 0;
+	if (n & 1) {
+		return libm_float(libm_sin_kernel(y, y_shift, sign ^ (y_neg ? F32_SIGN : 0)));
+	}
+	return libm_float(libm_cos_kernel(y, y_shift, sign));
+}
+
+// sqrtf() is the emulator's own square root, which is correctly rounded
+float sqrtf(float x) {
+	LIBM_FORWARD(sqrtf, libm_unary_t, x)
+	uint32_t a = libm_bits(x);
+	if (a > F32_SIGN && !f32_is_nan(a)) {
+		return libm_invalid();
+	}
+	return libm_float(f32_sqrt(a));
+}
+
+/*
+* For each of 64 subintervals of [1, 2), split by the top six bits of the
+* fraction: 1/c in Q31 for c near the middle of the subinterval, and
+* -log2 of that 1/c in Q62. Subintervals from 27 up are halved to [0.71, 1)
+* so that the table covers [0.71, 1.42). The two next to 1 have c = 1, so
+* that log2 of an x near 1 isn't the difference of two larger values.
+*/
+struct log2_entry {
+	uint32_t invc;
+	int64_t logc;
+};
+
+static const struct log2_entry log2_table[64] = {
+	{ 0x80000000, 0LL }, { 0x7D119679, 154136389392429074LL },
+	{ 0x7B301ECC, 254945234962267576LL }, { 0x795CEB24, 354249415013286543LL },
+	{ 0x77975B90, 452093185959104326LL }, { 0x75DED953, 548518881684279468LL },
+	{ 0x7432D63E, 643567019790382111LL }, { 0x7292CC15, 737276410238298749LL },
+	{ 0x70FE3C07, 829684235227707326LL }, { 0x6F74AE26, 920826162061876420LL },
+	{ 0x6DF5B0F7, 1010736402971236178LL }, { 0x6C80D902, 1099447801958889761LL },
+	{ 0x6B15C06B, 1186991915773547377LL }, { 0x69B4069B, 1273399060093750873LL },
+	{ 0x685B4FE6, 1358698388063260919LL }, { 0x670B453C, 1442917948643203592LL },
+	{ 0x65C393E0, 1526084740837360200LL }, { 0x6483ED27, 1608224754140239557LL },
+	{ 0x634C0635, 1689363032684410097LL }, { 0x621B97C3, 1769523719530326310LL },
+	{ 0x60F25DEB, 1848730090530448135LL }, { 0x5FD017F4, 1927004600760834747LL },
+	{ 0x5EB48824, 2004368918572988888LL }, { 0x5D9F7391, 2080843975045890677LL },
+	{ 0x5C90A1FD, 2156449977916690711LL }, { 0x5B87DDAD, 2231206455721990310LL },
+	{ 0x5A84F345, 2305132290161295398LL }, { 0xB30F6353, -2233440285536291584LL },
+	{ 0xB11FD3B8, -2161121566415968560LL }, { 0xAF3ADDC7, -2089580485333680864LL },
+	{ 0xAD602B58, -2018800491583529378LL }, { 0xAB8F69E3, -1948765566663518067LL },
+	{ 0xA9C84A48, -1879460184010626171LL }, { 0xA80A80A8, -1810869301844371878LL },
+	{ 0xA655C439, -1742978339479522580LL }, { 0xA4A9CF1E, -1675773157871981993LL },
+	{ 0xA3065E40, -1609240037718558261LL }, { 0xA16B312F, -1543365672422000271LL },
+	{ 0x9FD809FE, -1478137144972896829LL }, { 0x9E4CAD24, -1413541912904863224LL },
+	{ 0x9CC8E161, -1349567799596056899LL }, { 0x9B4C6F9F, -1286202972124458295LL },
+	{ 0x99D722DB, -1223435935893414846LL }, { 0x9868C80A, -1161255516122753008LL },
+	{ 0x97012E02, -1099650846503065048LL }, { 0x95A02568, -1038611368309371584LL },
+	{ 0x94458094, -978126800672636137LL }, { 0x92F11384, -918187147756615510LL },
+	{ 0x91A2B3C5, -858782677280374977LL }, { 0x905A3863, -799903915369946575LL },
+	{ 0x8F1779DA, -741541642273615572LL }, { 0x8DDA5202, -683686872314915007LL },
+	{ 0x8CA29C04, -626330856693172895LL }, { 0x8B70344A, -569465070821073169LL },
+	{ 0x8A42F870, -513081202543378114LL }, { 0x891AC73B, -457171155851405654LL },
+	{ 0x87F78088, -401727030261032838LL }, { 0x86D90544, -346741124477924266LL },
+	{ 0x85BF3761, -292205930280193912LL }, { 0x84A9F9C8, -238114116096823675LL },
+	{ 0x83993052, -184458529895403409LL }, { 0x828CBFBF, -131232195214410108LL },
+	{ 0x81848DA9, -78428293866190713LL }, { 0x80000000, 0LL },
+};
+
+// Taylor coefficients of log(1 + r)/r, in Q62
+static const int64_t log1p_coeffs[6] = {
+	4611686018427387904LL, -2305843009213693952LL, 1537228672809129301LL,
+	-1152921504606846976LL, 922337203685477581LL, -768614336404564651LL,
+};
+
+/*
+* Returns log2 of m * 2^(e - 23), 'm' having its leading bit at bit 23, as
+* the returned value * 2^'l_exp'. Its magnitude has its leading bit at bit
+* 62, unless it is zero. With z = m/2^23 (or m/2^24 from subinterval 27 on)
+* and 1/c from the table, r = z/c - 1 is exact in Q55, |r| <= 1/64, and
+* log2(z) is log2(c) + log(1 + r)/ln(2), the latter by a degree 6
+* polynomial. The result is good to 2^-40 relative to itself, which is what
+* keeps powf()'s y*log2(x) good to 2^-31 right up to the overflow threshold.
+*/
+static int64_t libm_log2(uint32_t m, int32_t e, int* l_exp) {
+	int i = (m >> 17) & 63;
+	uint64_t z = (uint64_t) m << 1;
+	if (i >= 27) {
+		z = m;
+		e++;
+	}
+	int64_t r = (int64_t) (z * log2_table[i].invc) - ((int64_t) 1 << 55);
+	int64_t r62 = r * 128;
+	int64_t q = log1p_coeffs[5];
+	for (int j = 4; j >= 0; j--) {
+		q = log1p_coeffs[j] + mul_q62(r62, q);
+	}
+	int64_t u = mul_q62(q, INVLN2_Q62);
+	uint64_t mag;
+	int shift;
+	if (e == 0 && log2_table[i].logc == 0) {
+		// log2(x) = r*u alone, and r is exact, so all the product's bits are kept
+		if (r == 0) {
+			*l_exp = 0;
+			return 0;
+		}
+		uint64_t lo;
+		uint64_t hi = mul64_to_128(r < 0 ? -(uint64_t) r62 : r62, u, &lo);
+		shift = __builtin_clzll(hi);
+		mag = ((hi << shift) | (shift == 0 ? 0 : lo >> (64 - shift))) >> 1;
+		*l_exp = -59 - shift;
+		return r < 0 ? -(int64_t) mag : (int64_t) mag;
+	}
+	int64_t l = (int64_t) e * ((int64_t) 1 << 54) + ((log2_table[i].logc + mul_q62(r62, u)) >> 8);
+	mag = l < 0 ? -(uint64_t) l : l;
+	shift = __builtin_clzll(mag) - 1;
+	*l_exp = -54 - shift;
+	return l < 0 ? -(int64_t) (mag << shift) : (int64_t) (mag << shift);
+}
+
+/*
+* Returns 0 if the float whose bits are 'b' isn't an integer, 1 if it is
+* odd and 2 if it is even.
+*/
+static inline int libm_checkint(uint32_t b) {
+	int e = F32_EXP(b);
+	if (e < 127) return 0;
+	if (e > 150) return 2;
+	if (b & ((1u << (150 - e)) - 1)) return 0;
+	if (b & (1u << (150 - e))) return 1;
+	return 2;
+}
+
+/*
+* x^y is 2^(y*log2|x|), with the sign of x if y is an odd integer. The
+* exponent is worked out as a 64-bit significand and a binary exponent, so
+* that it keeps its precision whatever its size, and then goes through
+* libm_exp_core() in Q54 as 2^(k/32) * e^(r*ln(2)).
+*/
+float powf(float x, float y) {
+	LIBM_FORWARD(powf, libm_binary_t, x, y)
+	uint32_t a = libm_bits(x), b = libm_bits(y);
+	uint32_t sign = 0;
+	if ((b << 1) == 0) {
+		return f32_is_snan(a) ? libm_float(a | F32_QUIET) : 1.0f;
+	}
+	if (a == 0x3F800000) {
+		return f32_is_snan(b) ? libm_float(b | F32_QUIET) : 1.0f;
+	}
+	if (f32_is_nan(a) || f32_is_nan(b)) {
+		return libm_float(f32_propagate_nan(a, b));
+	}
+	if ((b & ~F32_SIGN) == F32_INF) {
+		if (a == (F32_SIGN | 0x3F800000)) {
+			return 1.0f;
+		}
+		// |x| < 1 to the +infinity, or |x| > 1 to the -infinity
+		return ((a << 1) < 0x7F000000) == !(b & F32_SIGN) ? 0.0f : libm_float(F32_INF);
+	}
+	if ((a << 1) == 0 || (a << 1) == (F32_INF << 1)) {
+		sign = (a & F32_SIGN) && libm_checkint(b) == 1 ? F32_SIGN : 0;
+		if ((a << 1) == 0 && (b & F32_SIGN)) {
+			errno = ERANGE;
+			return libm_float(sign | F32_INF);
+		}
+		return libm_float(sign | (((a << 1) == 0) == !(b & F32_SIGN) ? 0 : F32_INF));
+	}
+	if (a & F32_SIGN) {
+		int yint = libm_checkint(b);
+		if (yint == 0) {
+			return libm_invalid();
+		}
+		sign = yint == 1 ? F32_SIGN : 0;
+	}
+
+	uint32_t m = F32_FRAC(a);
+	int32_t e = F32_EXP(a);
+	if (e == 0) {
+		int shift = __builtin_clz(m) - 8;
+		m <<= shift;
+		e = 1 - shift;
+	} else {
+		m |= 0x00800000;
+	}
+	int l_exp;
+	int64_t l = libm_log2(m, e - 127, &l_exp);
+	if (l == 0) {
+		return libm_float(sign | 0x3F800000);
+	}
+
+	// y*log2|x| = 'zm' * 2^'z_exp'
+	uint64_t y_sig = F32_EXP(b) == 0 ? F32_FRAC(b) : F32_FRAC(b) | 0x00800000;
+	int y_exp = (F32_EXP(b) == 0 ? 1 : (int) F32_EXP(b)) - 150;
+	uint64_t lo;
+	uint64_t zm = mul64_to_128(y_sig << 40, l < 0 ? -(uint64_t) l : l, &lo);
+	int z_exp = y_exp + l_exp + 24;
+	int z_neg = (l < 0) != ((b & F32_SIGN) != 0);
+	if (63 - __builtin_clzll(zm) + z_exp >= 8) {
+		// |y*log2|x|| >= 256: overflow or underflow
+		errno = ERANGE;
+		return libm_float(sign | (z_neg ? 0 : F32_INF));
+	}
+	int shift = z_exp + 54;
+	int64_t z = shift >= 0 ? (int64_t) (zm << shift) : -shift < 64 ? (int64_t) (zm >> -shift) : 0;
+	if (z_neg) {
+		z = -z;
+	}
+	int32_t k = (int32_t) ((z + ((int64_t) 1 << 48)) >> 49);
+	uint32_t result = libm_exp_core(k, mul_q62(z - k * ((int64_t) 1 << 49), LN2_Q62), sign);
+	if ((result << 1) == (F32_INF << 1) || z < -149 * ((int64_t) 1 << 54)) {
+		errno = ERANGE;	// overflow, or a result that may underflow
+	}
+	return libm_float(result);
+}
+#endif
@@ -0,0 +1,232 @@
+/*
+* Emulation of the VFP loads and stores: 'vldr'/'vstr', 'vldm'/'vstm' and
+* 'vpush'/'vpop', and of NEON's 'vld1'/'vst1'. They need the guest's core
+* registers for their addresses, so they are emulated through frame
+* trampolines rather than the template.
+*/
+
+/*
+* Pre-decoded VFP load or store, stored in its trampoline. 'words' 32-bit
+* words are transferred between the bank, starting at index 'first', and
+* memory starting at the value of core register 'base' (a Capstone register
+* name) plus 'offset'. Consecutive registers are consecutive in the bank
+* and in memory, so a transfer is one block copy.
+* For a PC-relative instruction, 'base' is ARM_REG_INVALID and 'offset' is
+* the absolute address, worked out when the instruction is rewritten.
+* If 'writeback' isn't zero it is added to the base register afterwards,
+* as is the value of core register 'index' unless it is ARM_REG_INVALID.
+*/
+struct mem_desc {
+	uint8_t first;
+	uint8_t words;
+	uint8_t base;
+	uint8_t index;
+	int32_t offset;
+	int32_t writeback;
+};
+
+// Returns the address of the first word transferred
+static inline void* mem_desc_addr(const struct mem_desc* desc, struct tramp_frame* frame) {
+	uint32_t base = desc->base == ARM_REG_INVALID ? 0 : frame_get_reg(frame, desc->base);
+	return (void*) (uintptr_t) (base + desc->offset);
+}
+
+// Updates the base register of a multiple transfer with writeback
+static inline void mem_desc_writeback(const struct mem_desc* desc, struct tramp_frame* frame) {
+	if (desc->writeback != 0) {
+		frame_set_reg(frame, desc->base, frame_get_reg(frame, desc->base) + desc->writeback);
+	} else if (desc->index != ARM_REG_INVALID) {
+		frame_set_reg(frame, desc->base, frame_get_reg(frame, desc->base) + frame_get_reg(frame, desc->index));
+	}
+}
+
+// Emulation routine for 'vldr', 'vldm' and 'vpop'
+void vload(const struct mem_desc* desc, struct tramp_frame* frame) {
+	memcpy(&fpu_registers[desc->first], mem_desc_addr(desc, frame), desc->words * 4);
+	mem_desc_writeback(desc, frame);
+}
+
+// Emulation routine for 'vstr', 'vstm' and 'vpush'
+void vstore(const struct mem_desc* desc, struct tramp_frame* frame) {
+	memcpy(mem_desc_addr(desc, frame), &fpu_registers[desc->first], desc->words * 4);
+	mem_desc_writeback(desc, frame);
+}
+
+/*
+* Fills in 'desc' from the 'num' operands 'ops', which must be consecutive
+* S or D registers. Returns 0 if they aren't.
+*/
+int decode_reg_list(cs_arm_op* ops, int num, struct mem_desc* desc) {
+	if (num <= 0) {
+		return 0;
+	}
+	int is_f64 = ops[0].type == ARM_OP_REG && ARM_REG_D0 <= ops[0].reg && ops[0].reg <= ARM_REG_D31;
+	int size = is_f64 ? 2 : 1;
+	for (int i = 0; i < num; i++) {
+		uint8_t index;
+		if (!is_fp_reg_op(&ops[i], is_f64, &index)) {
+			return 0;
+		}
+		if (i == 0) {
+			desc->first = index;
+		} else if (index != desc->first + i * size) {
+			return 0;
+		}
+	}
+	desc->words = num * size;
+	return 1;
+}
+
+#ifdef DO_NEON
+// Returns the Capstone name of core register 'num', which mustn't be the PC
+static arm_reg core_reg_name(int num) {
+	if (num == 13) {
+		return ARM_REG_SP;
+	}
+	return num == 14 ? ARM_REG_LR : ARM_REG_R0 + num;
+}
+
+/*
+* Fills in 'desc' for the NEON 'vld1' or 'vst1' of multiple single elements
+* encoded in 'instr', 1111 0100 0D L0 Rn Vd type size align Rm, and returns
+* its routine, or NULL for the other forms. Memory holds the elements in
+* lane order, so on a little-endian CPU the registers are one block of it
+* whatever the element size. The alignment hint isn't checked.
+* Rm is 15 for no writeback and 13 for adding the size of the transfer.
+*/
+void* decode_vld1_instr(uint32_t instr, struct mem_desc* desc) {
+	static const uint8_t regs_of_type[16] = { [0x7] = 1, [0xA] = 2, [0x6] = 3, [0x2] = 4 };
+	if ((instr & 0xFF900000) != 0xF4000000) {
+		return NULL;
+	}
+	int regs = regs_of_type[(instr >> 8) & 0xF];
+	int d = ((instr >> 18) & 0x10) | ((instr >> 12) & 0xF);
+	int rn = (instr >> 16) & 0xF;
+	int rm = instr & 0xF;
+	// Moving the SP would need a frame trampoline that adjusts it, which 'vpush' and 'vpop' have
+	if (regs == 0 || d + regs > 32 || rn == 15 || (rn == 13 && rm != 15)) {
+		return NULL;
+	}
+	desc->first = d * 2;
+	desc->words = regs * 2;
+	desc->base = core_reg_name(rn);
+	if (rm == 13) {
+		desc->writeback = regs * 8;
+	} else if (rm != 15) {
+		desc->index = core_reg_name(rm);
+	}
+	return ((instr >> 21) & 1) ? (void*) &vload : (void*) &vstore;
+}
+#endif
+
+/*
+* Decodes the VFP load or store whose ARM encoding is at 'instr_addr',
+* filling in 'desc' and setting 'sp_adjust' for generate_frame_trampoline()
+* if it pushes or pops. 'pc' is the value the PC reads as in the
+* instruction: its address plus 8, or plus 4 for Thumb code.
+* Returns its emulation routine, or NULL if it isn't one that is emulated.
+* Offsets and the writeback bit are taken from the encoding, which is
+* simpler than Capstone's view of them.
+*/
+void* decode_mem_instr(void* instr_addr, uint32_t pc, struct mem_desc* desc, int* sp_adjust) {
+	if (((uintptr_t) instr_addr & 3) != 0) {
+		return NULL;
+	}
+	cs_insn* disassembly = disassemble_instr(instr_addr);
+	if (disassembly == NULL) {
+		return NULL;
+	}
+	uint32_t instr = *(uint32_t*) instr_addr;
+	cs_arm* arm = &(disassembly->detail->arm);
+	unsigned int id = disassembly->id;
+	void* routine = NULL;
+	memset(desc, 0, sizeof(struct mem_desc));
+	*sp_adjust = 0;
+
+	if (id == ARM_INS_VLDR || id == ARM_INS_VSTR) {
+		cs_arm_op* mem = &arm->operands[1];
+		if (arm->op_count != 2 || mem->type != ARM_OP_MEM || !decode_reg_list(arm->operands, 1, desc)) {
+			goto out;
+		}
+		int32_t offset = (instr & 0xFF) * 4;
+		if (!(instr & (1 << 23))) {
+			offset = -offset;
+		}
+		if (mem->mem.base == ARM_REG_PC) {
+			// A literal, relative to the word-aligned PC
+			desc->base = ARM_REG_INVALID;
+			desc->offset = (pc & ~3) + offset;
+		} else if ((ARM_REG_R0 <= mem->mem.base && mem->mem.base <= ARM_REG_R12)
+			|| mem->mem.base == ARM_REG_SP || mem->mem.base == ARM_REG_LR) {
+			desc->base = mem->mem.base;
+			desc->offset = offset;
+		} else {
+			goto out;
+		}
+		routine = id == ARM_INS_VLDR ? (void*) &vload : (void*) &vstore;
+	} else if (id == ARM_INS_VPUSH || id == ARM_INS_VPOP) {
+		if (!decode_reg_list(arm->operands, arm->op_count, desc)) {
+			goto out;
+		}
+		desc->base = ARM_REG_SP;
+		*sp_adjust = id == ARM_INS_VPUSH ? -desc->words * 4 : desc->words * 4;
+		routine = id == ARM_INS_VPOP ? (void*) &vload : (void*) &vstore;
+	} else if (id == ARM_INS_VLDMIA || id == ARM_INS_VLDMDB || id == ARM_INS_VSTMIA || id == ARM_INS_VSTMDB) {
+		cs_arm_op* base = &arm->operands[0];
+		if (base->type != ARM_OP_REG || !decode_reg_list(arm->operands + 1, arm->op_count - 1, desc)) {
+			goto out;
+		}
+		int is_db = id == ARM_INS_VLDMDB || id == ARM_INS_VSTMDB;
+		int is_load = id == ARM_INS_VLDMIA || id == ARM_INS_VLDMDB;
+		int writeback = (instr >> 21) & 1;
+		int32_t size = desc->words * 4;
+		desc->base = base->reg;
+		desc->offset = is_db ? -size : 0;
+		if (base->reg == ARM_REG_SP && writeback) {
+			// Only the forms that are 'vpush' and 'vpop' move the SP
+			if (is_db == is_load) {
+				goto out;
+			}
+			desc->offset = 0;
+			*sp_adjust = is_load ? size : -size;
+		} else if ((ARM_REG_R0 <= base->reg && base->reg <= ARM_REG_R12) || base->reg == ARM_REG_LR) {
+			desc->writeback = writeback ? (is_db ? -size : size) : 0;
+		} else if (base->reg != ARM_REG_SP) {
+			goto out;
+		}
+		routine = is_load ? (void*) &vload : (void*) &vstore;
+	}
+	#ifdef DO_NEON
+	if (id == ARM_INS_VLD1 || id == ARM_INS_VST1) {
+		routine = decode_vld1_instr(instr, desc);
+	}
+	#endif
+
+out:
+	if (routine != NULL) {
+		printfdbg("%s %s: %d words at bank index %d\n", disassembly->mnemonic, disassembly->op_str, desc->words, desc->first);
+	}
+	free(disassembly);
+	return routine;
+}
+
+/*
+* If the instruction at 'instr_addr' is a VFP load or store, generates a
+* frame trampoline that emulates it and returns to the next instruction.
+* Returns NULL if it isn't one.
+*/
+void* generate_mem_trampoline(void* instr_addr) {
+	struct mem_desc desc;
+	int sp_adjust;
+	void* routine = decode_mem_instr(instr_addr, (uint32_t) (uintptr_t) instr_addr + 8, &desc, &sp_adjust);
+	if (routine == NULL) {
+		return NULL;
+	}
+	void* code = generate_frame_trampoline(instr_addr, (int8_t*) instr_addr + 4, &desc, sizeof(desc), routine, sp_adjust);
+	if (code == NULL) {
+		return NULL;
+	}
+	printfdbg("Load/store trampoline made at %p for instruction at %p\n", code, instr_addr);
+	stat_inc(STAT_MEM_TRAMPS);
+	return code;
+}
@@ -0,0 +1,310 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* emulating Advanced SIMD (NEON) instructions, for CPUs that have VFP but
+* no NEON.
+*/
+#define DO_NEON
+
+/*
+* Emulation of Advanced SIMD data-processing instructions. A Q register is
+* a pair of D registers, Qn being D2n and D2n+1, so the NEON registers are
+* the VFP bank seen in 128-bit pieces: Qn is bank entries 4n to 4n + 3.
+* Integer lanes are processed SIMD-within-a-register, a 32-bit word of
+* lanes at a time, so that carries don't cross from one lane into the
+* next. Float lanes go through the soft-float kernels of RunFast mode, as
+* NEON always flushes subnormals to zero, uses the default NaN and rounds
+* to nearest whatever the FPSCR says; they still raise exceptions in it.
+* The routines take an 'emu_desc' whose 'flags' (NEON_*) give the number
+* of words and the lane size.
+*/
+#define NEON_SIZE 0x3	// lanes of 8 << size bits
+#define NEON_Q 0x4	// Q registers, four words, rather than D registers, two
+
+static inline int neon_words(const struct emu_desc* desc) {
+	return (desc->flags & NEON_Q) ? 4 : 2;
+}
+
+// Masks of all bits but the top one of every 8, 16 and 32-bit lane
+static const uint32_t swar_low_bits[3] = { 0x7F7F7F7F, 0x7FFF7FFF, 0x7FFFFFFF };
+
+/*
+* Adds or subtracts the lanes of 'a' and 'b' without carries between lanes:
+* the top bit of each lane is left out of the 32-bit operation and put
+* back with an exclusive or.
+*/
+static inline uint32_t swar_add(uint32_t a, uint32_t b, uint32_t low) {
+	return ((a & low) + (b & low)) ^ ((a ^ b) & ~low);
+}
+
+static inline uint32_t swar_sub(uint32_t a, uint32_t b, uint32_t low) {
+	return ((a | ~low) - (b & low)) ^ ((a ^ ~b) & ~low);
+}
+
+// Multiplies the lanes of 'a' and 'b', keeping the low half of each product
+static inline uint32_t swar_mul(uint32_t a, uint32_t b, int size) {
+	if (size == 2) {
+		return a * b;
+	}
+	if (size == 1) {
+		return ((a * b) & 0xFFFF) | (((a >> 16) * (b >> 16)) << 16);
+	}
+	uint32_t r = 0;
+	for (int i = 0; i < 32; i += 8) {
+		r |= (((a >> i) * (b >> i)) & 0xFF) << i;
+	}
+	return r;
+}
+
+// 64-bit lanes are two words of the bank, low word first
+static inline uint64_t neon_get64(uint8_t index) {
+	return (uint32_t) fpu_registers[index] | ((uint64_t) fpu_registers[index + 1] << 32);
+}
+
+static inline void neon_set64(uint8_t index, uint64_t val) {
+	fpu_registers[index] = (int32_t) val;
+	fpu_registers[index + 1] = (int32_t) (val >> 32);
+}
+
+void neon_vadd_i(const struct emu_desc* desc) {
+	int size = desc->flags & NEON_SIZE;
+	if (size == 3) {
+		for (int i = 0; i < neon_words(desc); i += 2) {
+			neon_set64(desc->d + i, neon_get64(desc->n + i) + neon_get64(desc->m + i));
+		}
+		return;
+	}
+	uint32_t low = swar_low_bits[size];
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = swar_add(fpu_registers[desc->n + i], fpu_registers[desc->m + i], low);
+	}
+}
+
+void neon_vsub_i(const struct emu_desc* desc) {
+	int size = desc->flags & NEON_SIZE;
+	if (size == 3) {
+		for (int i = 0; i < neon_words(desc); i += 2) {
+			neon_set64(desc->d + i, neon_get64(desc->n + i) - neon_get64(desc->m + i));
+		}
+		return;
+	}
+	uint32_t low = swar_low_bits[size];
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = swar_sub(fpu_registers[desc->n + i], fpu_registers[desc->m + i], low);
+	}
+}
+
+void neon_vmul_i(const struct emu_desc* desc) {
+	int size = desc->flags & NEON_SIZE;
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = swar_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i], size);
+	}
+}
+
+void neon_vmla_i(const struct emu_desc* desc) {
+	int size = desc->flags & NEON_SIZE;
+	for (int i = 0; i < neon_words(desc); i++) {
+		uint32_t product = swar_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i], size);
+		fpu_registers[desc->d + i] = swar_add(fpu_registers[desc->d + i], product, swar_low_bits[size]);
+	}
+}
+
+void neon_vmls_i(const struct emu_desc* desc) {
+	int size = desc->flags & NEON_SIZE;
+	for (int i = 0; i < neon_words(desc); i++) {
+		uint32_t product = swar_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i], size);
+		fpu_registers[desc->d + i] = swar_sub(fpu_registers[desc->d + i], product, swar_low_bits[size]);
+	}
+}
+
+/*
+* The bitwise operations, on whole words. 'vmov' between registers is
+* 'vorr' with the same two sources. 'vbsl' selects with the destination,
+* 'vbit' and 'vbif' insert where the second source's bits are set or clear.
+*/
+#define NEON_BITWISE(name, expr) \
+	void name(const struct emu_desc* desc) { \
+		for (int i = 0; i < neon_words(desc); i++) { \
+			uint32_t d = fpu_registers[desc->d + i]; \
+			uint32_t n = fpu_registers[desc->n + i]; \
+			uint32_t m = fpu_registers[desc->m + i]; \
+			fpu_registers[desc->d + i] = (expr); \
+		} \
+	}
+
+NEON_BITWISE(neon_vand, n & m)
+NEON_BITWISE(neon_vbic, n & ~m)
+NEON_BITWISE(neon_vorr, n | m)
+NEON_BITWISE(neon_vorn, n | ~m)
+NEON_BITWISE(neon_veor, n ^ m)
+NEON_BITWISE(neon_vbsl, (n & d) | (m & ~d))
+NEON_BITWISE(neon_vbit, (n & m) | (d & ~m))
+NEON_BITWISE(neon_vbif, (d & m) | (n & ~m))
+
+// Float lanes, a word each
+void neon_vadd_f32(const struct emu_desc* desc) {
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = fp_kernels_runfast.f32_add(fpu_registers[desc->n + i], fpu_registers[desc->m + i]);
+	}
+}
+
+void neon_vsub_f32(const struct emu_desc* desc) {
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = fp_kernels_runfast.f32_sub(fpu_registers[desc->n + i], fpu_registers[desc->m + i]);
+	}
+}
+
+void neon_vmul_f32(const struct emu_desc* desc) {
+	for (int i = 0; i < neon_words(desc); i++) {
+		fpu_registers[desc->d + i] = fp_kernels_runfast.f32_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i]);
+	}
+}
+
+// As VFP's, NEON's 'vmla' and 'vmls' round the product before accumulating
+void neon_vmla_f32(const struct emu_desc* desc) {
+	for (int i = 0; i < neon_words(desc); i++) {
+		uint32_t product = fp_kernels_runfast.f32_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i]);
+		fpu_registers[desc->d + i] = fp_kernels_runfast.f32_add(fpu_registers[desc->d + i], product);
+	}
+}
+
+void neon_vmls_f32(const struct emu_desc* desc) {
+	for (int i = 0; i < neon_words(desc); i++) {
+		uint32_t product = fp_kernels_runfast.f32_mul(fpu_registers[desc->n + i], fpu_registers[desc->m + i]);
+		fpu_registers[desc->d + i] = fp_kernels_runfast.f32_sub(fpu_registers[desc->d + i], product);
+	}
+}
+
+/*
+* Expands the 8-bit immediate of a one register and modified immediate
+* instruction as the AdvSIMDExpandImm() pseudocode does, giving the value
+* of each 64-bit half of the destination.
+*/
+static uint64_t neon_expand_imm(int op, int cmode, uint8_t imm8) {
+	uint32_t imm32;
+	switch (cmode >> 1) {
+		case 0: imm32 = imm8; break;
+		case 1: imm32 = (uint32_t) imm8 << 8; break;
+		case 2: imm32 = (uint32_t) imm8 << 16; break;
+		case 3: imm32 = (uint32_t) imm8 << 24; break;
+		case 4: imm32 = imm8 * 0x00010001; break;
+		case 5: imm32 = (imm8 << 8) * 0x00010001; break;
+		case 6: imm32 = (cmode & 1) ? ((uint32_t) imm8 << 16) | 0xFFFF : ((uint32_t) imm8 << 8) | 0xFF; break;
+		default:
+			if (cmode & 1) {
+				imm32 = vfp_expand_imm32(imm8);
+			} else if (!op) {
+				imm32 = imm8 * 0x01010101;
+			} else {
+				// Each bit of the immediate gives a byte of ones or zeros
+				uint64_t imm64 = 0;
+				for (int i = 0; i < 8; i++) {
+					if (imm8 & (1 << i)) {
+						imm64 |= (uint64_t) 0xFF << (i * 8);
+					}
+				}
+				return imm64;
+			}
+	}
+	return imm32 | ((uint64_t) imm32 << 32);
+}
+
+/*
+* 'vmov', 'vmvn', 'vorr' and 'vbic' of an immediate. The descriptor keeps
+* the 8-bit immediate in 'n' and cmode and op (at bit 4) in 'm'.
+* The odd cmodes below 12 are 'vorr' and 'vbic', the others 'vmov' and
+* 'vmvn', except cmode 14 whose op picks the immediate rather than 'vmvn'.
+*/
+void neon_vmov_imm(const struct emu_desc* desc) {
+	int cmode = desc->m & 0xF;
+	int op = desc->m >> 4;
+	uint64_t imm = neon_expand_imm(op, cmode, desc->n);
+	int is_logical = (cmode & 1) && cmode < 12;
+	if (!is_logical && op && cmode != 14) {
+		imm = ~imm;
+	}
+	for (int i = 0; i < neon_words(desc); i += 2) {
+		uint64_t d = neon_get64(desc->d + i);
+		neon_set64(desc->d + i, !is_logical ? imm : op ? d & ~imm : d | imm);
+	}
+}
+
+/*
+* Returns the emulation routine of the Advanced SIMD data-processing
+* instruction encoded in 'instr', filling in 'desc', or NULL if it isn't
+* one that is emulated. The encodings are the ARM ones, from the
+* unconditional space: three registers of the same length are
+* 1111 001U 0D sz Vn Vd opc N Q M o1 Vm, and one register with a modified
+* immediate 1111 001i 1D000 imm3 Vd cmode 0 Q op 1 imm4. In Q forms the
+* register numbers must be even.
+*/
+void* decode_neon_instr(uint32_t instr, struct emu_desc* desc) {
+	int q = (instr >> 6) & 1;
+	desc->d = (((instr >> 18) & 0x10) | ((instr >> 12) & 0xF)) * 2;
+	desc->n = (((instr >> 3) & 0x10) | ((instr >> 16) & 0xF)) * 2;
+	desc->m = (((instr >> 1) & 0x10) | (instr & 0xF)) * 2;
+	desc->flags = q ? NEON_Q : 0;
+
+	if ((instr & 0xFEB80090) == 0xF2800010) {
+		int cmode = (instr >> 8) & 0xF;
+		int op = (instr >> 5) & 1;
+		if ((q && (desc->d & 2)) || (op && cmode == 15)) {
+			return NULL;
+		}
+		desc->n = ((instr >> 17) & 0x80) | ((instr >> 12) & 0x70) | (instr & 0xF);
+		desc->m = cmode | (op << 4);
+		return &neon_vmov_imm;
+	}
+	if ((instr & 0xFE800000) != 0xF2000000 || (q && ((desc->d | desc->n | desc->m) & 2))) {
+		return NULL;
+	}
+	int u = (instr >> 24) & 1;
+	int size = (instr >> 20) & 3;
+	int o1 = (instr >> 4) & 1;
+	desc->flags |= size;
+	switch ((instr >> 8) & 0xF) {
+		case 0x1:
+			if (!o1) {
+				return NULL;
+			}
+			switch (u << 2 | size) {
+				case 0: return &neon_vand;
+				case 1: return &neon_vbic;
+				case 2: return &neon_vorr;
+				case 3: return &neon_vorn;
+				case 4: return &neon_veor;
+				case 5: return &neon_vbsl;
+				case 6: return &neon_vbit;
+				default: return &neon_vbif;
+			}
+		case 0x8:
+			if (o1) {
+				return NULL;
+			}
+			return u ? &neon_vsub_i : &neon_vadd_i;
+		case 0x9:
+			// 'vmul.p8', with o1 and U set, multiplies polynomials
+			if (size == 3 || (o1 && u)) {
+				return NULL;
+			}
+			if (o1) {
+				return &neon_vmul_i;
+			}
+			return u ? &neon_vmls_i : &neon_vmla_i;
+		case 0xD:
+			// sz<0> is the float size, which must be 32 bits; sz<1> picks 'vsub' and 'vmls'
+			if (size & 1) {
+				return NULL;
+			}
+			if (!u && !o1) {
+				return (size & 2) ? &neon_vsub_f32 : &neon_vadd_f32;
+			}
+			if (!u && o1) {
+				return (size & 2) ? &neon_vmls_f32 : &neon_vmla_f32;
+			}
+			if (u && o1 && !(size & 2)) {
+				return &neon_vmul_f32;
+			}
+			return NULL;
+	}
+	return NULL;
+}
@@ -0,0 +1,262 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* replacing common sequences of VFP instructions with a single call to a
+* fused emulation routine (a superinstruction).
+*/
+#define DO_PEEPHOLE
+
+// Longest sequence of instructions a pattern can match
+#define MAX_PATTERN_LEN 5
+
+/*
+* Marks a 'vcmp' against zero in the 'm' field of its operands, which
+* otherwise holds a bank index.
+*/
+#define FUSED_ZERO 0xFF
+
+/*
+* Operands of one instruction of a fused sequence. 'd', 'n' and 'm' are bank
+* indices; for a 'vldr' or 'vstr', 'd' is the register transferred and the
+* address is the value of core register 'base' plus 'offset'.
+*/
+struct fused_op {
+	uint8_t d;
+	uint8_t n;
+	uint8_t m;
+	uint8_t base;
+	int32_t offset;
+};
+
+/*
+* Descriptor of a fused sequence, stored in its trampoline.
+* 'pattern' is the index of the matched pattern in 'fp_patterns'.
+*/
+struct fused_desc {
+	uint8_t pattern;
+	struct fused_op ops[MAX_PATTERN_LEN];
+};
+
+/*
+* A sequence of instructions that is fused, by instruction ID.
+* 'sites' counts the sequences rewritten to use the pattern and, with
+* DO_STATS, 'hits' counts how many times they were executed.
+*/
+struct fp_pattern {
+	const char* name;
+	int len;
+	unsigned int ids[MAX_PATTERN_LEN];
+	void* routine;
+	uint32_t sites;
+	uint32_t hits;
+};
+
+// Patterns, longest first so that a shorter one never hides a longer one starting at the same place
+extern struct fp_pattern fp_patterns[];
+
+#ifdef DO_STATS
+  #define pattern_hit(desc) __atomic_add_fetch(&fp_patterns[(desc)->pattern].hits, 1, __ATOMIC_RELAXED)
+#else
+  #define pattern_hit(desc)
+#endif
+
+void fused_load(const struct fused_op* op, struct tramp_frame* frame) {
+	uint32_t addr = frame_get_reg(frame, op->base) + op->offset;
+	memcpy(&fpu_registers[op->d], (void*) (uintptr_t) addr, sizeof(int32_t));
+}
+
+void fused_store(const struct fused_op* op, struct tramp_frame* frame) {
+	uint32_t addr = frame_get_reg(frame, op->base) + op->offset;
+	memcpy((void*) (uintptr_t) addr, &fpu_registers[op->d], sizeof(int32_t));
+}
+
+void fused_mul(const struct fused_op* op) {
+	fpu_registers[op->d] = fpu_kernels->f32_mul(fpu_registers[op->n], fpu_registers[op->m]);
+}
+
+void fused_add(const struct fused_op* op) {
+	fpu_registers[op->d] = fpu_kernels->f32_add(fpu_registers[op->n], fpu_registers[op->m]);
+}
+
+/*
+* Fused emulation routines, one per pattern. Each performs the instructions
+* of its pattern in order with their own operands, so every register and
+* memory location ends up as if they had been emulated one at a time.
+*/
+
+// vldr; vldr; vmul.f32; vadd.f32; vstr
+void fused_ldr_ldr_mul_add_str(const struct fused_desc* desc, struct tramp_frame* frame) {
+	pattern_hit(desc);
+	fused_load(&desc->ops[0], frame);
+	fused_load(&desc->ops[1], frame);
+	fused_mul(&desc->ops[2]);
+	fused_add(&desc->ops[3]);
+	fused_store(&desc->ops[4], frame);
+}
+
+/*
+* vcmp(e).f32; vmrs APSR_nzcv, fpscr
+* The comparison's flags go straight into the guest's APSR as well as the
+* FPSCR. 'quiet_nan_invalid' selects the comparison of 'vcmpe'.
+*/
+static inline void fused_compare(const struct fused_desc* desc, struct tramp_frame* frame, int quiet_nan_invalid) {
+	pattern_hit(desc);
+	const struct fused_op* op = &desc->ops[0];
+	uint32_t m = op->m == FUSED_ZERO ? 0 : fpu_registers[op->m];
+	const struct fp_kernels* kernels = fpu_kernels;
+	uint32_t flags = quiet_nan_invalid ? kernels->f32_cmpe(fpu_registers[op->d], m) : kernels->f32_cmp(fpu_registers[op->d], m);
+	fpscr = (fpscr & 0x0FFFFFFF) | flags;
+	frame->apsr = (frame->apsr & 0x0FFFFFFF) | flags;
+}
+
+void fused_cmp_mrs(const struct fused_desc* desc, struct tramp_frame* frame) {
+	fused_compare(desc, frame, 0);
+}
+
+void fused_cmpe_mrs(const struct fused_desc* desc, struct tramp_frame* frame) {
+	fused_compare(desc, frame, 1);
+}
+
+// vmul.f32; vadd.f32, i.e. a multiply-accumulate rounded after each step
+void fused_mul_add(const struct fused_desc* desc, struct tramp_frame* frame) {
+	pattern_hit(desc);
+	fused_mul(&desc->ops[0]);
+	fused_add(&desc->ops[1]);
+}
+
+struct fp_pattern fp_patterns[] = {
+	{ "vldr; vldr; vmul; vadd; vstr", 5, { ARM_INS_VLDR, ARM_INS_VLDR, ARM_INS_VMUL, ARM_INS_VADD, ARM_INS_VSTR }, &fused_ldr_ldr_mul_add_str },
+	{ "vcmp; vmrs APSR_nzcv", 2, { ARM_INS_VCMP, ARM_INS_VMRS }, &fused_cmp_mrs },
+	{ "vcmpe; vmrs APSR_nzcv", 2, { ARM_INS_VCMPE, ARM_INS_VMRS }, &fused_cmpe_mrs },
+	{ "vmul; vadd", 2, { ARM_INS_VMUL, ARM_INS_VADD }, &fused_mul_add },
+};
+#define NUM_FP_PATTERNS (sizeof(fp_patterns) / sizeof(fp_patterns[0]))
+
+#ifdef DO_STATS
+  static void print_pattern_stats(void) __attribute__((destructor));
+  static void print_pattern_stats(void) {
+	fprintf(stderr, "arm-fp-emu fused patterns:\n");
+	for (int i = 0; i < NUM_FP_PATTERNS; i++) {
+		fprintf(stderr, "\t%-32s %u sites, %u hits\n", fp_patterns[i].name, fp_patterns[i].sites, fp_patterns[i].hits);
+	}
+  }
+#endif
+
+// Returns whether 'op' is a single precision register, setting 'index' to its bank index
+int fused_sreg(cs_arm_op* op, uint8_t* index) {
+	if (op->type != ARM_OP_REG || op->reg < ARM_REG_S0 || op->reg > ARM_REG_S31) {
+		return 0;
+	}
+	*index = sreg_to_bank_index(op->reg);
+	return 1;
+}
+
+/*
+* Fills in 'op' from one decoded instruction of a pattern.
+* Returns 0 if its operands are of a form the fused routines don't handle:
+* conditional, double precision, PC-relative or with a register offset.
+*/
+int fused_decode_op(cs_insn* insn, struct fused_op* op) {
+	cs_arm* arm = &(insn->detail->arm);
+	if (arm->cc != ARM_CC_AL && arm->cc != ARM_CC_INVALID) {
+		return 0;
+	}
+
+	switch (insn->id) {
+		case ARM_INS_VLDR:
+		case ARM_INS_VSTR: {
+			cs_arm_op* mem = &arm->operands[1];
+			if (arm->op_count != 2 || !fused_sreg(&arm->operands[0], &op->d) || mem->type != ARM_OP_MEM
+				|| mem->mem.index != ARM_REG_INVALID
+				|| !((ARM_REG_R0 <= mem->mem.base && mem->mem.base <= ARM_REG_R12)
+					|| mem->mem.base == ARM_REG_SP || mem->mem.base == ARM_REG_LR)) {
+				return 0;
+			}
+			// Capstone register names all fit in a byte
+			op->base = mem->mem.base;
+			op->offset = mem->mem.disp;
+			return 1;
+		}
+		case ARM_INS_VMUL:
+		case ARM_INS_VADD:
+			return arm->op_count == 3 && fused_sreg(&arm->operands[0], &op->d)
+				&& fused_sreg(&arm->operands[1], &op->n) && fused_sreg(&arm->operands[2], &op->m);
+		case ARM_INS_VCMP:
+		case ARM_INS_VCMPE:
+			if (arm->op_count != 2 || !fused_sreg(&arm->operands[0], &op->d)) {
+				return 0;
+			}
+			if (arm->operands[1].type == ARM_OP_FP || arm->operands[1].type == ARM_OP_IMM) {
+				op->m = FUSED_ZERO;
+				return 1;
+			}
+			return fused_sreg(&arm->operands[1], &op->m);
+		case ARM_INS_VMRS:
+			// Only the flag transfer is fused; reading the FPSCR into a core register isn't
+			return arm->op_count == 2 && arm->operands[0].type == ARM_OP_REG
+				&& arm->operands[0].reg == ARM_REG_APSR_NZCV;
+	}
+	return 0;
+}
+
+/*
+* Tries each pattern against the instructions starting at 'head', stopping
+* before 'end'. Returns the index of the first one that matches and fills
+* in 'desc', or returns -1.
+*/
+int match_pattern(int8_t* head, int8_t* end, struct fused_desc* desc) {
+	cs_insn* window[MAX_PATTERN_LEN];
+	int num_decoded = 0;
+	int match = -1;
+	for (int p = 0; p < NUM_FP_PATTERNS && match < 0; p++) {
+		struct fp_pattern* pattern = &fp_patterns[p];
+		if (head + 4 * pattern->len > end) {
+			continue;
+		}
+		int i;
+		for (i = 0; i < pattern->len; i++) {
+			// The window is only disassembled as far as a pattern needs it
+			if (i == num_decoded) {
+				window[num_decoded] = disassemble_instr(head + 4 * i);
+				if (window[num_decoded] == NULL) {
+					break;
+				}
+				num_decoded++;
+			}
+			if (window[i]->id != pattern->ids[i] || !fused_decode_op(window[i], &desc->ops[i])) {
+				break;
+			}
+		}
+		if (i == pattern->len) {
+			match = p;
+		}
+	}
+	for (int i = 0; i < num_decoded; i++) {
+		free(window[i]);
+	}
+	desc->pattern = match;
+	return match;
+}
+
+/*
+* If a known idiom starts at 'head', generates a trampoline that emulates
+* the whole sequence with one call to its fused routine, passing the
+* descriptor and the saved register frame, and returns to just after it.
+* Sets 'pattern_end' to the end of the sequence.
+* Returns NULL if no pattern matches.
+*/
+void* generate_fused_trampoline(int8_t* head, int8_t* end, int8_t** pattern_end) {
+	struct fused_desc desc;
+	if (((uintptr_t) head & 3) != 0 || match_pattern(head, end, &desc) < 0) {
+		return NULL;
+	}
+	struct fp_pattern* pattern = &fp_patterns[desc.pattern];
+	*pattern_end = head + 4 * pattern->len;
+
+	void* code = generate_frame_trampoline(head, *pattern_end, &desc, sizeof(struct fused_desc), pattern->routine, 0);
+	if (code == NULL) {
+		return NULL;
+	}
+	pattern->sites++;
+	printfdbg("Fused trampoline made at %p for '%s' at %p\n", code, pattern->name, head);
+	return code;
+}
@@ -0,0 +1,207 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* translating whole loops that contain FP instructions into the trampoline pools.
+*/
+#define DO_REGIONS
+
+// Longest loop, in instructions, that is translated as one region
+#define MAX_REGION_INSTRS 256
+
+/*
+* Upper bound on the number of instructions emitted per instruction of a
+* region: leaving a block, entering the next and emulating an FP instruction.
+*/
+#define REGION_INSTR_WORDS (BLOCK_LEAVE_WORDS + BLOCK_ENTER_WORDS + BLOCK_FP_WORDS)
+
+/*
+* Loads and stores that can be copied into a region unchanged, provided
+* they don't use the PC. Together with the relocatable integer instructions
+* these cover the bookkeeping compilers put around FP code in loop bodies.
+*/
+unsigned int relocatable_mem_ids[] = {
+	ARM_INS_LDR, ARM_INS_STR, ARM_INS_LDRB, ARM_INS_STRB, ARM_INS_LDRH, ARM_INS_STRH,
+	ARM_INS_LDRSB, ARM_INS_LDRSH, ARM_INS_LDRD, ARM_INS_STRD, ARM_INS_PUSH, ARM_INS_POP,
+	ARM_INS_LDM, ARM_INS_STM, ARM_INS_LDMDB, ARM_INS_STMDB, ARM_INS_LDMIB, ARM_INS_STMIB,
+	ARM_INS_LDMDA, ARM_INS_STMDA
+};
+
+/*
+* How an instruction of a region is translated: emulated, copied as it is,
+* or a branch re-encoded for its new address.
+*/
+#define REGION_FP 0
+#define REGION_COPY 1
+#define REGION_BRANCH 2
+
+struct region_instr {
+	int kind;
+	void* routine;		// emulation routine of a REGION_FP instruction
+	struct emu_desc desc;	// and its descriptor
+	int is_target;		// whether a branch inside the region goes here
+	uint32_t* xlat;		// start of the translated instruction
+};
+
+/*
+* Works out how the instruction at 'addr' is translated.
+* Returns 0 if it can't be moved into a region at all.
+*/
+int region_classify(void* addr, struct region_instr* ri) {
+	uint32_t instr = *(uint32_t*) addr;
+	ri->is_target = 0;
+	ri->routine = decode_fp_instr(addr, &ri->desc);
+	if (ri->routine != NULL) {
+		ri->kind = REGION_FP;
+	} else if (is_arm_branch(instr)) {
+		ri->kind = REGION_BRANCH;
+	} else if (is_relocatable_alu(addr)
+		|| is_relocatable(addr, relocatable_mem_ids, sizeof(relocatable_mem_ids) / sizeof(relocatable_mem_ids[0]))) {
+		ri->kind = REGION_COPY;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+* If the instruction at 'tail' is the backward branch of a loop whose body
+* contains emulatable FP instructions and can be relocated, translates the
+* loop head..tail into a region of trampoline memory and returns it, setting
+* 'head_out' to where the probe into the region must be inserted.
+* Within a region, consecutive FP instructions are emulated as a block,
+* other instructions are copied, and branches are re-encoded: those inside
+* the loop (including the back edge) go to the translated instructions so
+* that execution stays in the region across iterations, and those leaving
+* it go back to the original code, through a jump placed after the code
+* when they can't reach it. Falling out of the bottom of the loop returns
+* to the instruction after 'tail'.
+* Emulated registers are only cached in core registers within a block: the
+* copied instructions run on the guest's registers, so the cache is written
+* back whenever a block ends, including at the loop's head. What a region
+* saves is going through the probes and back on every iteration, not the
+* bank traffic between iterations.
+* Returns NULL if 'tail' isn't such a branch or the region can't be made,
+* e.g. because its pool has no room for the veneers its routines need.
+*/
+void* translate_loop(int8_t* tail, int8_t* start, int8_t** head_out) {
+	uint32_t tail_instr = *(uint32_t*) tail;
+	if (!is_arm_branch(tail_instr) || is_arm_branch_link(tail_instr)) {
+		return NULL;
+	}
+	int8_t* head = arm_branch_target(tail, tail_instr);
+	int len = (tail - head) / 4 + 1;
+	if (head >= tail || head < start || len > MAX_REGION_INSTRS) {
+		return NULL;
+	}
+	// An unconditional branch at the head is probably the probe of another region
+	uint32_t head_instr = *(uint32_t*) head;
+	if (is_arm_branch(head_instr) && (head_instr >> 28) == COND_AL) {
+		return NULL;
+	}
+
+	struct region_instr instrs[MAX_REGION_INSTRS];
+	int num_fp = 0;
+	for (int i = 0; i < len; i++) {
+		if (!region_classify(head + 4 * i, &instrs[i])) {
+			return NULL;
+		}
+		num_fp += instrs[i].kind == REGION_FP;
+	}
+	if (num_fp == 0) {
+		return NULL;
+	}
+	int num_exits = 0;
+	for (int i = 0; i < len; i++) {
+		int8_t* addr = head + 4 * i;
+		if (instrs[i].kind == REGION_BRANCH) {
+			int8_t* target = arm_branch_target(addr, *(uint32_t*) addr);
+			if (head <= target && target <= tail) {
+				instrs[(target - head) / 4].is_target = 1;
+			} else {
+				num_exits++;
+			}
+		}
+	}
+
+	// The pool is only in range of 'head', so every way out may need a jump
+	size_t max_words = len * REGION_INSTR_WORDS + BLOCK_LEAVE_WORDS + (num_exits + 1) * JUMP_WORDS;
+	size_t descs_size = num_fp * sizeof(struct emu_desc);
+	struct tramp_pool* pool;
+	int8_t* mem = tramp_alloc(head, descs_size + max_words * 4, &pool);
+	if (mem == NULL) {
+		printfdbg("ERROR: no space for region near loop %p-%p\n", head, tail);
+		return NULL;
+	}
+	struct emu_desc* descs = (struct emu_desc*) mem;
+	uint32_t* code = (uint32_t*) (mem + descs_size);
+
+	struct emitter e = { code, code };
+	struct jit_slow_path* slow = malloc(num_fp * sizeof(struct jit_slow_path));
+	struct reg_alloc ra;
+	int num_slow = 0;
+	int num_descs = 0;
+	int in_block = 0;
+	for (int i = 0; i < len; i++) {
+		struct region_instr* ri = &instrs[i];
+		// Blocks are split at branch targets so that every instruction has an entry point
+		// with the guest's registers in place, which flushes the cache on the back edge
+		if (in_block && (ri->kind != REGION_FP || ri->is_target)) {
+			block_emit_leave(&e, &ra);
+			in_block = 0;
+		}
+		ri->xlat = e.pos;
+		if (ri->kind == REGION_FP) {
+			if (!in_block) {
+				if (block_emit_enter(&e, pool, &ra) != 0) {
+					free(slow);
+					return NULL;
+				}
+				in_block = 1;
+			}
+			struct emu_desc* desc = &descs[num_descs++];
+			memcpy(desc, &ri->desc, sizeof(struct emu_desc));
+			if (block_emit_fp_instr(&e, pool, ri->routine, desc, arm_cond(*(uint32_t*) (head + 4 * i)), slow, &num_slow, &ra) != 0) {
+				free(slow);
+				return NULL;
+			}
+		} else {
+			// Branches are emitted once every instruction's new address is known
+			emit(&e, *(uint32_t*) (head + 4 * i));
+		}
+	}
+	if (in_block) {
+		block_emit_leave(&e, &ra);
+	}
+	emit_jump(&e, tail + 4);
+	for (int i = 0; i < num_slow; i++) {
+		if (jit_emit_slow_path(&e, pool, &slow[i]) != 0) {
+			free(slow);
+			return NULL;
+		}
+	}
+	free(slow);
+
+	for (int i = 0; i < len; i++) {
+		if (instrs[i].kind != REGION_BRANCH) {
+			continue;
+		}
+		int8_t* addr = head + 4 * i;
+		uint32_t instr = *(uint32_t*) addr;
+		int8_t* target = arm_branch_target(addr, instr);
+		void* dest = target;
+		if (head <= target && target <= tail) {
+			dest = instrs[(target - head) / 4].xlat;
+		} else if (!branch_in_range(instrs[i].xlat, target)) {
+			// A 'bl' through the jump still returns to the region
+			dest = e.pos;
+			emit_jump(&e, target);
+		}
+		*instrs[i].xlat = with_cond(encode_branch(instrs[i].xlat, dest, is_arm_branch_link(instr)), instr >> 28);
+	}
+	assert(e.pos - e.start <= max_words);
+
+	__builtin___clear_cache((char*) mem, (char*) e.pos);
+	printfdbg("Region made at %p for loop %p-%p (%d instructions, %d FP)\n", code, head, tail, len, num_fp);
+	stat_inc(STAT_REGIONS);
+	*head_out = head;
+	return code;
+}
@@ -0,0 +1,107 @@
+/*
+* Signal handlers and the emulated FPU state.
+* On hardware the kernel saves the FP registers when it delivers a signal
+* and restores them when the handler returns, so a handler that uses FP
+* can't change the registers of the code it interrupted. The emulated
+* registers live in memory the kernel knows nothing about, so the handlers
+* the program installs are wrapped to do the same with the thread's state.
+*/
+
+#include <signal.h>
+#include <dlfcn.h>
+
+typedef int (*sigaction_t)(int, const struct sigaction*, struct sigaction*);
+
+// The actions the program asked for, whose handlers are called by fpu_signal_wrapper()
+struct sigaction guest_actions[NSIG];
+
+// Returns libc's 'sigaction', which this library's preempts
+sigaction_t real_sigaction(void) {
+	static sigaction_t real = NULL;
+	if (real == NULL) {
+		real = (sigaction_t) dlsym(RTLD_NEXT, "sigaction");
+	}
+	return real;
+}
+
+/*
+* Installed in place of every handler the program sets. Saves the thread's
+* FPU state, calls the program's handler and restores the state. A thread
+* without a state gets none back: one allocated by the handler is freed so
+* that the interrupted code, which may be allocating its own, starts clean.
+* Such a state was never registered with 'fpu_state_key' (see
+* fpu_state_alloc()), so only async-signal-safe calls are made here.
+* A handler that doesn't return (e.g. through siglongjmp()) leaves the
+* thread counted as in a handler, so a state it allocates later is leaked
+* when it exits rather than freed.
+*/
+void fpu_signal_wrapper(int sig, siginfo_t* info, void* context) {
+	struct fpu_state* state = fpu_state_tls;
+	struct fpu_state saved;
+	if (state != NULL) {
+		memcpy(&saved, state, sizeof(struct fpu_state));
+	}
+
+	struct sigaction* action = &guest_actions[sig];
+	fpu_in_signal++;
+	if (action->sa_flags & SA_SIGINFO) {
+		action->sa_sigaction(sig, info, context);
+	} else {
+		action->sa_handler(sig);
+	}
+	fpu_in_signal--;
+
+	if (state != NULL) {
+		memcpy(state, &saved, sizeof(struct fpu_state));
+	} else if (fpu_state_tls != NULL) {
+		fpu_state_free(fpu_state_tls);
+	}
+}
+
+/*
+* Preempts libc's 'sigaction' so that handlers are installed wrapped by
+* fpu_signal_wrapper(). The program still sees its own handlers as the
+* old actions.
+*/
+int sigaction(int sig, const struct sigaction* act, struct sigaction* oldact) {
+	if (sig <= 0 || sig >= NSIG) {
+		return real_sigaction()(sig, act, oldact);
+	}
+	struct sigaction guest_old = guest_actions[sig];
+	struct sigaction wrapped;
+	const struct sigaction* install = act;
+	if (act != NULL && act->sa_handler != SIG_DFL && act->sa_handler != SIG_IGN) {
+		memcpy(&wrapped, act, sizeof(struct sigaction));
+		wrapped.sa_flags |= SA_SIGINFO;
+		wrapped.sa_sigaction = &fpu_signal_wrapper;
+		install = &wrapped;
+	}
+	// The new handler is recorded first, as the signal may come as soon as it is installed
+	if (act != NULL) {
+		memcpy(&guest_actions[sig], act, sizeof(struct sigaction));
+	}
+	int ret = real_sigaction()(sig, install, oldact);
+	if (ret != 0) {
+		guest_actions[sig] = guest_old;
+		return ret;
+	}
+	if (oldact != NULL && oldact->sa_sigaction == &fpu_signal_wrapper) {
+		memcpy(oldact, &guest_old, sizeof(struct sigaction));
+	}
+	return 0;
+}
+
+// libc's 'signal' doesn't call 'sigaction' through the PLT, so it is preempted too
+sighandler_t signal(int sig, sighandler_t handler) {
+	struct sigaction act;
+	struct sigaction oldact;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, sig);
+	if (sigaction(sig, &act, &oldact) != 0) {
+		return SIG_ERR;
+	}
+	return oldact.sa_handler;
+}
@@ -0,0 +1,1333 @@
+#include <stdint.h>
+
+/*
+* Integer-only IEEE-754 single precision arithmetic.
+* Values are passed around as their raw bit patterns so that no host
+* floating-point instruction (or libgcc soft-float helper) is ever used.
+* Results follow the ARM VFP rules for NaN propagation and detect
+* tininess before rounding, so they match what the hardware would produce.
+*/
+
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* division and square root by table-seeded Newton-Raphson iteration.
+* Without it quotients and roots are worked out one bit at a time.
+*/
+#define DO_FAST_DIV_SQRT
+
+#define F32_SIGN 0x80000000
+#define F32_INF 0x7F800000
+#define F32_QUIET 0x00400000
+#define F32_DEFAULT_NAN 0x7FC00000
+#define F32_EXP(a) (((a) >> 23) & 0xFF)
+#define F32_FRAC(a) ((a) & 0x007FFFFF)
+
+// Rounding modes, numbered as in the RMode field of the FPSCR
+#define ROUND_NEAREST 0
+#define ROUND_PLUS_INF 1
+#define ROUND_MINUS_INF 2
+#define ROUND_ZERO 3
+
+/*
+* Arithmetic modes: the FPSCR's RMode (bits 22 and 23), FZ (flush-to-zero,
+* bit 24) and DN (default NaN, bit 25) fields shifted down. The '_in'
+* kernels take one as 'mode' and are always inlined, so an instance for a
+* constant mode has no mode tests left in it. The kernels without a suffix
+* are the instances for the default mode: round to nearest, IEEE subnormals
+* and NaN propagation. Conversions take a rounding mode of their own.
+*/
+#define FP_MODE_SHIFT 22
+#define FP_MODE_RMODE 0x3
+#define FP_MODE_FZ 0x4
+#define FP_MODE_DN 0x8
+#define FP_MODE_RUNFAST (FP_MODE_FZ | FP_MODE_DN)	// ARM's RunFast mode, with round to nearest
+#define NUM_FP_MODES 16
+
+#define FP_INLINE static inline __attribute__((always_inline))
+
+// NZCV flags set by a comparison, in their positions in the FPSCR and APSR
+#define FLAGS_EQUAL 0x60000000
+#define FLAGS_LESS 0x80000000
+#define FLAGS_GREATER 0x20000000
+#define FLAGS_UNORDERED 0x30000000
+
+static inline int f32_is_nan(uint32_t a) {
+	return (a & ~F32_SIGN) > F32_INF;
+}
+
+static inline int f32_is_snan(uint32_t a) {
+	return f32_is_nan(a) && !(a & F32_QUIET);
+}
+
+/*
+* Picks the NaN an operation on 'a' and 'b' returns, where at least one of them is a NaN.
+* As on ARM, a signalling NaN takes priority over a quiet one, then 'a' over 'b'.
+*/
+uint32_t f32_propagate_nan(uint32_t a, uint32_t b) {
+	if (f32_is_snan(a)) return a | F32_QUIET;
+	if (f32_is_snan(b)) return b | F32_QUIET;
+	if (f32_is_nan(a)) return a;
+	return b | F32_QUIET;
+}
+
+/*
+* Picks the NaN a fused multiply-add on 'a', 'b' and 'c' returns, where at
+* least one of them is a NaN. As for f32_propagate_nan(), signalling NaNs
+* come first, then the operands in order.
+*/
+uint32_t f32_propagate_nan3(uint32_t a, uint32_t b, uint32_t c) {
+	if (f32_is_snan(a)) return a | F32_QUIET;
+	if (f32_is_snan(b)) return b | F32_QUIET;
+	if (f32_is_snan(c)) return c | F32_QUIET;
+	if (f32_is_nan(a)) return a;
+	if (f32_is_nan(b)) return b;
+	return c;
+}
+
+// The NaN returned for a NaN operand: the default NaN in DN mode
+FP_INLINE uint32_t f32_nan_in(uint32_t a, uint32_t b, int mode) {
+	return (mode & FP_MODE_DN) ? F32_DEFAULT_NAN : f32_propagate_nan(a, b);
+}
+
+// In FZ mode, subnormal operands are replaced by zeros of the same sign
+FP_INLINE uint32_t f32_flush_in(uint32_t a, int mode) {
+	return (mode & FP_MODE_FZ) && F32_EXP(a) == 0 ? a & F32_SIGN : a;
+}
+
+/*
+* Returns what is added to a result with 'bits' bits below its final
+* precision and sign 'sign' to round it in rounding mode 'rmode': half of
+* the last place to nearest, all but one bit away from zero and nothing
+* towards zero.
+*/
+FP_INLINE uint64_t round_increment(int rmode, int sign, int bits) {
+	uint64_t all = ((uint64_t) 1 << bits) - 1;
+	if (rmode == ROUND_NEAREST) return all / 2 + 1;
+	if (rmode == ROUND_ZERO || (rmode == ROUND_PLUS_INF) == sign) return 0;
+	return all;
+}
+
+// Returns whether an exact zero sum of non-zero operands is negative, i.e. when rounding down
+FP_INLINE int exact_zero_is_negative(int mode) {
+	return (mode & FP_MODE_RMODE) == ROUND_MINUS_INF;
+}
+
+/*
+* Shifts 'a' right by 'count' bits, OR-ing any bits shifted out into
+* the least significant bit so that rounding still sees them.
+*/
+static inline uint32_t shift_right_jam32(uint32_t a, int count) {
+	if (count == 0) return a;
+	if (count < 32) return (a >> count) | ((a << (-count & 31)) != 0);
+	return a != 0;
+}
+
+static inline uint64_t shift_right_jam64(uint64_t a, int count) {
+	if (count == 0) return a;
+	if (count < 64) return (a >> count) | ((a << (-count & 63)) != 0);
+	return a != 0;
+}
+
+// As shift_right_jam64() for 0 < 'count' < 64, returning the low 32 bits.
+static inline uint32_t short_shift_right_jam64(uint64_t a, int count) {
+	return (uint32_t) (a >> count) | ((a & (((uint64_t) 1 << count) - 1)) != 0);
+}
+
+/*
+* Rounds and packs a result.
+* 'sig' has its leading bit at bit 30 and seven bits below the final
+* precision; 'exp' is one less than the biased exponent of the result,
+* as adding the leading bit of 'sig' increments it. It is negative for a
+* result that is tiny before rounding, which FZ mode flushes to zero.
+* Overflow gives the largest finite value when rounding towards zero.
+*/
+FP_INLINE uint32_t f32_round_pack_in(uint32_t sign, int32_t exp, uint32_t sig, int mode) {
+	int rmode = mode & FP_MODE_RMODE;
+	uint32_t increment = round_increment(rmode, sign != 0, 7);
+	uint32_t round_bits = sig & 0x7F;
+	if ((uint32_t) exp >= 0xFD) {
+		if (exp > 0xFD || (exp == 0xFD && (int32_t) (sig + increment) < 0)) {
+			return increment == 0 ? sign | 0x7F7FFFFF : sign | F32_INF;
+		}
+		if (exp < 0) {
+			if (mode & FP_MODE_FZ) return sign;
+			sig = shift_right_jam32(sig, -exp);
+			exp = 0;
+			round_bits = sig & 0x7F;
+		}
+	}
+	sig = (sig + increment) >> 7;
+	if (rmode == ROUND_NEAREST) sig &= ~(uint32_t) (round_bits == 0x40);
+	if (sig == 0) exp = 0;
+	return sign + ((uint32_t) exp << 23) + sig;
+}
+
+// As f32_round_pack_in(), but 'sig' may have its leading bit anywhere.
+FP_INLINE uint32_t f32_norm_round_pack_in(uint32_t sign, int32_t exp, uint32_t sig, int mode) {
+	int shift = __builtin_clz(sig) - 1;
+	return f32_round_pack_in(sign, exp - shift, sig << shift, mode);
+}
+
+uint32_t f32_round_pack(uint32_t sign, int32_t exp, uint32_t sig) {
+	return f32_round_pack_in(sign, exp, sig, ROUND_NEAREST);
+}
+
+uint32_t f32_norm_round_pack(uint32_t sign, int32_t exp, uint32_t sig) {
+	return f32_norm_round_pack_in(sign, exp, sig, ROUND_NEAREST);
+}
+
+/*
+* Normalises the significand of a subnormal so that its leading bit is at
+* bit 23, adjusting the exponent to match.
+*/
+static inline void f32_norm_subnormal(int32_t* exp, uint32_t* sig) {
+	int shift = __builtin_clz(*sig) - 8;
+	*exp = 1 - shift;
+	*sig <<= shift;
+}
+
+// Adds the magnitudes of 'a' and 'b', giving the result the sign 'sign'.
+FP_INLINE uint32_t f32_add_mags(uint32_t a, uint32_t b, uint32_t sign, int mode) {
+	int32_t a_exp = F32_EXP(a);
+	int32_t b_exp = F32_EXP(b);
+	uint32_t a_sig = F32_FRAC(a) << 6;
+	uint32_t b_sig = F32_FRAC(b) << 6;
+	int32_t exp_diff = a_exp - b_exp;
+	int32_t z_exp;
+	uint32_t z_sig;
+
+	if (exp_diff > 0) {
+		if (a_exp == 0xFF) return a_sig ? f32_nan_in(a, b, mode) : sign | F32_INF;
+		if (b_exp == 0) --exp_diff; else b_sig |= 0x20000000;
+		b_sig = shift_right_jam32(b_sig, exp_diff);
+		z_exp = a_exp;
+	} else if (exp_diff < 0) {
+		if (b_exp == 0xFF) return b_sig ? f32_nan_in(a, b, mode) : sign | F32_INF;
+		if (a_exp == 0) ++exp_diff; else a_sig |= 0x20000000;
+		a_sig = shift_right_jam32(a_sig, -exp_diff);
+		z_exp = b_exp;
+	} else {
+		if (a_exp == 0xFF) return (a_sig | b_sig) ? f32_nan_in(a, b, mode) : sign | F32_INF;
+		// Two subnormals (or zeros) add exactly, possibly into the smallest normal
+		if (a_exp == 0) return sign | ((a_sig + b_sig) >> 6);
+		return f32_round_pack_in(sign, a_exp, 0x40000000 + a_sig + b_sig, mode);
+	}
+	a_sig |= 0x20000000;
+	z_sig = (a_sig + b_sig) << 1;
+	--z_exp;
+	if ((int32_t) z_sig < 0) {
+		z_sig = a_sig + b_sig;
+		++z_exp;
+	}
+	return f32_round_pack_in(sign, z_exp, z_sig, mode);
+}
+
+/*
+* Subtracts the magnitude of 'b' from that of 'a', where 'sign' is the
+* sign the result has if |a| >= |b|.
+*/
+FP_INLINE uint32_t f32_sub_mags(uint32_t a, uint32_t b, uint32_t sign, int mode) {
+	int32_t a_exp = F32_EXP(a);
+	int32_t b_exp = F32_EXP(b);
+	uint32_t a_sig = F32_FRAC(a) << 7;
+	uint32_t b_sig = F32_FRAC(b) << 7;
+	int32_t exp_diff = a_exp - b_exp;
+
+	if (exp_diff > 0) {
+		if (a_exp == 0xFF) return a_sig ? f32_nan_in(a, b, mode) : sign | F32_INF;
+		if (b_exp == 0) --exp_diff; else b_sig |= 0x40000000;
+		b_sig = shift_right_jam32(b_sig, exp_diff);
+		a_sig |= 0x40000000;
+	} else if (exp_diff < 0) {
+		if (b_exp == 0xFF) return b_sig ? f32_nan_in(a, b, mode) : (sign ^ F32_SIGN) | F32_INF;
+		if (a_exp == 0) ++exp_diff; else a_sig |= 0x40000000;
+		a_sig = shift_right_jam32(a_sig, -exp_diff);
+		b_sig |= 0x40000000;
+		a_exp = b_exp;
+	} else {
+		if (a_exp == 0xFF) return (a_sig | b_sig) ? f32_nan_in(a, b, mode) : F32_DEFAULT_NAN;
+		if (a_exp == 0) a_exp = 1;
+		if (a_sig == b_sig) return exact_zero_is_negative(mode) ? F32_SIGN : 0;
+	}
+	if (a_sig < b_sig) {
+		uint32_t tmp = a_sig;
+		a_sig = b_sig;
+		b_sig = tmp;
+		sign ^= F32_SIGN;
+	}
+	return f32_norm_round_pack_in(sign, a_exp - 1, a_sig - b_sig, mode);
+}
+
+FP_INLINE uint32_t f32_add_in(uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	uint32_t sign = a & F32_SIGN;
+	if (sign == (b & F32_SIGN)) return f32_add_mags(a, b, sign, mode);
+	return f32_sub_mags(a, b, sign, mode);
+}
+
+FP_INLINE uint32_t f32_sub_in(uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	uint32_t sign = a & F32_SIGN;
+	if (sign == (b & F32_SIGN)) return f32_sub_mags(a, b, sign, mode);
+	return f32_add_mags(a, b, sign, mode);
+}
+
+FP_INLINE uint32_t f32_mul_in(uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	uint32_t sign = (a ^ b) & F32_SIGN;
+	int32_t a_exp = F32_EXP(a);
+	int32_t b_exp = F32_EXP(b);
+	uint32_t a_sig = F32_FRAC(a);
+	uint32_t b_sig = F32_FRAC(b);
+
+	// One test lets two normal operands skip the special cases
+	if ((uint32_t) (a_exp - 1) < 0xFE && (uint32_t) (b_exp - 1) < 0xFE) {
+		goto multiply;
+	}
+	if (a_exp == 0xFF || b_exp == 0xFF) {
+		if ((a_exp == 0xFF && a_sig) || (b_exp == 0xFF && b_sig)) return f32_nan_in(a, b, mode);
+		// Infinity times zero is invalid
+		if ((a_exp | a_sig) == 0 || (b_exp | b_sig) == 0) return F32_DEFAULT_NAN;
+		return sign | F32_INF;
+	}
+	if (a_exp == 0) {
+		if (a_sig == 0) return sign;
+		f32_norm_subnormal(&a_exp, &a_sig);
+	}
+	if (b_exp == 0) {
+		if (b_sig == 0) return sign;
+		f32_norm_subnormal(&b_exp, &b_sig);
+	}
+
+multiply:
+	// The 48-bit product of the significands has its leading bit at 62 or 61
+	int32_t z_exp = a_exp + b_exp - 0x7F;
+	uint64_t product = (uint64_t) ((a_sig | 0x00800000) << 7) * ((b_sig | 0x00800000) << 8);
+	uint32_t z_sig = (uint32_t) (product >> 32) | ((uint32_t) product != 0);
+	if (z_sig < 0x40000000) {
+		--z_exp;
+		z_sig <<= 1;
+	}
+	return f32_round_pack_in(sign, z_exp, z_sig, mode);
+}
+
+/*
+* Returns the NZCV flags 'vcmp' sets when comparing 'a' with 'b'.
+* Zeros compare equal whatever their signs and NaNs are unordered.
+*/
+FP_INLINE uint32_t f32_compare_in(uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	if (f32_is_nan(a) || f32_is_nan(b)) return FLAGS_UNORDERED;
+	if (a == b || ((a | b) & ~F32_SIGN) == 0) return FLAGS_EQUAL;
+	// Same-signed values order like their bit patterns, reversed if negative
+	int less = (a & F32_SIGN) != (b & F32_SIGN) ? (a & F32_SIGN) != 0 : (a < b) != ((a & F32_SIGN) != 0);
+	return less ? FLAGS_LESS : FLAGS_GREATER;
+}
+
+#ifdef DO_FAST_DIV_SQRT
+/*
+* Seeds for the reciprocal of b in [0.5, 1) and the reciprocal square root
+* of a in [0.25, 1): one straight line per interval of 2^-7 and 2^-6
+* respectively, with 'k0' the value at the start of the interval and 'k1'
+* the drop over it, in units of 2^-15. Each line stays below the function,
+* so the seeds, and the iterations from them, never overestimate.
+*/
+static const uint16_t recip_k0[64] = {
+	0xFFFA, 0xFC0B, 0xF839, 0xF485, 0xF0EC, 0xED6E, 0xEA0A, 0xE6BE,
+	0xE38A, 0xE06C, 0xDD64, 0xDA70, 0xD790, 0xD4C4, 0xD20A, 0xCF61,
+	0xCCC9, 0xCA42, 0xC7CB, 0xC563, 0xC309, 0xC0BE, 0xBE80, 0xBC4F,
+	0xBA2C, 0xB814, 0xB608, 0xB408, 0xB213, 0xB029, 0xAE4A, 0xAC74,
+	0xAAA8, 0xA8E5, 0xA72C, 0xA57C, 0xA3D4, 0xA235, 0xA09E, 0x9F0F,
+	0x9D87, 0x9C07, 0x9A8F, 0x991D, 0x97B2, 0x964E, 0x94F0, 0x9398,
+	0x9247, 0x90FC, 0x8FB6, 0x8E76, 0x8D3C, 0x8C07, 0x8AD7, 0x89AC,
+	0x8886, 0x8765, 0x864A, 0x8532, 0x841F, 0x8310, 0x8206, 0x8100,
+};
+static const uint16_t recip_k1[64] = {
+	0x03F0, 0x03D2, 0x03B5, 0x0399, 0x037E, 0x0364, 0x034C, 0x0334,
+	0x031E, 0x0308, 0x02F4, 0x02E0, 0x02CD, 0x02BA, 0x02A9, 0x0298,
+	0x0287, 0x0277, 0x0268, 0x025A, 0x024B, 0x023E, 0x0231, 0x0224,
+	0x0218, 0x020C, 0x0200, 0x01F5, 0x01EA, 0x01E0, 0x01D6, 0x01CC,
+	0x01C2, 0x01B9, 0x01B0, 0x01A8, 0x019F, 0x0197, 0x018F, 0x0188,
+	0x0180, 0x0179, 0x0172, 0x016B, 0x0164, 0x015E, 0x0158, 0x0151,
+	0x014B, 0x0146, 0x0140, 0x013A, 0x0135, 0x0130, 0x012B, 0x0126,
+	0x0121, 0x011C, 0x0118, 0x0113, 0x010F, 0x010A, 0x0106, 0x0102,
+};
+static const uint16_t rsqrt_k0[48] = {
+	0xFFE8, 0xF846, 0xF14A, 0xEADC, 0xE4EB, 0xDF67, 0xDA45, 0xD57A,
+	0xD0FC, 0xCCC4, 0xC8CA, 0xC50A, 0xC17E, 0xBE20, 0xBAEE, 0xB7E5,
+	0xB500, 0xB23C, 0xAF98, 0xAD12, 0xAAA6, 0xA854, 0xA619, 0xA3F5,
+	0xA1E5, 0x9FE8, 0x9DFE, 0x9C25, 0x9A5D, 0x98A3, 0x96F8, 0x955A,
+	0x93CA, 0x9246, 0x90CE, 0x8F61, 0x8DFE, 0x8CA6, 0x8B57, 0x8A11,
+	0x88D4, 0x879F, 0x8673, 0x854E, 0x8430, 0x831A, 0x820A, 0x8101,
+};
+static const uint16_t rsqrt_k1[48] = {
+	0x07A5, 0x06FF, 0x0670, 0x05F3, 0x0585, 0x0523, 0x04CC, 0x047F,
+	0x0439, 0x03FA, 0x03C1, 0x038D, 0x035E, 0x0332, 0x030A, 0x02E6,
+	0x02C4, 0x02A4, 0x0287, 0x026C, 0x0252, 0x023B, 0x0225, 0x0210,
+	0x01FD, 0x01EA, 0x01D9, 0x01C9, 0x01BA, 0x01AB, 0x019D, 0x0190,
+	0x0184, 0x0178, 0x016D, 0x0163, 0x0159, 0x014F, 0x0146, 0x013D,
+	0x0135, 0x012D, 0x0125, 0x011E, 0x0117, 0x0110, 0x0109, 0x0103,
+};
+
+/*
+* Returns an approximation of 2^63 / 'b', where 'b' has its leading bit at
+* 31, from below and within 4. The seed is good to about 14 bits and one
+* Newton-Raphson step of second order, r * (1 + e + e^2) where e is the
+* seed's relative error 1 - b * r, brings it to 31.
+*/
+static inline uint32_t approx_recip32(uint32_t b) {
+	int index = (b >> 25) & 0x3F;
+	uint32_t eps = (b >> 9) & 0xFFFF;
+	uint32_t r0 = (uint32_t) (recip_k0[index] - ((recip_k1[index] * eps) >> 16)) << 16;
+	// 'err' is e in units of 2^-42
+	uint32_t err = ((1ULL << 63) - (uint64_t) b * r0) >> 21;
+	uint32_t step = ((uint64_t) r0 * err) >> 42;
+	return r0 + step + (uint32_t) (((uint64_t) step * err) >> 42);
+}
+
+/*
+* Returns an approximation of 2^47 / sqrt('a'), where 'a' has its leading
+* bit at 30 or 31, from below and within 4. The Newton-Raphson step is
+* r * (1 + e / 2 + 3 * e^2 / 8) where e is 1 - a * r^2.
+*/
+static inline uint32_t approx_rsqrt32(uint32_t a) {
+	int index = (a >> 26) - 16;
+	uint32_t eps = (a >> 10) & 0xFFFF;
+	uint32_t r0 = (uint32_t) (rsqrt_k0[index] - ((rsqrt_k1[index] * eps) >> 16)) << 16;
+	uint32_t r0_sqr = ((uint64_t) r0 * r0) >> 32;
+	// 'err' is e in units of 2^-42
+	uint32_t err = ((1ULL << 62) - (uint64_t) a * r0_sqr) >> 20;
+	uint32_t step = ((uint64_t) r0 * err) >> 43;
+	return r0 + step + (uint32_t) ((3 * (uint64_t) step * err) >> 44);
+}
+
+/*
+* Returns ('a_sig' << 'shift') / 'b_sig' with the sticky bit set if it is
+* inexact, where the significands have their leading bit at 23 and 'shift'
+* is 30 or 31. The quotient estimated with the reciprocal is short by at
+* most a few units, which the remainder puts right.
+*/
+static inline uint32_t f32_div_sig(uint32_t a_sig, uint32_t b_sig, int shift) {
+	uint32_t q = ((uint64_t) (a_sig << (shift - 23)) * approx_recip32(b_sig << 8)) >> 32;
+	uint64_t rem = ((uint64_t) a_sig << shift) - (uint64_t) q * b_sig;
+	while (rem >= b_sig) {
+		q++;
+		rem -= b_sig;
+	}
+	return q | (rem != 0);
+}
+#else
+static inline uint32_t f32_div_sig(uint32_t a_sig, uint32_t b_sig, int shift) {
+	uint64_t dividend = (uint64_t) a_sig << shift;
+	uint32_t z_sig = dividend / b_sig;
+	// Only an exact-looking quotient needs the remainder checked for rounding
+	if ((z_sig & 0x3F) == 0) {
+		z_sig |= (uint64_t) b_sig * z_sig != dividend;
+	}
+	return z_sig;
+}
+#endif
+
+FP_INLINE uint32_t f32_div_in(uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	uint32_t sign = (a ^ b) & F32_SIGN;
+	int32_t a_exp = F32_EXP(a);
+	int32_t b_exp = F32_EXP(b);
+	uint32_t a_sig = F32_FRAC(a);
+	uint32_t b_sig = F32_FRAC(b);
+
+	if ((uint32_t) (a_exp - 1) < 0xFE && (uint32_t) (b_exp - 1) < 0xFE) {
+		goto divide;
+	}
+	if (a_exp == 0xFF) {
+		if (a_sig || (b_exp == 0xFF && b_sig)) return f32_nan_in(a, b, mode);
+		// Infinity divided by infinity is invalid
+		if (b_exp == 0xFF) return F32_DEFAULT_NAN;
+		return sign | F32_INF;
+	}
+	if (b_exp == 0xFF) {
+		if (b_sig) return f32_nan_in(a, b, mode);
+		return sign;
+	}
+	if (b_exp == 0) {
+		if (b_sig == 0) {
+			// Zero divided by zero is invalid; anything else divided by zero is infinite
+			if ((a_exp | a_sig) == 0) return F32_DEFAULT_NAN;
+			return sign | F32_INF;
+		}
+		f32_norm_subnormal(&b_exp, &b_sig);
+	}
+	if (a_exp == 0) {
+		if (a_sig == 0) return sign;
+		f32_norm_subnormal(&a_exp, &a_sig);
+	}
+
+divide: ;
+	int32_t z_exp = a_exp - b_exp + 0x7E;
+	a_sig |= 0x00800000;
+	b_sig |= 0x00800000;
+	// Scale the dividend so the quotient has its leading bit at 30
+	int shift = 30;
+	if (a_sig < b_sig) {
+		--z_exp;
+		shift = 31;
+	}
+	return f32_round_pack_in(sign, z_exp, f32_div_sig(a_sig, b_sig, shift), mode);
+}
+
+/*
+* Returns the integer square root of the 2 * 'bits'-bit number 'hi':'lo',
+* setting 'inexact' if the remainder isn't zero. Two bits of the radicand
+* are consumed per step, so the root has 'bits' bits; 'bits' is at most 56
+* for the remainder to fit in 64 bits.
+*/
+static uint64_t isqrt_wide(uint64_t hi, uint64_t lo, int bits, int* inexact) {
+	uint64_t rem = 0;
+	uint64_t root = 0;
+	for (int i = bits - 1; i >= 0; i--) {
+		int pos = 2 * i;
+		uint64_t next = pos >= 64 ? (hi >> (pos - 64)) & 3 : (lo >> pos) & 3;
+		rem = (rem << 2) | next;
+		uint64_t trial = (root << 2) | 1;
+		uint64_t bit = rem >= trial;
+		rem -= trial & -bit;
+		root = (root << 1) | bit;
+	}
+	*inexact = rem != 0;
+	return root;
+}
+
+/*
+* Returns the square root of 'x', in [2^60, 2^62), with the sticky bit set
+* if it is inexact. The estimate from the reciprocal square root of the
+* top bits is short by at most a few units.
+*/
+static inline uint32_t f32_sqrt_sig(uint64_t x) {
+	#ifdef DO_FAST_DIV_SQRT
+	uint32_t x32 = x >> 30;
+	uint32_t root = ((uint64_t) x32 * approx_rsqrt32(x32)) >> 32;
+	uint64_t rem = x - (uint64_t) root * root;
+	while (rem > 2 * (uint64_t) root) {
+		rem -= 2 * (uint64_t) root + 1;
+		root++;
+	}
+	return root | (rem != 0);
+	#else
+	int inexact;
+	uint32_t root = isqrt_wide(0, x, 32, &inexact);
+	return root | inexact;
+	#endif
+}
+
+FP_INLINE uint32_t f32_sqrt_in(uint32_t a, int mode) {
+	a = f32_flush_in(a, mode);
+	uint32_t sign = a & F32_SIGN;
+	int32_t a_exp = F32_EXP(a);
+	uint32_t a_sig = F32_FRAC(a);
+
+	if (a_exp == 0xFF) {
+		if (a_sig) return f32_nan_in(a, a, mode);
+		return sign ? F32_DEFAULT_NAN : a;
+	}
+	if (a_exp == 0 && a_sig == 0) return a;
+	if (sign) return F32_DEFAULT_NAN;
+	if (a_exp == 0) f32_norm_subnormal(&a_exp, &a_sig);
+
+	/*
+	* a = sig * 2^(a_exp - 150), where sig has its leading bit at 23. Shift
+	* sig up into [2^60, 2^62) by an amount that leaves an even power of
+	* two, so the root has its leading bit at 30.
+	*/
+	int shift = (a_exp & 1) ? 37 : 38;
+	uint32_t z_sig = f32_sqrt_sig((uint64_t) (a_sig | 0x00800000) << shift);
+	int32_t z_exp = 156 + (a_exp - 150 - shift) / 2;
+	return f32_round_pack_in(0, z_exp, z_sig, mode);
+}
+
+/*
+* Returns c + a * b with a single rounding, as 'vfma' computes it.
+* As on ARM, the NaN rules treat 'c', the addend, as the first operand and
+* a quiet NaN addend doesn't hide the invalid product of zero and infinity.
+*/
+FP_INLINE uint32_t f32_mul_add_in(uint32_t c, uint32_t a, uint32_t b, int mode) {
+	a = f32_flush_in(a, mode);
+	b = f32_flush_in(b, mode);
+	c = f32_flush_in(c, mode);
+	uint32_t prod_sign = (a ^ b) & F32_SIGN;
+	uint32_t c_sign = c & F32_SIGN;
+	int32_t a_exp = F32_EXP(a);
+	int32_t b_exp = F32_EXP(b);
+	int32_t c_exp = F32_EXP(c);
+	uint32_t a_sig = F32_FRAC(a);
+	uint32_t b_sig = F32_FRAC(b);
+	uint32_t c_sig = F32_FRAC(c);
+
+	int inf_times_zero = (a_exp == 0xFF && a_sig == 0 && (b & ~F32_SIGN) == 0)
+		|| (b_exp == 0xFF && b_sig == 0 && (a & ~F32_SIGN) == 0);
+	if (f32_is_nan(a) || f32_is_nan(b) || f32_is_nan(c)) {
+		if ((inf_times_zero && !f32_is_snan(c)) || (mode & FP_MODE_DN)) return F32_DEFAULT_NAN;
+		return f32_propagate_nan3(c, a, b);
+	}
+	if (inf_times_zero) return F32_DEFAULT_NAN;
+	if (a_exp == 0xFF || b_exp == 0xFF) {
+		// Infinities of opposite signs can't be added
+		if (c_exp == 0xFF && prod_sign != c_sign) return F32_DEFAULT_NAN;
+		return prod_sign | F32_INF;
+	}
+	if (c_exp == 0xFF) return c;
+
+	if (a_exp == 0) {
+		if (a_sig == 0) goto zero_product;
+		f32_norm_subnormal(&a_exp, &a_sig);
+	}
+	if (b_exp == 0) {
+		if (b_sig == 0) goto zero_product;
+		f32_norm_subnormal(&b_exp, &b_sig);
+	}
+
+	// The exact product, with its leading bit at 61 or 62
+	int32_t prod_exp = a_exp + b_exp - 0x7E;
+	uint64_t prod_sig = (uint64_t) ((a_sig | 0x00800000) << 7) * ((b_sig | 0x00800000) << 7);
+	if (prod_sig < 0x2000000000000000) {
+		--prod_exp;
+		prod_sig <<= 1;
+	}
+
+	uint32_t sign = prod_sign;
+	int32_t z_exp;
+	uint32_t z_sig;
+	if (c_exp == 0) {
+		if (c_sig == 0) {
+			return f32_round_pack_in(sign, prod_exp - 1, short_shift_right_jam64(prod_sig, 31), mode);
+		}
+		f32_norm_subnormal(&c_exp, &c_sig);
+	}
+	c_sig = (c_sig | 0x00800000) << 6;
+	int32_t exp_diff = prod_exp - c_exp;
+	if (prod_sign == c_sign) {
+		if (exp_diff <= 0) {
+			z_exp = c_exp;
+			z_sig = c_sig + (uint32_t) shift_right_jam64(prod_sig, 32 - exp_diff);
+		} else {
+			z_exp = prod_exp;
+			z_sig = short_shift_right_jam64(prod_sig + shift_right_jam64((uint64_t) c_sig << 32, exp_diff), 32);
+		}
+		if (z_sig < 0x40000000) {
+			--z_exp;
+			z_sig <<= 1;
+		}
+	} else {
+		uint64_t c_sig64 = (uint64_t) c_sig << 32;
+		uint64_t z_sig64;
+		if (exp_diff < 0) {
+			sign = c_sign;
+			z_exp = c_exp;
+			z_sig64 = c_sig64 - shift_right_jam64(prod_sig, -exp_diff);
+		} else if (exp_diff == 0) {
+			z_exp = prod_exp;
+			z_sig64 = prod_sig - c_sig64;
+			// Exact cancellation gives +0, except when rounding down
+			if (z_sig64 == 0) return exact_zero_is_negative(mode) ? F32_SIGN : 0;
+			if (z_sig64 & 0x8000000000000000) {
+				sign ^= F32_SIGN;
+				z_sig64 = -z_sig64;
+			}
+		} else {
+			z_exp = prod_exp;
+			z_sig64 = prod_sig - shift_right_jam64(c_sig64, exp_diff);
+		}
+		int shift = __builtin_clzll(z_sig64) - 1;
+		z_exp -= shift;
+		shift -= 32;
+		if (shift < 0) {
+			z_sig = short_shift_right_jam64(z_sig64, -shift);
+		} else {
+			z_sig = (uint32_t) z_sig64 << shift;
+		}
+	}
+	return f32_round_pack_in(sign, z_exp, z_sig, mode);
+
+zero_product:
+	// Adding zeros of opposite signs gives +0, except when rounding down
+	if ((c & ~F32_SIGN) == 0 && prod_sign != c_sign) return exact_zero_is_negative(mode) ? F32_SIGN : 0;
+	return c;
+}
+
+uint32_t f32_add(uint32_t a, uint32_t b) { return f32_add_in(a, b, ROUND_NEAREST); }
+uint32_t f32_sub(uint32_t a, uint32_t b) { return f32_sub_in(a, b, ROUND_NEAREST); }
+uint32_t f32_mul(uint32_t a, uint32_t b) { return f32_mul_in(a, b, ROUND_NEAREST); }
+uint32_t f32_div(uint32_t a, uint32_t b) { return f32_div_in(a, b, ROUND_NEAREST); }
+uint32_t f32_sqrt(uint32_t a) { return f32_sqrt_in(a, ROUND_NEAREST); }
+uint32_t f32_mul_add(uint32_t c, uint32_t a, uint32_t b) { return f32_mul_add_in(c, a, b, ROUND_NEAREST); }
+uint32_t f32_compare(uint32_t a, uint32_t b) { return f32_compare_in(a, b, ROUND_NEAREST); }
+
+/*
+* Rounds the magnitude of 'a' (not a NaN) times 2^'frac_bits' to an
+* integer using 'rmode', where the directed modes take the sign of 'a'
+* into account. Scaling only adds to the exponent, so fixed point costs no
+* more than integers. Magnitudes of 2^32 and above come back as 2^32,
+* which is enough for callers to saturate.
+*/
+static inline uint64_t f32_round_to_int_mag(uint32_t a, int frac_bits, int rmode) {
+	uint32_t sign = a & F32_SIGN;
+	int32_t exp = F32_EXP(a);
+	uint32_t sig = F32_FRAC(a);
+	if (exp + frac_bits >= 0x7F + 32) return (uint64_t) 1 << 32;
+	if (exp) sig |= 0x00800000;
+	else exp = 1;
+
+	// The magnitude as fixed point with 32 fraction bits: sig * 2^(exp + frac_bits - 150 + 32)
+	int shift = 150 - exp - frac_bits;
+	uint64_t fixed = shift < 0 ? (uint64_t) sig << (32 - shift) : shift_right_jam64((uint64_t) sig << 32, shift);
+	uint64_t whole = fixed >> 32;
+	uint32_t frac = (uint32_t) fixed;
+	switch (rmode) {
+		case ROUND_NEAREST:
+			whole += frac > 0x80000000 || (frac == 0x80000000 && (whole & 1));
+			break;
+		case ROUND_PLUS_INF:
+			whole += !sign && frac;
+			break;
+		case ROUND_MINUS_INF:
+			whole += sign && frac;
+			break;
+	}
+	return whole;
+}
+
+/*
+* Saturates the rounded magnitude 'mag' of a value of sign 'sign' to a
+* 'size'-bit integer, which is returned sign or zero extended to 32 bits.
+*/
+static inline uint32_t saturate_mag(uint64_t mag, int sign, int size, int is_unsigned) {
+	if (is_unsigned) {
+		uint32_t max = (uint32_t) (((uint64_t) 1 << size) - 1);
+		if (sign) return 0;
+		return mag > max ? max : (uint32_t) mag;
+	}
+	uint32_t limit = (uint32_t) 1 << (size - 1);
+	if (sign) return mag >= limit ? -limit : -(uint32_t) mag;
+	return mag >= limit ? limit - 1 : (uint32_t) mag;
+}
+
+/*
+* Converts 'a' to a 'size'-bit (16 or 32) fixed-point number with
+* 'frac_bits' fraction bits, saturating as 'vcvt' does, with NaNs
+* converting to 0. 16-bit results are sign or zero extended. 'mode' is an
+* arithmetic mode: 'vcvt' to integers and fixed point rounds towards zero,
+* 'vcvtr' uses the FPSCR's rounding mode, and FZ flushes a subnormal 'a'.
+*/
+uint32_t f32_to_fixed(uint32_t a, int frac_bits, int size, int is_unsigned, int mode) {
+	int rmode = mode & FP_MODE_RMODE;
+	int32_t exp = F32_EXP(a) + frac_bits;
+	// Truncating a value from 1 to 2^(size - 1), which fits either way, is a shift of its significand
+	if (rmode == ROUND_ZERO && exp >= 0x7F && exp < 0x7F + size - 1) {
+		uint32_t sig = F32_FRAC(a) | 0x00800000;
+		int shift = exp - 150;
+		uint32_t mag = shift < 0 ? sig >> -shift : sig << shift;
+		if (!(a & F32_SIGN)) return mag;
+		return is_unsigned ? 0 : -mag;
+	}
+	if (f32_is_nan(a)) return 0;
+	a = f32_flush_in(a, mode);
+	return saturate_mag(f32_round_to_int_mag(a, frac_bits, rmode), (a & F32_SIGN) != 0, size, is_unsigned);
+}
+
+/*
+* Converts the 'size'-bit fixed-point number 'a', with 'frac_bits'
+* fraction bits, to single precision, rounding with the mode's RMode.
+* Only the low 'size' bits of 'a' are used.
+*/
+uint32_t fixed_to_f32(uint32_t a, int frac_bits, int size, int is_unsigned, int mode) {
+	if (size == 16) a = is_unsigned ? (uint16_t) a : (uint32_t) (int16_t) a;
+	uint32_t sign = !is_unsigned && (int32_t) a < 0 ? F32_SIGN : 0;
+	uint32_t mag = sign ? -a : a;
+	if (mag == 0) return 0;
+	// Below 2^24 the value is exact: move the leading bit to the hidden bit, which adds one to the exponent
+	if (mag < 0x01000000) {
+		int lead = 31 - __builtin_clz(mag);
+		return sign + ((uint32_t) (0x7E + lead - frac_bits) << 23) + (mag << (23 - lead));
+	}
+	if (mag & 0x80000000) {
+		return f32_round_pack_in(sign, 0x9D - frac_bits, (mag >> 1) | (mag & 1), mode & FP_MODE_RMODE);
+	}
+	return f32_norm_round_pack_in(sign, 0x9C - frac_bits, mag, mode & FP_MODE_RMODE);
+}
+
+/*
+* Conversions to and from 32-bit integers, which are fixed point without
+* fraction bits. The integer ones round to nearest, as C's do.
+*/
+int32_t f32_to_i32(uint32_t a, int mode) {
+	return (int32_t) f32_to_fixed(a, 0, 32, 0, mode);
+}
+
+uint32_t f32_to_u32(uint32_t a, int mode) {
+	return f32_to_fixed(a, 0, 32, 1, mode);
+}
+
+uint32_t i32_to_f32(int32_t a) {
+	return fixed_to_f32((uint32_t) a, 0, 32, 0, ROUND_NEAREST);
+}
+
+uint32_t u32_to_f32(uint32_t a) {
+	return fixed_to_f32(a, 0, 32, 1, ROUND_NEAREST);
+}
+
+/*
+* Double precision, in the same style as single precision: values are raw
+* 64-bit patterns, and a 32-bit ARM has no 64x64-bit multiply or 64-bit
+* divide, so those are built from 32-bit pieces.
+*/
+
+#define F64_SIGN 0x8000000000000000ULL
+#define F64_INF 0x7FF0000000000000ULL
+#define F64_QUIET 0x0008000000000000ULL
+#define F64_DEFAULT_NAN 0x7FF8000000000000ULL
+#define F64_HIDDEN 0x0010000000000000ULL
+#define F64_EXP(a) ((int32_t) ((a) >> 52) & 0x7FF)
+#define F64_FRAC(a) ((a) & 0x000FFFFFFFFFFFFFULL)
+
+static inline int f64_is_nan(uint64_t a) {
+	return (a & ~F64_SIGN) > F64_INF;
+}
+
+static inline int f64_is_snan(uint64_t a) {
+	return f64_is_nan(a) && !(a & F64_QUIET);
+}
+
+// As f32_propagate_nan()
+uint64_t f64_propagate_nan(uint64_t a, uint64_t b) {
+	if (f64_is_snan(a)) return a | F64_QUIET;
+	if (f64_is_snan(b)) return b | F64_QUIET;
+	if (f64_is_nan(a)) return a;
+	return b | F64_QUIET;
+}
+
+// As f32_nan_in() and f32_flush_in()
+FP_INLINE uint64_t f64_nan_in(uint64_t a, uint64_t b, int mode) {
+	return (mode & FP_MODE_DN) ? F64_DEFAULT_NAN : f64_propagate_nan(a, b);
+}
+
+FP_INLINE uint64_t f64_flush_in(uint64_t a, int mode) {
+	return (mode & FP_MODE_FZ) && F64_EXP(a) == 0 ? a & F64_SIGN : a;
+}
+
+// Returns the high 64 bits of the product of 'a' and 'b', setting 'lo' to the low 64
+static inline uint64_t mul64_to_128(uint64_t a, uint64_t b, uint64_t* lo) {
+	uint32_t a0 = (uint32_t) a, a1 = (uint32_t) (a >> 32);
+	uint32_t b0 = (uint32_t) b, b1 = (uint32_t) (b >> 32);
+	uint64_t p00 = (uint64_t) a0 * b0;
+	uint64_t p01 = (uint64_t) a0 * b1;
+	uint64_t p10 = (uint64_t) a1 * b0;
+	uint64_t p11 = (uint64_t) a1 * b1;
+	uint64_t mid = (p00 >> 32) + (uint32_t) p01 + (uint32_t) p10;
+	*lo = (mid << 32) | (uint32_t) p00;
+	return p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+/*
+* As f32_round_pack_in(), with 'sig' having its leading bit at bit 62 and
+* ten bits below the final precision.
+*/
+FP_INLINE uint64_t f64_round_pack_in(uint64_t sign, int32_t exp, uint64_t sig, int mode) {
+	int rmode = mode & FP_MODE_RMODE;
+	uint64_t increment = round_increment(rmode, sign != 0, 10);
+	uint32_t round_bits = sig & 0x3FF;
+	if ((uint32_t) exp >= 0x7FD) {
+		if (exp > 0x7FD || (exp == 0x7FD && (int64_t) (sig + increment) < 0)) {
+			return increment == 0 ? sign | 0x7FEFFFFFFFFFFFFFULL : sign | F64_INF;
+		}
+		if (exp < 0) {
+			if (mode & FP_MODE_FZ) return sign;
+			sig = shift_right_jam64(sig, -exp);
+			exp = 0;
+			round_bits = sig & 0x3FF;
+		}
+	}
+	sig = (sig + increment) >> 10;
+	if (rmode == ROUND_NEAREST) sig &= ~(uint64_t) (round_bits == 0x200);
+	if (sig == 0) exp = 0;
+	return sign + ((uint64_t) exp << 52) + sig;
+}
+
+// As f32_norm_round_pack_in()
+FP_INLINE uint64_t f64_norm_round_pack_in(uint64_t sign, int32_t exp, uint64_t sig, int mode) {
+	int shift = __builtin_clzll(sig) - 1;
+	return f64_round_pack_in(sign, exp - shift, sig << shift, mode);
+}
+
+uint64_t f64_round_pack(uint64_t sign, int32_t exp, uint64_t sig) {
+	return f64_round_pack_in(sign, exp, sig, ROUND_NEAREST);
+}
+
+uint64_t f64_norm_round_pack(uint64_t sign, int32_t exp, uint64_t sig) {
+	return f64_norm_round_pack_in(sign, exp, sig, ROUND_NEAREST);
+}
+
+// As f32_norm_subnormal(), leaving the leading bit at bit 52
+static inline void f64_norm_subnormal(int32_t* exp, uint64_t* sig) {
+	int shift = __builtin_clzll(*sig) - 11;
+	*exp = 1 - shift;
+	*sig <<= shift;
+}
+
+FP_INLINE uint64_t f64_add_mags(uint64_t a, uint64_t b, uint64_t sign, int mode) {
+	int32_t a_exp = F64_EXP(a);
+	int32_t b_exp = F64_EXP(b);
+	uint64_t a_sig = F64_FRAC(a) << 9;
+	uint64_t b_sig = F64_FRAC(b) << 9;
+	int32_t exp_diff = a_exp - b_exp;
+	int32_t z_exp;
+	uint64_t z_sig;
+
+	if (exp_diff > 0) {
+		if (a_exp == 0x7FF) return a_sig ? f64_nan_in(a, b, mode) : sign | F64_INF;
+		if (b_exp == 0) --exp_diff; else b_sig |= 0x2000000000000000ULL;
+		b_sig = shift_right_jam64(b_sig, exp_diff);
+		z_exp = a_exp;
+	} else if (exp_diff < 0) {
+		if (b_exp == 0x7FF) return b_sig ? f64_nan_in(a, b, mode) : sign | F64_INF;
+		if (a_exp == 0) ++exp_diff; else a_sig |= 0x2000000000000000ULL;
+		a_sig = shift_right_jam64(a_sig, -exp_diff);
+		z_exp = b_exp;
+	} else {
+		if (a_exp == 0x7FF) return (a_sig | b_sig) ? f64_nan_in(a, b, mode) : sign | F64_INF;
+		if (a_exp == 0) return sign | ((a_sig + b_sig) >> 9);
+		return f64_round_pack_in(sign, a_exp, 0x4000000000000000ULL + a_sig + b_sig, mode);
+	}
+	a_sig |= 0x2000000000000000ULL;
+	z_sig = (a_sig + b_sig) << 1;
+	--z_exp;
+	if ((int64_t) z_sig < 0) {
+		z_sig = a_sig + b_sig;
+		++z_exp;
+	}
+	return f64_round_pack_in(sign, z_exp, z_sig, mode);
+}
+
+FP_INLINE uint64_t f64_sub_mags(uint64_t a, uint64_t b, uint64_t sign, int mode) {
+	int32_t a_exp = F64_EXP(a);
+	int32_t b_exp = F64_EXP(b);
+	uint64_t a_sig = F64_FRAC(a) << 10;
+	uint64_t b_sig = F64_FRAC(b) << 10;
+	int32_t exp_diff = a_exp - b_exp;
+
+	if (exp_diff > 0) {
+		if (a_exp == 0x7FF) return a_sig ? f64_nan_in(a, b, mode) : sign | F64_INF;
+		if (b_exp == 0) --exp_diff; else b_sig |= 0x4000000000000000ULL;
+		b_sig = shift_right_jam64(b_sig, exp_diff);
+		a_sig |= 0x4000000000000000ULL;
+	} else if (exp_diff < 0) {
+		if (b_exp == 0x7FF) return b_sig ? f64_nan_in(a, b, mode) : (sign ^ F64_SIGN) | F64_INF;
+		if (a_exp == 0) ++exp_diff; else a_sig |= 0x4000000000000000ULL;
+		a_sig = shift_right_jam64(a_sig, -exp_diff);
+		b_sig |= 0x4000000000000000ULL;
+		a_exp = b_exp;
+	} else {
+		if (a_exp == 0x7FF) return (a_sig | b_sig) ? f64_nan_in(a, b, mode) : F64_DEFAULT_NAN;
+		if (a_exp == 0) a_exp = 1;
+		if (a_sig == b_sig) return exact_zero_is_negative(mode) ? F64_SIGN : 0;
+	}
+	if (a_sig < b_sig) {
+		uint64_t tmp = a_sig;
+		a_sig = b_sig;
+		b_sig = tmp;
+		sign ^= F64_SIGN;
+	}
+	return f64_norm_round_pack_in(sign, a_exp - 1, a_sig - b_sig, mode);
+}
+
+FP_INLINE uint64_t f64_add_in(uint64_t a, uint64_t b, int mode) {
+	a = f64_flush_in(a, mode);
+	b = f64_flush_in(b, mode);
+	uint64_t sign = a & F64_SIGN;
+	if (sign == (b & F64_SIGN)) return f64_add_mags(a, b, sign, mode);
+	return f64_sub_mags(a, b, sign, mode);
+}
+
+FP_INLINE uint64_t f64_sub_in(uint64_t a, uint64_t b, int mode) {
+	a = f64_flush_in(a, mode);
+	b = f64_flush_in(b, mode);
+	uint64_t sign = a & F64_SIGN;
+	if (sign == (b & F64_SIGN)) return f64_sub_mags(a, b, sign, mode);
+	return f64_add_mags(a, b, sign, mode);
+}
+
+FP_INLINE uint64_t f64_mul_in(uint64_t a, uint64_t b, int mode) {
+	a = f64_flush_in(a, mode);
+	b = f64_flush_in(b, mode);
+	uint64_t sign = (a ^ b) & F64_SIGN;
+	int32_t a_exp = F64_EXP(a);
+	int32_t b_exp = F64_EXP(b);
+	uint64_t a_sig = F64_FRAC(a);
+	uint64_t b_sig = F64_FRAC(b);
+
+	if ((uint32_t) (a_exp - 1) < 0x7FE && (uint32_t) (b_exp - 1) < 0x7FE) {
+		goto multiply;
+	}
+	if (a_exp == 0x7FF || b_exp == 0x7FF) {
+		if ((a_exp == 0x7FF && a_sig) || (b_exp == 0x7FF && b_sig)) return f64_nan_in(a, b, mode);
+		if ((a_exp | a_sig) == 0 || (b_exp | b_sig) == 0) return F64_DEFAULT_NAN;
+		return sign | F64_INF;
+	}
+	if (a_exp == 0) {
+		if (a_sig == 0) return sign;
+		f64_norm_subnormal(&a_exp, &a_sig);
+	}
+	if (b_exp == 0) {
+		if (b_sig == 0) return sign;
+		f64_norm_subnormal(&b_exp, &b_sig);
+	}
+
+multiply: ;
+	// The 106-bit product of the significands has its leading bit at 125 or 124
+	int32_t z_exp = a_exp + b_exp - 0x3FF;
+	uint64_t lo;
+	uint64_t z_sig = mul64_to_128((a_sig | F64_HIDDEN) << 10, (b_sig | F64_HIDDEN) << 11, &lo);
+	z_sig |= lo != 0;
+	if (z_sig < 0x4000000000000000ULL) {
+		--z_exp;
+		z_sig <<= 1;
+	}
+	return f64_round_pack_in(sign, z_exp, z_sig, mode);
+}
+
+// As f32_compare_in()
+FP_INLINE uint32_t f64_compare_in(uint64_t a, uint64_t b, int mode) {
+	a = f64_flush_in(a, mode);
+	b = f64_flush_in(b, mode);
+	if (f64_is_nan(a) || f64_is_nan(b)) return FLAGS_UNORDERED;
+	if (a == b || ((a | b) & ~F64_SIGN) == 0) return FLAGS_EQUAL;
+	int less = (a & F64_SIGN) != (b & F64_SIGN) ? (a & F64_SIGN) != 0 : (a < b) != ((a & F64_SIGN) != 0);
+	return less ? FLAGS_LESS : FLAGS_GREATER;
+}
+
+#ifdef DO_FAST_DIV_SQRT
+/*
+* Returns ('rem' << 29) / 'b_sig' rounded down and makes 'rem' the
+* remainder, where 'rem' is below twice 'b_sig', 'b_sig' has its leading
+* bit at 52 and 'recip' is approx_recip32() of its top 32 bits. The
+* estimate is off by a few units at most, in either direction as the top
+* bits of 'b_sig' are rounded down.
+*/
+static inline uint32_t f64_div_step(uint64_t* rem, uint64_t b_sig, uint32_t recip) {
+	uint32_t q = ((*rem >> 22) * recip) >> 33;
+	int64_t r = (int64_t) ((*rem << 29) - q * b_sig);
+	while (r < 0) {
+		q--;
+		r += b_sig;
+	}
+	while (r >= (int64_t) b_sig) {
+		q++;
+		r -= b_sig;
+	}
+	*rem = r;
+	return q;
+}
+
+/*
+* Returns 'a_sig' / 'b_sig' with its leading bit at 62 and the sticky bit
+* set if it is inexact, where 'b_sig' has its leading bit at 52 and the
+* quotient is in [1, 2). It is worked out 29 bits at a time, which leaves
+* the 58 bits above the sticky bit exact: more than rounding needs.
+*/
+static inline uint64_t f64_div_sig(uint64_t a_sig, uint64_t b_sig) {
+	uint32_t recip = approx_recip32(b_sig >> 21);
+	uint64_t rem = a_sig;
+	uint64_t q = (uint64_t) f64_div_step(&rem, b_sig, recip) << 29;
+	q |= f64_div_step(&rem, b_sig, recip);
+	return (q << 4) | (rem != 0);
+}
+#else
+// Restoring division, one bit at a time. The steps are branch-free as each quotient bit is unpredictable.
+static inline uint64_t f64_div_sig(uint64_t rem, uint64_t b_sig) {
+	uint64_t z_sig = 0;
+	for (int i = 0; i < 63; i++) {
+		uint64_t bit = rem >= b_sig;
+		rem -= b_sig & -bit;
+		z_sig = (z_sig << 1) | bit;
+		rem <<= 1;
+	}
+	return z_sig | (rem != 0);
+}
+#endif
+
+FP_INLINE uint64_t f64_div_in(uint64_t a, uint64_t b, int mode) {
+	a = f64_flush_in(a, mode);
+	b = f64_flush_in(b, mode);
+	uint64_t sign = (a ^ b) & F64_SIGN;
+	int32_t a_exp = F64_EXP(a);
+	int32_t b_exp = F64_EXP(b);
+	uint64_t a_sig = F64_FRAC(a);
+	uint64_t b_sig = F64_FRAC(b);
+
+	if ((uint32_t) (a_exp - 1) < 0x7FE && (uint32_t) (b_exp - 1) < 0x7FE) {
+		goto divide;
+	}
+	if (a_exp == 0x7FF) {
+		if (a_sig || (b_exp == 0x7FF && b_sig)) return f64_nan_in(a, b, mode);
+		if (b_exp == 0x7FF) return F64_DEFAULT_NAN;
+		return sign | F64_INF;
+	}
+	if (b_exp == 0x7FF) {
+		if (b_sig) return f64_nan_in(a, b, mode);
+		return sign;
+	}
+	if (b_exp == 0) {
+		if (b_sig == 0) {
+			if ((a_exp | a_sig) == 0) return F64_DEFAULT_NAN;
+			return sign | F64_INF;
+		}
+		f64_norm_subnormal(&b_exp, &b_sig);
+	}
+	if (a_exp == 0) {
+		if (a_sig == 0) return sign;
+		f64_norm_subnormal(&a_exp, &a_sig);
+	}
+
+divide: ;
+	int32_t z_exp = a_exp - b_exp + 0x3FE;
+	a_sig |= F64_HIDDEN;
+	b_sig |= F64_HIDDEN;
+	if (a_sig < b_sig) {
+		--z_exp;
+		a_sig <<= 1;
+	}
+	return f64_round_pack_in(sign, z_exp, f64_div_sig(a_sig, b_sig), mode);
+}
+
+/*
+* Returns the 54-bit square root of 'a_sig' << 'shift', where 'a_sig' has
+* its leading bit at 52 and 'shift' is 54 or 55, moved up to have its
+* leading bit at 62 and with the sticky bit set if it is inexact.
+* The fast version takes the root of the top 32 bits as for single
+* precision, then one Newton-Raphson step with the same reciprocal square
+* root; the remainder is then small enough to be worked out modulo 2^64.
+*/
+static inline uint64_t f64_sqrt_sig(uint64_t a_sig, int shift) {
+	#ifdef DO_FAST_DIV_SQRT
+	uint32_t x32 = a_sig >> (76 - shift);
+	uint32_t recip = approx_rsqrt32(x32);
+	uint64_t root = ((uint64_t) x32 * recip) >> 32;
+	// The root of the top bits is below that of the whole, so 'err' is positive
+	uint64_t err = (a_sig << (shift - 46)) - root * root;
+	root = (root << 23) + (((err >> 8) * recip) >> 32);
+	int64_t rem = (int64_t) ((a_sig << shift) - root * root);
+	while (rem < 0) {
+		rem += 2 * root - 1;
+		root--;
+	}
+	while (rem > (int64_t) (2 * root)) {
+		rem -= 2 * root + 1;
+		root++;
+	}
+	return (root << 9) | (rem != 0);
+	#else
+	int inexact;
+	uint64_t root = isqrt_wide(a_sig >> (64 - shift), a_sig << shift, 54, &inexact);
+	return (root << 9) | inexact;
+	#endif
+}
+
+FP_INLINE uint64_t f64_sqrt_in(uint64_t a, int mode) {
+	a = f64_flush_in(a, mode);
+	uint64_t sign = a & F64_SIGN;
+	int32_t a_exp = F64_EXP(a);
+	uint64_t a_sig = F64_FRAC(a);
+
+	if (a_exp == 0x7FF) {
+		if (a_sig) return f64_nan_in(a, a, mode);
+		return sign ? F64_DEFAULT_NAN : a;
+	}
+	if (a_exp == 0 && a_sig == 0) return a;
+	if (sign) return F64_DEFAULT_NAN;
+	if (a_exp == 0) f64_norm_subnormal(&a_exp, &a_sig);
+
+	/*
+	* a = sig * 2^(a_exp - 1075), where sig has its leading bit at 52. Shift
+	* sig up into [2^106, 2^108) by an even amount relative to the exponent,
+	* so the 54-bit root holds one bit beyond the final precision; the
+	* remainder supplies the sticky bit.
+	*/
+	a_sig |= F64_HIDDEN;
+	int shift = (a_exp & 1) ? 54 : 55;
+	int32_t z_exp = 1075 + (a_exp - 1075 - shift) / 2;
+	return f64_round_pack_in(0, z_exp, f64_sqrt_sig(a_sig, shift), mode);
+}
+
+uint64_t f64_add(uint64_t a, uint64_t b) { return f64_add_in(a, b, ROUND_NEAREST); }
+uint64_t f64_sub(uint64_t a, uint64_t b) { return f64_sub_in(a, b, ROUND_NEAREST); }
+uint64_t f64_mul(uint64_t a, uint64_t b) { return f64_mul_in(a, b, ROUND_NEAREST); }
+uint64_t f64_div(uint64_t a, uint64_t b) { return f64_div_in(a, b, ROUND_NEAREST); }
+uint64_t f64_sqrt(uint64_t a) { return f64_sqrt_in(a, ROUND_NEAREST); }
+uint32_t f64_compare(uint64_t a, uint64_t b) { return f64_compare_in(a, b, ROUND_NEAREST); }
+
+// As f32_round_to_int_mag()
+static inline uint64_t f64_round_to_int_mag(uint64_t a, int frac_bits, int rmode) {
+	uint64_t sign = a & F64_SIGN;
+	int32_t exp = F64_EXP(a);
+	uint64_t sig = F64_FRAC(a);
+	if (exp + frac_bits >= 0x3FF + 32) return (uint64_t) 1 << 32;
+	if (exp) sig |= F64_HIDDEN;
+	else exp = 1;
+
+	// As fixed point with 32 fraction bits: (sig << 11) * 2^(exp + frac_bits - 1054), which never shifts left
+	uint64_t fixed = shift_right_jam64(sig << 11, 1075 - 21 - exp - frac_bits);
+	uint64_t whole = fixed >> 32;
+	uint32_t frac = (uint32_t) fixed;
+	switch (rmode) {
+		case ROUND_NEAREST:
+			whole += frac > 0x80000000 || (frac == 0x80000000 && (whole & 1));
+			break;
+		case ROUND_PLUS_INF:
+			whole += !sign && frac;
+			break;
+		case ROUND_MINUS_INF:
+			whole += sign && frac;
+			break;
+	}
+	return whole;
+}
+
+// As f32_to_fixed()
+uint32_t f64_to_fixed(uint64_t a, int frac_bits, int size, int is_unsigned, int mode) {
+	int rmode = mode & FP_MODE_RMODE;
+	int32_t exp = F64_EXP(a) + frac_bits;
+	if (rmode == ROUND_ZERO && exp >= 0x3FF && exp < 0x3FF + size - 1) {
+		uint32_t mag = (uint32_t) ((F64_FRAC(a) | F64_HIDDEN) >> (1075 - exp));
+		if (!(a & F64_SIGN)) return mag;
+		return is_unsigned ? 0 : -mag;
+	}
+	if (f64_is_nan(a)) return 0;
+	a = f64_flush_in(a, mode);
+	return saturate_mag(f64_round_to_int_mag(a, frac_bits, rmode), (a & F64_SIGN) != 0, size, is_unsigned);
+}
+
+// As fixed_to_f32(), but every fixed-point number is exact in double precision
+uint64_t fixed_to_f64(uint32_t a, int frac_bits, int size, int is_unsigned) {
+	if (size == 16) a = is_unsigned ? (uint16_t) a : (uint32_t) (int16_t) a;
+	uint64_t sign = !is_unsigned && (int32_t) a < 0 ? F64_SIGN : 0;
+	uint32_t mag = sign ? -a : a;
+	if (mag == 0) return 0;
+	int lead = 31 - __builtin_clz(mag);
+	return sign + ((uint64_t) (0x3FE + lead - frac_bits) << 52) + ((uint64_t) mag << (52 - lead));
+}
+
+int32_t f64_to_i32(uint64_t a, int mode) {
+	return (int32_t) f64_to_fixed(a, 0, 32, 0, mode);
+}
+
+uint32_t f64_to_u32(uint64_t a, int mode) {
+	return f64_to_fixed(a, 0, 32, 1, mode);
+}
+
+uint64_t i32_to_f64(int32_t a) {
+	return fixed_to_f64((uint32_t) a, 0, 32, 0);
+}
+
+uint64_t u32_to_f64(uint32_t a) {
+	return fixed_to_f64(a, 0, 32, 1);
+}
+
+/*
+* Conversions between precisions. NaNs keep their payloads as far as they
+* fit and are made quiet, or become the default NaN in DN mode, and FZ
+* mode flushes subnormal single and double precision operands and results.
+* Half precision is the IEEE format (the FPSCR's AHP bit is not emulated)
+* and, as on hardware, is never flushed.
+*/
+uint64_t f32_to_f64(uint32_t a, int mode) {
+	a = f32_flush_in(a, mode);
+	uint64_t sign = (uint64_t) (a & F32_SIGN) << 32;
+	int32_t exp = F32_EXP(a);
+	uint32_t frac = F32_FRAC(a);
+	if (exp == 0xFF) {
+		if (frac == 0) return sign | F64_INF;
+		if (mode & FP_MODE_DN) return F64_DEFAULT_NAN;
+		return sign | F64_INF | F64_QUIET | ((uint64_t) frac << 29);
+	}
+	if (exp == 0) {
+		if (frac == 0) return sign;
+		f32_norm_subnormal(&exp, &frac);
+	} else {
+		frac |= 0x00800000;
+	}
+	// Widening is exact: rebias the exponent, the hidden bit adding one to it
+	return sign + ((uint64_t) (exp + 0x380 - 1) << 52) + ((uint64_t) frac << 29);
+}
+
+uint32_t f64_to_f32(uint64_t a, int mode) {
+	a = f64_flush_in(a, mode);
+	uint32_t sign = (uint32_t) (a >> 32) & F32_SIGN;
+	int32_t exp = F64_EXP(a);
+	uint64_t frac = F64_FRAC(a);
+	if (exp == 0x7FF) {
+		if (frac == 0) return sign | F32_INF;
+		if (mode & FP_MODE_DN) return F32_DEFAULT_NAN;
+		return sign | F32_INF | F32_QUIET | (uint32_t) (frac >> 29);
+	}
+	if (exp == 0 && frac == 0) return sign;
+	if (exp) frac |= F64_HIDDEN;
+	else exp = 1;
+	// The leading bit lands on bit 30, and the bits below the seven round bits only matter as a sticky bit
+	return f32_round_pack_in(sign, exp - 0x381, short_shift_right_jam64(frac, 22), mode);
+}
+
+/*
+* Half precision values are in the low 16 bits. Normal halves only need
+* their exponent rebiased by 127 - 15, which is one addition.
+*/
+uint32_t f16_to_f32(uint32_t h, int mode) {
+	uint32_t sign = (h & 0x8000) << 16;
+	uint32_t mag = h & 0x7FFF;
+	if (mag - 0x0400 < 0x7800) return sign | ((mag << 13) + 0x38000000);
+	if (mag >= 0x7C00) {
+		if (mag == 0x7C00) return sign | F32_INF;
+		if (mode & FP_MODE_DN) return F32_DEFAULT_NAN;
+		return sign | F32_INF | F32_QUIET | ((mag & 0x3FF) << 13);
+	}
+	if (mag == 0) return sign;
+	// A subnormal half, mag * 2^-24, is a normal single: its leading bit becomes the hidden bit
+	int lead = 31 - __builtin_clz(mag);
+	return sign + ((uint32_t) (0x7F - 24 - 1 + lead) << 23) + (mag << (23 - lead));
+}
+
+/*
+* When the result is a normal half, the 13 bits dropped from the fraction
+* are rounded in place: adding the increment carries into the exponent
+* when the fraction overflows, and into infinity past the largest half.
+*/
+uint32_t f32_to_f16(uint32_t a, int mode) {
+	int rmode = mode & FP_MODE_RMODE;
+	uint32_t sign = (a >> 16) & 0x8000;
+	int32_t exp = F32_EXP(a);
+	uint32_t increment = round_increment(rmode, sign != 0, 13);
+	if ((uint32_t) (exp - 113) < 30) {
+		uint32_t low = a & 0x1FFF;
+		uint32_t h = (((a & ~F32_SIGN) >> 13) - (112 << 10)) + ((low + increment) >> 13);
+		if (rmode == ROUND_NEAREST && low == 0x1000) h &= ~1;
+		return sign | h;
+	}
+	if (exp == 0xFF) {
+		if (F32_FRAC(a) == 0) return sign | 0x7C00;
+		if (mode & FP_MODE_DN) return 0x7E00;
+		return sign | 0x7E00 | (F32_FRAC(a) >> 13);
+	}
+	if (exp >= 143) return increment == 0 ? sign | 0x7BFF : sign | 0x7C00;
+
+	// Subnormal or zero: the significand in units of 2^-37, i.e. with 13 bits below a half's last place
+	a = f32_flush_in(a, mode);
+	uint32_t sig = F32_FRAC(a);
+	if (exp) sig |= 0x00800000;
+	else exp = 1;
+	sig = shift_right_jam32(sig, 113 - exp);
+	uint32_t h = (sig + increment) >> 13;
+	if (rmode == ROUND_NEAREST && (sig & 0x1FFF) == 0x1000) h &= ~1;
+	return sign | h;
+}
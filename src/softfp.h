@@ -0,0 +1,267 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* emulating softfp ABI boundaries as one unit: the 'vmov sN, rM' transfers
+* that move arguments into FP registers, the FP operations on them and the
+* 'vmov rM, sN' transfers that move the results back.
+*/
+#define DO_SOFTFP_ELISION
+
+// Limits on the parts of a transfer sandwich
+#define MAX_SANDWICH_IN 4
+#define MAX_SANDWICH_OPS 8
+#define MAX_SANDWICH_OUT 4
+#define MAX_SANDWICH_SLOTS 8
+
+/*
+* Binary operations that can appear between the transfers, with the integer
+* kernel each is computed by.
+*/
+struct sandwich_kernel {
+	unsigned int id;
+	uint32_t (*kernel)(uint32_t, uint32_t);
+};
+
+struct sandwich_kernel sandwich_kernels[] = {
+	{ ARM_INS_VADD, &fpu_f32_add },
+	{ ARM_INS_VSUB, &fpu_f32_sub },
+	{ ARM_INS_VMUL, &fpu_f32_mul },
+};
+#define NUM_SANDWICH_KERNELS (sizeof(sandwich_kernels) / sizeof(sandwich_kernels[0]))
+
+/*
+* One operation of a sandwich: 'kernel' indexes 'sandwich_kernels' and the
+* operands index the sandwich's slots.
+*/
+struct sandwich_op {
+	uint8_t kernel;
+	uint8_t d;
+	uint8_t n;
+	uint8_t m;
+};
+
+/*
+* Descriptor of a sandwich. Each FP register it mentions gets a slot, a local
+* variable of the routine, with 'slot_bank' giving the register's bank index.
+* Slots in 'load_mask' are read before they are written, so they start with
+* the register's value; slots in 'store_mask' are written back to the bank
+* afterwards. Transfers move values between core registers (frame indices)
+* and slots.
+*/
+struct sandwich_desc {
+	uint8_t num_in;
+	uint8_t num_ops;
+	uint8_t num_out;
+	uint8_t num_slots;
+	uint8_t load_mask;
+	uint8_t store_mask;
+	uint8_t slot_bank[MAX_SANDWICH_SLOTS];
+	uint8_t in_reg[MAX_SANDWICH_IN];
+	uint8_t in_slot[MAX_SANDWICH_IN];
+	struct sandwich_op ops[MAX_SANDWICH_OPS];
+	uint8_t out_reg[MAX_SANDWICH_OUT];
+	uint8_t out_slot[MAX_SANDWICH_OUT];
+};
+
+/*
+* Emulation routine for a sandwich. The arguments come straight from the
+* saved core registers and the results go straight back to them; the bank
+* is only read for registers used without being transferred in and only
+* written for registers that may be read after the sandwich.
+*/
+void softfp_sandwich(const struct sandwich_desc* desc, struct tramp_frame* frame) {
+	uint32_t slots[MAX_SANDWICH_SLOTS];
+	for (int i = 0; i < desc->num_slots; i++) {
+		if (desc->load_mask & (1 << i)) {
+			slots[i] = fpu_registers[desc->slot_bank[i]];
+		}
+	}
+	for (int i = 0; i < desc->num_in; i++) {
+		slots[desc->in_slot[i]] = frame->r[desc->in_reg[i]];
+	}
+	for (int i = 0; i < desc->num_ops; i++) {
+		const struct sandwich_op* op = &desc->ops[i];
+		slots[op->d] = sandwich_kernels[op->kernel].kernel(slots[op->n], slots[op->m]);
+	}
+	for (int i = 0; i < desc->num_out; i++) {
+		frame->r[desc->out_reg[i]] = slots[desc->out_slot[i]];
+	}
+	for (int i = 0; i < desc->num_slots; i++) {
+		if (desc->store_mask & (1 << i)) {
+			fpu_registers[desc->slot_bank[i]] = slots[i];
+		}
+	}
+}
+
+/*
+* Returns the slot of 'desc' for the single precision register operand 'op',
+* giving it a new slot if it hasn't got one. 'reading' says whether the
+* instruction reads the register, which makes a new slot start with its
+* value. Returns -1 if 'op' isn't such a register or the slots have run out.
+*/
+int sandwich_slot(struct sandwich_desc* desc, cs_arm_op* op, int reading) {
+	if (op->type != ARM_OP_REG || op->reg < ARM_REG_S0 || op->reg > ARM_REG_S31) {
+		return -1;
+	}
+	uint8_t index = sreg_to_bank_index(op->reg);
+	for (int i = 0; i < desc->num_slots; i++) {
+		if (desc->slot_bank[i] == index) {
+			return i;
+		}
+	}
+	if (desc->num_slots == MAX_SANDWICH_SLOTS) {
+		return -1;
+	}
+	int slot = desc->num_slots++;
+	desc->slot_bank[slot] = index;
+	if (reading) {
+		desc->load_mask |= 1 << slot;
+	}
+	return slot;
+}
+
+// Returns the frame index of core register operand 'op', or -1 if it isn't one of r0-r12
+int sandwich_core_reg(cs_arm_op* op) {
+	if (op->type != ARM_OP_REG || op->reg < ARM_REG_R0 || op->reg > ARM_REG_R12) {
+		return -1;
+	}
+	return op->reg - ARM_REG_R0;
+}
+
+/*
+* Returns whether 'instr' returns from a function: 'bx lr', 'pop {..., pc}'
+* or 'ldr pc, [sp], #4', unconditionally.
+*/
+int is_arm_return(uint32_t instr) {
+	return instr == 0xE12FFF1E || (instr & 0xFFFF8000) == 0xE8BD8000 || instr == 0xE49DF004;
+}
+
+/*
+* Where the next instruction of a sandwich is added: the transfers in,
+* the operations or the transfers out.
+*/
+#define SANDWICH_IN 0
+#define SANDWICH_OPS 1
+#define SANDWICH_OUT 2
+
+/*
+* Adds the instruction 'insn' to the sandwich being built in 'desc', which
+* is in part 'part'. Returns the part the sandwich is in afterwards, or -1
+* if the instruction can't be added.
+*/
+int sandwich_add(struct sandwich_desc* desc, cs_insn* insn, int part) {
+	cs_arm* arm = &(insn->detail->arm);
+	if (arm->cc != ARM_CC_AL && arm->cc != ARM_CC_INVALID) {
+		return -1;
+	}
+
+	if (insn->id == ARM_INS_VMOV && arm->op_count == 2) {
+		int core_in = sandwich_core_reg(&arm->operands[1]);
+		int core_out = sandwich_core_reg(&arm->operands[0]);
+		if (core_in >= 0 && part == SANDWICH_IN && desc->num_in < MAX_SANDWICH_IN) {
+			int slot = sandwich_slot(desc, &arm->operands[0], 0);
+			if (slot < 0) {
+				return -1;
+			}
+			desc->in_reg[desc->num_in] = core_in;
+			desc->in_slot[desc->num_in] = slot;
+			desc->num_in++;
+			desc->store_mask |= 1 << slot;
+			return SANDWICH_IN;
+		}
+		if (core_out >= 0 && part != SANDWICH_IN && desc->num_out < MAX_SANDWICH_OUT) {
+			int slot = sandwich_slot(desc, &arm->operands[1], 1);
+			if (slot < 0) {
+				return -1;
+			}
+			desc->out_reg[desc->num_out] = core_out;
+			desc->out_slot[desc->num_out] = slot;
+			desc->num_out++;
+			return SANDWICH_OUT;
+		}
+		return -1;
+	}
+
+	if (part == SANDWICH_OUT || desc->num_ops == MAX_SANDWICH_OPS || arm->op_count != 3) {
+		return -1;
+	}
+	for (int k = 0; k < NUM_SANDWICH_KERNELS; k++) {
+		if (sandwich_kernels[k].id != insn->id) {
+			continue;
+		}
+		struct sandwich_op* op = &desc->ops[desc->num_ops];
+		int n = sandwich_slot(desc, &arm->operands[1], 1);
+		int m = sandwich_slot(desc, &arm->operands[2], 1);
+		int d = sandwich_slot(desc, &arm->operands[0], 0);
+		if (n < 0 || m < 0 || d < 0) {
+			return -1;
+		}
+		op->kernel = k;
+		op->d = d;
+		op->n = n;
+		op->m = m;
+		desc->num_ops++;
+		desc->store_mask |= 1 << d;
+		return SANDWICH_OPS;
+	}
+	return -1;
+}
+
+/*
+* If the instructions starting at 'head' move arguments from core registers
+* into FP registers, operate on them and move the results back, generates a
+* trampoline that emulates all of it with one call to softfp_sandwich().
+* When the sandwich is followed by a return, as in a leaf float helper, the
+* caller-saved registers s0-s15 are dead afterwards and aren't written back.
+* Sets 'sandwich_end' to just after the last transfer out.
+* Returns NULL if there is no such sandwich at 'head'.
+*/
+void* generate_sandwich_trampoline(int8_t* head, int8_t* end, int8_t** sandwich_end) {
+	if (((uintptr_t) head & 3) != 0) {
+		return NULL;
+	}
+	struct sandwich_desc desc;
+	memset(&desc, 0, sizeof(desc));
+
+	int8_t* instr = head;
+	int part = SANDWICH_IN;
+	// Remembers the sandwich as it was after the last transfer out, where it may end
+	struct sandwich_desc complete;
+	int8_t* complete_end = NULL;
+	while (instr + 4 <= end) {
+		cs_insn* disassembly = disassemble_instr(instr);
+		if (disassembly == NULL) {
+			break;
+		}
+		part = sandwich_add(&desc, disassembly, part);
+		free(disassembly);
+		if (part < 0) {
+			break;
+		}
+		instr += 4;
+		if (part == SANDWICH_OUT) {
+			memcpy(&complete, &desc, sizeof(desc));
+			complete_end = instr;
+		}
+	}
+	if (complete_end == NULL || complete.num_in == 0 || complete.num_ops == 0) {
+		return NULL;
+	}
+
+	if (complete_end + 4 <= end && is_arm_return(*(uint32_t*) complete_end)) {
+		for (int i = 0; i < complete.num_slots; i++) {
+			if (complete.slot_bank[i] < 16) {
+				complete.store_mask &= ~(1 << i);
+			}
+		}
+	}
+
+	void* code = generate_frame_trampoline(head, complete_end, &complete, sizeof(complete), &softfp_sandwich, 0);
+	if (code == NULL) {
+		return NULL;
+	}
+	*sandwich_end = complete_end;
+	printfdbg("Sandwich trampoline made at %p for %p-%p (%d in, %d ops, %d out)\n",
+		code, head, complete_end, complete.num_in, complete.num_ops, complete.num_out);
+	stat_inc(STAT_SANDWICHES);
+	return code;
+}
@@ -0,0 +1,62 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* counting what the instrumentation does and printing the counts to
+* stderr when the program exits.
+*/
+//#define DO_STATS
+
+/*
+* Events that are counted. Each has a line in the statistics output,
+* named by the entry at the same position in 'stat_names'.
+*/
+enum stat_id {
+	STAT_TEMPLATE_TRAMPS,
+	STAT_JIT_TRAMPS,
+	STAT_BLOCK_TRAMPS,
+	STAT_REGIONS,
+	STAT_TIER0_TRAMPS,
+	STAT_TIER_UP_JIT,
+	STAT_TIER_UP_BLOCK,
+	STAT_TIER_UP_FAILED,
+	STAT_SANDWICHES,
+	STAT_MEM_TRAMPS,
+	STAT_XFER_TRAMPS,
+	STAT_THUMB_TRAMPS,
+	STAT_ISLANDS,
+	STAT_PROBES_FAILED,
+	NUM_STATS
+};
+
+const char* stat_names[NUM_STATS] = {
+	"template trampolines",
+	"JIT trampolines",
+	"block trampolines",
+	"loop regions",
+	"tier-0 trampolines",
+	"tier 0 -> 1 (JIT)",
+	"tier 0 -> 1 (block)",
+	"tier 0 -> 1 failed",
+	"softfp sandwiches",
+	"load/store trampolines",
+	"transfer trampolines",
+	"Thumb trampolines",
+	"islands",
+	"probes out of reach",
+};
+
+#ifdef DO_STATS
+  uint32_t stats[NUM_STATS];
+
+  // Counts can go up from generated code running on any thread
+  #define stat_inc(id) __atomic_add_fetch(&stats[id], 1, __ATOMIC_RELAXED)
+
+  static void print_stats(void) __attribute__((destructor));
+  static void print_stats(void) {
+	fprintf(stderr, "arm-fp-emu statistics:\n");
+	for (int i = 0; i < NUM_STATS; i++) {
+		fprintf(stderr, "\t%-24s %u\n", stat_names[i], stats[i]);
+	}
+  }
+#else
+  #define stat_inc(id)
+#endif
@@ -0,0 +1,210 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* instrumenting Thumb-2 code. Which parts of a file are Thumb is worked out
+* from its symbols; everything else is scanned as ARM code.
+*/
+#define DO_THUMB
+
+#include <fcntl.h>
+
+/*
+* The instruction set of the code from 'addr' up to the next change, as
+* given by a file's symbols. 'addr' is a run-time address.
+*/
+#define STATE_ARM 0
+#define STATE_THUMB 1
+#define STATE_DATA 2
+
+struct state_change {
+	uintptr_t addr;
+	int state;
+};
+
+int compare_state_changes(const void* a, const void* b) {
+	uintptr_t addr_a = ((const struct state_change*) a)->addr;
+	uintptr_t addr_b = ((const struct state_change*) b)->addr;
+	return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+/*
+* Returns the state named by mapping symbol 'name' ('$a', '$t' or '$d',
+* optionally followed by '.' and more), or -1 if it isn't one.
+*/
+int mapping_symbol_state(const char* name) {
+	if (name[0] != '$' || name[1] == '\0' || (name[2] != '\0' && name[2] != '.')) {
+		return -1;
+	}
+	switch (name[1]) {
+		case 'a': return STATE_ARM;
+		case 't': return STATE_THUMB;
+		case 'd': return STATE_DATA;
+	}
+	return -1;
+}
+
+/*
+* Reads the changes of instruction set in the file described by 'meta',
+* loaded at 'l_addr', into a sorted array and returns how many there are,
+* or 0 if they can't be found. The ARM mapping symbols ('$a', '$t', '$d')
+* of the full symbol table mark every change, including literal pools.
+* Stripped files only have '.dynsym', where the state is taken from bit 0
+* of each function's address and lasts until the next function.
+* The caller frees '*changes_out'.
+*/
+int read_state_changes(struct file_metadata* meta, ElfW(Addr) l_addr, struct state_change** changes_out) {
+	ElfW(Shdr)* symtab = NULL;
+	for (int i = 0; i < meta->ehdr->e_shnum; i++) {
+		ElfW(Shdr)* shdr = &meta->shdrs[i];
+		if (shdr->sh_type == SHT_SYMTAB || (shdr->sh_type == SHT_DYNSYM && symtab == NULL)) {
+			symtab = shdr;
+		}
+	}
+	int fd = meta->filename == NULL ? -1 : open(meta->filename, O_RDONLY);
+	if (symtab == NULL || fd < 0) {
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	ElfW(Shdr)* strtab = &meta->shdrs[symtab->sh_link];
+	ElfW(Sym)* syms = malloc(symtab->sh_size);
+	char* strs = malloc(strtab->sh_size);
+	size_t num_syms = symtab->sh_size / sizeof(ElfW(Sym));
+	struct state_change* changes = malloc(num_syms * sizeof(struct state_change));
+	int num_changes = 0;
+	if (pread(fd, syms, symtab->sh_size, symtab->sh_offset) == symtab->sh_size
+		&& pread(fd, strs, strtab->sh_size, strtab->sh_offset) == strtab->sh_size) {
+		for (size_t i = 0; i < num_syms; i++) {
+			if (syms[i].st_name >= strtab->sh_size) {
+				continue;
+			}
+			int state = mapping_symbol_state(strs + syms[i].st_name);
+			if (state >= 0) {
+				changes[num_changes].addr = l_addr + syms[i].st_value;
+				changes[num_changes].state = state;
+				num_changes++;
+			}
+		}
+		// Without mapping symbols, fall back on the functions
+		if (num_changes == 0) {
+			for (size_t i = 0; i < num_syms; i++) {
+				if (ELF32_ST_TYPE(syms[i].st_info) == STT_FUNC && syms[i].st_shndx != SHN_UNDEF) {
+					changes[num_changes].addr = l_addr + (syms[i].st_value & ~1);
+					changes[num_changes].state = (syms[i].st_value & 1) ? STATE_THUMB : STATE_ARM;
+					num_changes++;
+				}
+			}
+		}
+	}
+	close(fd);
+	free(syms);
+	free(strs);
+	qsort(changes, num_changes, sizeof(struct state_change), &compare_state_changes);
+	printfdbg("%d instruction set changes found in %s\n", num_changes, meta->filename);
+	*changes_out = changes;
+	return num_changes;
+}
+
+// Returns the size in bytes of the Thumb instruction whose first halfword is 'hw1'
+static inline int thumb_instr_size(uint16_t hw1) {
+	return (hw1 >> 11) >= 0x1D ? 4 : 2;
+}
+
+// Returns whether 'hw1' is an 'it' instruction (the hints share its encoding with a zero mask)
+static inline int is_thumb_it(uint16_t hw1) {
+	return (hw1 & 0xFF00) == 0xBF00 && (hw1 & 0xF) != 0;
+}
+
+/*
+* Moves the IT state of an 'it' block, its 'firstcond:mask' byte, on to
+* the next instruction. The block is over when it becomes zero.
+*/
+static inline uint8_t thumb_it_advance(uint8_t it) {
+	return (it & 0x7) == 0 ? 0 : (it & 0xE0) | ((it << 1) & 0x1F);
+}
+
+/*
+* Returns the ARM encoding of the 32-bit Thumb instruction at 'instr_addr'
+* if it is a VFP instruction, or 0 if it isn't. The Thumb-2 VFP encodings
+* are the ARM ones with 0b1110 in place of the condition field, stored as
+* two halfwords, so the emulator's ARM decoders can be used for both.
+* NEON instructions differ from their ARM encodings in their top byte.
+*/
+uint32_t thumb_vfp_to_arm(void* instr_addr) {
+	uint16_t hw1 = ((uint16_t*) instr_addr)[0];
+	uint16_t hw2 = ((uint16_t*) instr_addr)[1];
+	#ifdef DO_NEON
+	// Data processing is 111U 1111 in Thumb and 1111 001U in ARM, element loads and stores 1111 1001 and 1111 0100
+	if ((hw1 & 0xEF00) == 0xEF00) {
+		return 0xF2000000 | ((uint32_t) (hw1 & 0x1000) << 12) | ((uint32_t) (hw1 & 0xFF) << 16) | hw2;
+	}
+	if ((hw1 >> 8) == 0xF9) {
+		return 0xF4000000 | ((uint32_t) (hw1 & 0xFF) << 16) | hw2;
+	}
+	#endif
+	// Coprocessor instructions (first halfword 0xECxx-0xEExx) whose coprocessor field, bits 11:8 of the second, is 10 or 11
+	if ((hw1 >> 8) < 0xEC || (hw1 >> 8) > 0xEE || ((hw2 >> 9) & 0x7) != 0x5) {
+		return 0;
+	}
+	return ((uint32_t) hw1 << 16) | hw2;
+}
+
+/*
+* Replaces the 32-bit Thumb instruction at 'instr' with a 'b.w' to 'tramp'.
+* Thumb instructions are only halfword-aligned, so a probe that straddles
+* a word is written as two halfwords rather than one atomic store.
+* Inside an 'it' block the branch takes the block's condition, as long as
+* it is the block's last instruction, which the caller makes sure of.
+* A trampoline out of range is reached through an island, as for ARM code.
+*/
+int insert_thumb_probe(void* instr, void* tramp) {
+	printfdbg("Inserting Thumb probe at %p to connect to trampoline at %p\n", instr, tramp);
+	if (!thumb_branch_in_range(instr, tramp)) {
+		tramp = island_alloc((void*) ((uintptr_t) instr | 1), tramp);
+		if (tramp == NULL) {
+			printfdbg("ERROR: no island in range of Thumb instruction %p, leaving it in place\n", instr);
+			stat_inc(STAT_PROBES_FAILED);
+			return -1;
+		}
+	}
+	uint32_t probe = encode_thumb_branch(instr, tramp);
+	make_writable(instr, (int8_t*) instr + 4, NULL);
+	if (((uintptr_t) instr & 3) == 0) {
+		__atomic_store_n((uint32_t*) instr, probe, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n((uint16_t*) instr + 1, (uint16_t) (probe >> 16), __ATOMIC_RELEASE);
+		__atomic_store_n((uint16_t*) instr, (uint16_t) probe, __ATOMIC_RELEASE);
+	}
+	__builtin___clear_cache((char*) instr, (char*) instr + 4);
+	return 0;
+}
+
+/*
+* If the 32-bit Thumb instruction at 'instr_addr', whose ARM encoding is
+* 'instr', is a VFP instruction that is emulated, generates an ARM frame
+* trampoline that emulates it and returns to the Thumb code after it.
+* The data-processing routines ignore the frame they are passed. Returns
+* NULL otherwise.
+*/
+void* generate_thumb_trampoline(void* instr_addr, uint32_t instr) {
+	void* site = (void*) ((uintptr_t) instr_addr | 1);
+	void* resume = (void*) (((uintptr_t) instr_addr + 4) | 1);
+	void* code = NULL;
+
+	struct mem_desc mem;
+	int sp_adjust;
+	struct xfer_desc xfer;
+	struct emu_desc desc;
+	void* routine = decode_mem_instr(&instr, (uint32_t) (uintptr_t) instr_addr + 4, &mem, &sp_adjust);
+	if (routine != NULL) {
+		code = generate_frame_trampoline(site, resume, &mem, sizeof(mem), routine, sp_adjust);
+	} else if (decode_xfer_instr(&instr, &xfer)) {
+		code = generate_frame_trampoline(site, resume, &xfer, sizeof(xfer), &vxfer, 0);
+	} else if ((routine = decode_fp_instr(&instr, &desc)) != NULL) {
+		code = generate_frame_trampoline(site, resume, &desc, sizeof(desc), routine, 0);
+	}
+	if (code == NULL) {
+		return NULL;
+	}
+	printfdbg("Thumb trampoline made at %p for instruction at %p\n", code, instr_addr);
+	stat_inc(STAT_THUMB_TRAMPS);
+	return code;
+}
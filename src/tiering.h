@@ -0,0 +1,232 @@
+/*
+* Uncommenting/commenting this 'define' statement will enable or disable
+* tiered emulation. With it, every probe site first gets a cheap generic
+* trampoline that counts its executions, and only sites that turn out to be
+* hot are recompiled into a JIT or block trampoline.
+*/
+#define DO_TIERING
+
+#include <pthread.h>
+#include <semaphore.h>
+
+// Number of executions of a tier-0 trampoline before its site is recompiled
+#define TIER_UP_THRESHOLD 1000
+
+/*
+* Everything needed to recompile a site, stored in trampoline memory just
+* before its tier-0 code. The descriptor comes first so that the site's
+* address can be passed to the emulation routine as the descriptor.
+*/
+struct tier_site {
+	struct emu_desc desc;
+	int32_t countdown;		// executions left until recompilation
+	void* instr;			// the probe site
+	void* routine;
+	struct block_instr* run;	// run of FP instructions starting here, or NULL
+	int run_len;
+	int run_num_fp;
+	struct tier_site* next;		// in 'tier_queue'
+};
+
+// Upper bound on the number of instructions in a tier-0 trampoline
+#define TIER0_WORDS 20
+
+/*
+* Sites waiting to be recompiled, most recent first. Recompiling needs
+* malloc() and the trampoline pools, which the guest's thread can't use
+* from inside an FP instruction: it may be running a signal handler, or
+* have been interrupted while holding the allocator's lock. So tier_up()
+* only queues the site, and a thread of the emulator's own recompiles it.
+* 'tier_sem' wakes that thread once 'tier_worker_started' is set.
+*/
+struct tier_site* tier_queue = NULL;
+sem_t tier_sem;
+int tier_worker_started = 0;
+
+/*
+* Called from a tier-0 trampoline whose countdown has run out, by exactly
+* one of the threads running it. Queues the site for tier_worker() and
+* wakes it, using only atomic operations and sem_post(), which are
+* async-signal-safe. The caller finishes its emulation through tier 0.
+*/
+void tier_up(struct tier_site* site) {
+	struct tier_site* head = __atomic_load_n(&tier_queue, __ATOMIC_RELAXED);
+	do {
+		site->next = head;
+	} while (!__atomic_compare_exchange_n(&tier_queue, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (__atomic_load_n(&tier_worker_started, __ATOMIC_ACQUIRE)) {
+		sem_post(&tier_sem);
+	}
+}
+
+/*
+* Recompiles a queued site into a block trampoline if a run of FP
+* instructions starts there or a JIT trampoline otherwise, then retargets
+* the probe to it. The branch is rewritten in one store, so other threads
+* take either trampoline.
+* If the site can't be recompiled, or the probe can't reach the new
+* trampoline, it stays in tier 0 and only tries again after another 2^31
+* executions. The trampoline memory of a failed probe isn't reclaimed, as
+* the pools only grow.
+*/
+void tier_recompile(struct tier_site* site) {
+	void* tramp = NULL;
+	int stat = STAT_TIER_UP_FAILED;
+	#ifdef DO_BLOCK_FUSION
+	if (site->run != NULL) {
+		tramp = emit_block_trampoline(site->run, site->run_len, site->run_num_fp);
+		stat = STAT_TIER_UP_BLOCK;
+	}
+	#endif
+	#ifdef DO_JIT
+	if (tramp == NULL) {
+		tramp = jit_generate_trampoline(site->instr, &site->desc, site->routine);
+		stat = STAT_TIER_UP_JIT;
+	}
+	#endif
+
+	// The probe already has the instruction's condition
+	if (tramp == NULL || insert_probe(site->instr, tramp, arm_cond(*(uint32_t*) site->instr)) != 0) {
+		printfdbg("Site %p stays in tier 0\n", site->instr);
+		stat_inc(STAT_TIER_UP_FAILED);
+		__atomic_store_n(&site->countdown, INT32_MAX, __ATOMIC_RELAXED);
+		return;
+	}
+	printfdbg("Site %p moved to tier 1 (trampoline at %p)\n", site->instr, tramp);
+	stat_inc(stat);
+	free(site->run);
+	site->run = NULL;
+}
+
+/*
+* Body of the thread that recompiles the sites tier_up() queues. It takes
+* the whole queue at once, so pushing onto it never races with removal.
+* It runs with every signal blocked, so no handler runs while it holds
+* the allocator's or the pools' state.
+*/
+void* tier_worker(void* arg) {
+	for (;;) {
+		struct tier_site* site = __atomic_exchange_n(&tier_queue, NULL, __ATOMIC_ACQUIRE);
+		while (site != NULL) {
+			struct tier_site* next = site->next;
+			tier_recompile(site);
+			site = next;
+		}
+		while (sem_wait(&tier_sem) != 0) {
+			// Interrupted: wait again
+		}
+	}
+	return NULL;
+}
+
+/*
+* Starts tier_worker() once instrumentation is over, so the pools are only
+* used by one thread at a time. Sites queued before it starts are
+* recompiled first. A process forked afterwards has no worker, so its
+* sites stay in tier 0.
+*/
+void tier_init(void) {
+	if (sem_init(&tier_sem, 0, 0) != 0) {
+		printfdbg("ERROR: couldn't create the tiering semaphore, sites stay in tier 0\n");
+		return;
+	}
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t worker;
+	int ret = pthread_create(&worker, NULL, &tier_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		printfdbg("ERROR: couldn't start the tiering thread, sites stay in tier 0\n");
+		return;
+	}
+	pthread_detach(worker);
+	__atomic_store_n(&tier_worker_started, 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Frees what a tier-0 trampoline made by tier0_generate_trampoline() holds
+* outside trampoline memory, when its probe couldn't be inserted. The
+* trampoline itself stays in its pool, unused.
+*/
+void tier0_discard(void* code) {
+	struct tier_site* site = (struct tier_site*) ((int8_t*) code - sizeof(struct tier_site));
+	free(site->run);
+	site->run = NULL;
+}
+
+/*
+* Generates a tier-0 trampoline for the FP instruction at 'instr', which
+* works like the template trampoline but first counts down the site's
+* executions and calls tier_up() when the countdown reaches zero.
+* If a run of FP instructions for a block trampoline starts at 'instr' it is
+* recorded now, while the later instructions of the run haven't been
+* replaced by probes yet. 'end' and 'run_end' are as for
+* generate_block_trampoline().
+* The site is stored before the code, which starts at the returned address.
+* Returns NULL if there is no space for it or its calls can't be reached.
+*/
+void* tier0_generate_trampoline(int8_t* instr, struct emu_desc* desc, void* routine, int8_t* end, int8_t** run_end) {
+	struct tramp_pool* pool;
+	int8_t* mem = tramp_alloc(instr, sizeof(struct tier_site) + TIER0_WORDS * 4, &pool);
+	if (mem == NULL) {
+		printfdbg("ERROR: no space for tier-0 trampoline near instruction %p\n", instr);
+		return NULL;
+	}
+	struct tier_site* site = (struct tier_site*) mem;
+	uint32_t* code = (uint32_t*) (mem + sizeof(struct tier_site));
+	memcpy(&site->desc, desc, sizeof(struct emu_desc));
+	site->countdown = TIER_UP_THRESHOLD;
+	site->instr = instr;
+	site->routine = routine;
+	site->run = NULL;
+	site->next = NULL;
+
+	#ifdef DO_BLOCK_FUSION
+	if (instr >= *run_end) {
+		struct block_instr run[MAX_BLOCK_INSTRS];
+		int num_fp;
+		int len = find_fp_run(instr, end, run, &num_fp);
+		*run_end = (int8_t*) run[len - 1].addr + 4;
+		if (num_fp >= 2) {
+			site->run = malloc(len * sizeof(struct block_instr));
+			memcpy(site->run, run, len * sizeof(struct block_instr));
+			site->run_len = len;
+			site->run_num_fp = num_fp;
+		}
+	}
+	#endif
+
+	struct emitter e = { code, code };
+	emit(&e, arm_push(0x5FFF)); // {r0-r12, r14}
+	emit(&e, arm_mrs_apsr(JIT_REG_APSR));
+	// Other threads may be counting down the same site, so exactly one of them must see zero
+	emit_addr(&e, 3, &site->countdown);
+	uint32_t* retry = e.pos;
+	emit(&e, arm_ldrex(1, 3));
+	emit(&e, arm_sub_imm(1, 1, 1));
+	emit(&e, arm_strex(2, 1, 3));
+	emit(&e, arm_cmp_imm(2, 0));
+	emit(&e, with_cond(encode_branch(e.pos, retry, 0), COND_NE));
+	emit(&e, arm_cmp_imm(1, 0));
+	emit_addr(&e, 0, site);
+	if (jit_emit_call(&e, pool, &tier_up) != 0) {
+		free(site->run);
+		return NULL;
+	}
+	e.pos[-1] = with_cond(e.pos[-1], COND_EQ);
+	emit_addr(&e, 0, site);
+	if (jit_emit_call(&e, pool, routine) != 0) {
+		free(site->run);
+		return NULL;
+	}
+	emit(&e, arm_msr_apsr(JIT_REG_APSR));
+	emit(&e, arm_pop(0x5FFF));
+	emit_branch(&e, instr + 4, 0);
+
+	assert(e.pos - e.start <= TIER0_WORDS);
+	__builtin___clear_cache((char*) mem, (char*) e.pos);
+	printfdbg("Tier-0 trampoline made at %p for instruction at %p\n", code, instr);
+	stat_inc(STAT_TIER0_TRAMPS);
+	return code;
+}
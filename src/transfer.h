@@ -0,0 +1,185 @@
+/*
+* Emulation of the transfers between core and FP registers ('vmov') and of
+* the FPSCR accesses ('vmrs', 'vmsr'). Their routines read and write the
+* guest's core registers and flags in the saved frame, which the trampoline
+* restores afterwards, so the results land in the guest's registers.
+*/
+
+// Kinds of transfer
+#define XFER_TO_FP 0		// vmov sN, rT and the other core to FP forms
+#define XFER_TO_CORE 1		// vmov rT, sN and the other FP to core forms
+#define XFER_MRS 2		// vmrs rT, fpscr
+#define XFER_MRS_FLAGS 3	// vmrs APSR_nzcv, fpscr
+#define XFER_MSR 4		// vmsr fpscr, rT
+
+/*
+* Pre-decoded transfer, stored in its trampoline. Word i moves between the
+* bank entry 'bank[i]' and core register 'core[i]' (a Capstone register
+* name). The FPSCR accesses use 'core[0]' alone.
+*/
+struct xfer_desc {
+	uint8_t kind;
+	uint8_t words;
+	uint8_t bank[2];
+	uint8_t core[2];
+};
+
+// Emulation routine for all the transfers
+void vxfer(const struct xfer_desc* desc, struct tramp_frame* frame) {
+	switch (desc->kind) {
+		case XFER_TO_FP:
+			for (int i = 0; i < desc->words; i++) {
+				fpu_registers[desc->bank[i]] = frame_get_reg(frame, desc->core[i]);
+			}
+			break;
+		case XFER_TO_CORE:
+			for (int i = 0; i < desc->words; i++) {
+				frame_set_reg(frame, desc->core[i], fpu_registers[desc->bank[i]]);
+			}
+			break;
+		case XFER_MRS:
+			// The cumulative exception flags may still be pending
+			fpu_settle();
+			frame_set_reg(frame, desc->core[0], fpscr);
+			break;
+		case XFER_MRS_FLAGS:
+			// The flags are restored into the APSR along with the guest's registers
+			frame->apsr = (frame->apsr & 0x0FFFFFFF) | (fpscr & 0xF0000000);
+			break;
+		case XFER_MSR:
+			// Flags of earlier operations that the program overwrites are dropped with them
+			fpu_set_fpscr(frame_get_reg(frame, desc->core[0]));
+			break;
+	}
+}
+
+// Returns whether 'op' is one of the core registers a transfer can use: r0-r12 or lr
+int is_xfer_core_reg(cs_arm_op* op) {
+	return op->type == ARM_OP_REG && ((ARM_REG_R0 <= op->reg && op->reg <= ARM_REG_R12) || op->reg == ARM_REG_LR);
+}
+
+/*
+* Adds the bank entries of FP register operand 'op' to 'desc': one for an
+* S register or a 32-bit scalar such as 'd0[1]', two for a D register.
+* Returns 0 if 'op' isn't one of those or there are too many.
+*/
+int xfer_add_fp_reg(struct xfer_desc* desc, cs_arm_op* op, int* num_fp) {
+	uint8_t index;
+	int words;
+	if (op->type != ARM_OP_REG) {
+		return 0;
+	}
+	if (is_fp_reg_op(op, 0, &index)) {
+		words = 1;
+	} else if (is_fp_reg_op(op, 1, &index)) {
+		words = op->vector_index >= 0 ? 1 : 2;
+		if (op->vector_index > 0) {
+			index += op->vector_index;
+		}
+	} else {
+		return 0;
+	}
+	if (*num_fp + words > 2) {
+		return 0;
+	}
+	for (int i = 0; i < words; i++) {
+		desc->bank[(*num_fp)++] = index + i;
+	}
+	return 1;
+}
+
+/*
+* Decodes the transfer at 'instr_addr' into 'desc'. Returns 0 if it isn't
+* one that is emulated.
+*/
+int decode_xfer_instr(void* instr_addr, struct xfer_desc* desc) {
+	if (((uintptr_t) instr_addr & 3) != 0) {
+		return 0;
+	}
+	cs_insn* disassembly = disassemble_instr(instr_addr);
+	if (disassembly == NULL) {
+		return 0;
+	}
+	cs_arm* arm = &(disassembly->detail->arm);
+	cs_arm_op* ops = arm->operands;
+	int ok = 0;
+	memset(desc, 0, sizeof(struct xfer_desc));
+	if (arm->op_count < 2) {
+		goto out;
+	}
+
+	switch (disassembly->id) {
+		case ARM_INS_VMOV: {
+			// Only the 32-bit forms move whole FP registers; the NEON lane forms are narrower
+			if (arm->vector_data != ARM_VECTORDATA_INVALID && arm->vector_data != ARM_VECTORDATA_I32
+				&& arm->vector_data != ARM_VECTORDATA_S32 && arm->vector_data != ARM_VECTORDATA_U32) {
+				goto out;
+			}
+			int num_core = 0;
+			int num_fp = 0;
+			for (int i = 0; i < arm->op_count; i++) {
+				if (is_xfer_core_reg(&ops[i])) {
+					if (num_core == 2) {
+						goto out;
+					}
+					desc->core[num_core++] = ops[i].reg;
+				} else if (!xfer_add_fp_reg(desc, &ops[i], &num_fp)) {
+					goto out;
+				}
+			}
+			if (num_core == 0 || num_core != num_fp) {
+				goto out;
+			}
+			desc->kind = is_xfer_core_reg(&ops[0]) ? XFER_TO_CORE : XFER_TO_FP;
+			desc->words = num_core;
+			ok = 1;
+			break;
+		}
+		case ARM_INS_VMRS:
+			if (ops[1].type != ARM_OP_REG || ops[1].reg != ARM_REG_FPSCR) {
+				goto out;
+			}
+			if (ops[0].type == ARM_OP_REG && ops[0].reg == ARM_REG_APSR_NZCV) {
+				desc->kind = XFER_MRS_FLAGS;
+				ok = 1;
+			} else if (is_xfer_core_reg(&ops[0])) {
+				desc->kind = XFER_MRS;
+				desc->core[0] = ops[0].reg;
+				ok = 1;
+			}
+			break;
+		case ARM_INS_VMSR:
+			if (ops[0].type == ARM_OP_REG && ops[0].reg == ARM_REG_FPSCR && is_xfer_core_reg(&ops[1])) {
+				desc->kind = XFER_MSR;
+				desc->core[0] = ops[1].reg;
+				ok = 1;
+			}
+			break;
+	}
+
+out:
+	if (ok) {
+		printfdbg("%s %s: transfer of kind %d\n", disassembly->mnemonic, disassembly->op_str, desc->kind);
+	}
+	free(disassembly);
+	return ok;
+}
+
+/*
+* If the instruction at 'instr_addr' is a transfer or FPSCR access,
+* generates a frame trampoline that emulates it and returns to the next
+* instruction. Returns NULL if it isn't one.
+*/
+void* generate_xfer_trampoline(void* instr_addr) {
+	struct xfer_desc desc;
+	if (!decode_xfer_instr(instr_addr, &desc)) {
+		return NULL;
+	}
+	void* code = generate_frame_trampoline(instr_addr, (int8_t*) instr_addr + 4, &desc, sizeof(desc), &vxfer, 0);
+	if (code == NULL) {
+		return NULL;
+	}
+	printfdbg("Transfer trampoline made at %p for instruction at %p\n", code, instr_addr);
+	stat_inc(STAT_XFER_TRAMPS);
+	return code;
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+/*
+* Measures the soft-float helpers of the ARM run-time ABI that the
+* emulator exports against libgcc's, and counts any results that differ.
+* Built with -mfloat-abi=soft. This program's own references to the
+* helpers are linked statically from libgcc.a, so they are libgcc's, while
+* dlsym() finds the ones the preloaded emulator exports. A NaN result
+* matches any other NaN, as the helpers only differ in NaN payloads.
+* Run under the emulator with the number of calls per measurement and
+* optionally the clock rate in MHz, to report cycles per call rather than
+* ns, e.g. 'aeabi-bench 1000000 1200'.
+*/
+
+extern uint32_t __aeabi_fadd(uint32_t, uint32_t);
+extern uint32_t __aeabi_fsub(uint32_t, uint32_t);
+extern uint32_t __aeabi_fmul(uint32_t, uint32_t);
+extern uint32_t __aeabi_fdiv(uint32_t, uint32_t);
+extern uint32_t __aeabi_fcmplt(uint32_t, uint32_t);
+extern uint32_t __aeabi_fcmpeq(uint32_t, uint32_t);
+extern uint32_t __aeabi_f2iz(uint32_t);
+extern uint32_t __aeabi_i2f(uint32_t);
+extern uint64_t __aeabi_f2d(uint32_t);
+extern uint32_t __aeabi_d2f(uint64_t);
+extern uint64_t __aeabi_dadd(uint64_t, uint64_t);
+extern uint64_t __aeabi_dsub(uint64_t, uint64_t);
+extern uint64_t __aeabi_dmul(uint64_t, uint64_t);
+extern uint64_t __aeabi_ddiv(uint64_t, uint64_t);
+extern uint32_t __aeabi_dcmplt(uint64_t, uint64_t);
+extern uint32_t __aeabi_d2iz(uint64_t);
+extern uint64_t __aeabi_i2d(uint32_t);
+extern uint64_t __aeabi_l2d(uint64_t);
+extern uint64_t __aeabi_d2lz(uint64_t);
+
+// Signatures, by the sizes of the result and the operands
+#define SIG_32_32 0
+#define SIG_32_32_32 1
+#define SIG_64_32 2
+#define SIG_32_64 3
+#define SIG_64_64 4
+#define SIG_64_64_64 5
+#define SIG_32_64_64 6
+
+typedef uint32_t (*sig_32_32_t)(uint32_t);
+typedef uint32_t (*sig_32_32_32_t)(uint32_t, uint32_t);
+typedef uint64_t (*sig_64_32_t)(uint32_t);
+typedef uint32_t (*sig_32_64_t)(uint64_t);
+typedef uint64_t (*sig_64_64_t)(uint64_t);
+typedef uint64_t (*sig_64_64_64_t)(uint64_t, uint64_t);
+typedef uint32_t (*sig_32_64_64_t)(uint64_t, uint64_t);
+
+// What a helper returns, which says how its results are compared
+#define RESULT_INT 0
+#define RESULT_F32 1
+#define RESULT_F64 2
+
+#define NUM_OPERANDS 4096
+uint32_t float_operands[NUM_OPERANDS];
+uint32_t int_operands[NUM_OPERANDS];
+uint64_t double_operands[NUM_OPERANDS];
+uint64_t long_operands[NUM_OPERANDS];
+
+struct helper {
+	const char* name;
+	int sig;
+	int result;
+	const void* operands;
+	void* libgcc;
+	void* exported;	// looked up when the program starts
+};
+
+#define HELPER(name, sig, result, operands) { "__aeabi_" #name, sig, result, operands, &__aeabi_##name, NULL }
+
+struct helper helpers[] = {
+	HELPER(fadd, SIG_32_32_32, RESULT_F32, float_operands),
+	HELPER(fsub, SIG_32_32_32, RESULT_F32, float_operands),
+	HELPER(fmul, SIG_32_32_32, RESULT_F32, float_operands),
+	HELPER(fdiv, SIG_32_32_32, RESULT_F32, float_operands),
+	HELPER(fcmplt, SIG_32_32_32, RESULT_INT, float_operands),
+	HELPER(fcmpeq, SIG_32_32_32, RESULT_INT, float_operands),
+	HELPER(f2iz, SIG_32_32, RESULT_INT, float_operands),
+	HELPER(i2f, SIG_32_32, RESULT_F32, int_operands),
+	HELPER(f2d, SIG_64_32, RESULT_F64, float_operands),
+	HELPER(d2f, SIG_32_64, RESULT_F32, double_operands),
+	HELPER(dadd, SIG_64_64_64, RESULT_F64, double_operands),
+	HELPER(dsub, SIG_64_64_64, RESULT_F64, double_operands),
+	HELPER(dmul, SIG_64_64_64, RESULT_F64, double_operands),
+	HELPER(ddiv, SIG_64_64_64, RESULT_F64, double_operands),
+	HELPER(dcmplt, SIG_32_64_64, RESULT_INT, double_operands),
+	HELPER(d2iz, SIG_32_64, RESULT_INT, double_operands),
+	HELPER(i2d, SIG_64_32, RESULT_F64, int_operands),
+	HELPER(l2d, SIG_64_64, RESULT_F64, long_operands),
+	HELPER(d2lz, SIG_64_64, RESULT_INT, double_operands),
+};
+
+/*
+* Fills the operand tables from a fixed LCG so every run sees the same
+* values: mostly normal floats and doubles with exponents that keep
+* results in range, one in 16 being a zero, subnormal, infinity or NaN,
+* and integers of all sizes.
+*/
+void make_operands() {
+	static const uint32_t special_floats[] = { 0x00000000, 0x80000000, 0x00012345, 0x7F800000, 0xFF800000, 0x7FC00000 };
+	static const uint64_t special_doubles[] = {
+		0x0000000000000000ULL, 0x8000000000000000ULL, 0x0000000123456789ULL,
+		0x7FF0000000000000ULL, 0xFFF0000000000000ULL, 0x7FF8000000000000ULL,
+	};
+	uint32_t x = 12345;
+	for (int i = 0; i < NUM_OPERANDS; i++) {
+		x = x * 1664525 + 1013904223;
+		uint32_t exp = 0x70 + (x >> 27); // 2^-15 to 2^16
+		x = x * 1664525 + 1013904223;
+		float_operands[i] = (x & 0x80000000) | (exp << 23) | (x & 0x007FFFFF);
+		x = x * 1664525 + 1013904223;
+		int_operands[i] = x >> (x & 31);
+		x = x * 1664525 + 1013904223;
+		uint64_t dexp = 0x3F0 + (x >> 27); // 2^-15 to 2^16
+		x = x * 1664525 + 1013904223;
+		uint64_t frac = ((uint64_t) (x & 0x000FFFFF) << 32);
+		x = x * 1664525 + 1013904223;
+		double_operands[i] = ((uint64_t) (x & 0x80000000) << 32) | (dexp << 52) | frac | x;
+		x = x * 1664525 + 1013904223;
+		long_operands[i] = (((uint64_t) x << 32) | int_operands[i]) >> (x & 63);
+		if (i % 16 == 15) {
+			float_operands[i] = special_floats[(i / 16) % 6];
+			double_operands[i] = special_doubles[(i / 16) % 6];
+		}
+	}
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Calls 'func', a helper with signature 'sig', on operands 'i' and 'i + 1' of 'operands'
+static inline uint64_t call_helper(int sig, void* func, const void* operands, int i) {
+	const uint32_t* ops32 = operands;
+	const uint64_t* ops64 = operands;
+	int j = (i + 1) % NUM_OPERANDS;
+	switch (sig) {
+		case SIG_32_32: return ((sig_32_32_t) func)(ops32[i]);
+		case SIG_32_32_32: return ((sig_32_32_32_t) func)(ops32[i], ops32[j]);
+		case SIG_64_32: return ((sig_64_32_t) func)(ops32[i]);
+		case SIG_32_64: return ((sig_32_64_t) func)(ops64[i]);
+		case SIG_64_64: return ((sig_64_64_t) func)(ops64[i]);
+		case SIG_64_64_64: return ((sig_64_64_64_t) func)(ops64[i], ops64[j]);
+		case SIG_32_64_64: return ((sig_32_64_64_t) func)(ops64[i], ops64[j]);
+	}
+	return 0;
+}
+
+/*
+* Calls 'func', one of the versions of 'h', 'iters' times, returning the
+* time taken in ns per call. The signature is a constant in each loop, so
+* the loops only differ in the function called. The results are XOR-ed
+* into 'sink' so the calls can't be optimised away.
+*/
+#define TIME_LOOP(sig) \
+	for (long i = 0; i < iters; i++) { \
+		acc ^= call_helper(sig, func, h->operands, i % NUM_OPERANDS); \
+	}
+
+double time_helper(struct helper* h, void* func, long iters, uint64_t* sink) {
+	uint64_t acc = 0;
+	double start = now();
+	switch (h->sig) {
+		case SIG_32_32: TIME_LOOP(SIG_32_32) break;
+		case SIG_32_32_32: TIME_LOOP(SIG_32_32_32) break;
+		case SIG_64_32: TIME_LOOP(SIG_64_32) break;
+		case SIG_32_64: TIME_LOOP(SIG_32_64) break;
+		case SIG_64_64: TIME_LOOP(SIG_64_64) break;
+		case SIG_64_64_64: TIME_LOOP(SIG_64_64_64) break;
+		case SIG_32_64_64: TIME_LOOP(SIG_32_64_64) break;
+	}
+	double elapsed = now() - start;
+	*sink ^= acc;
+	return elapsed * 1e9 / iters;
+}
+
+static inline int is_nan(int result, uint64_t r) {
+	if (result == RESULT_F32) return (r & 0x7FFFFFFF) > 0x7F800000;
+	if (result == RESULT_F64) return (r & 0x7FFFFFFFFFFFFFFFULL) > 0x7FF0000000000000ULL;
+	return 0;
+}
+
+// Counts the operands for which the two versions of 'h' disagree
+int count_mismatches(struct helper* h) {
+	int mismatches = 0;
+	for (int i = 0; i < NUM_OPERANDS; i++) {
+		uint64_t expected = call_helper(h->sig, h->libgcc, h->operands, i);
+		uint64_t actual = call_helper(h->sig, h->exported, h->operands, i);
+		mismatches += expected != actual && !(is_nan(h->result, expected) && is_nan(h->result, actual));
+	}
+	return mismatches;
+}
+
+int main(int argc, char** argv) {
+	long iters = atol(argv[1]);
+	double mhz = argc > 2 ? atof(argv[2]) : 0;
+	uint64_t sink = 0;
+	make_operands();
+
+	for (int i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++) {
+		helpers[i].exported = dlsym(RTLD_NEXT, helpers[i].name);
+		if (helpers[i].exported == NULL || helpers[i].exported == helpers[i].libgcc) {
+			printf("%s isn't exported by a preloaded library: run this under the emulator\n", helpers[i].name);
+			return 1;
+		}
+	}
+	Dl_info info;
+	if (dladdr(helpers[0].exported, &info) && info.dli_fname != NULL) {
+		printf("Exported helpers from %s\n\n", info.dli_fname);
+	}
+
+	const char* unit = mhz > 0 ? "cycles" : "ns";
+	printf("%-16s %10s %-6s %10s %-6s %8s %12s\n", "helper", "libgcc", unit, "exported", unit, "speedup", "mismatches");
+	for (int i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++) {
+		struct helper* h = &helpers[i];
+		double libgcc_ns = time_helper(h, h->libgcc, iters, &sink);
+		double exported_ns = time_helper(h, h->exported, iters, &sink);
+		double scale = mhz > 0 ? mhz / 1000 : 1;
+		printf("%-16s %17.1f %17.1f %8.2f %12d\n", h->name, libgcc_ns * scale, exported_ns * scale,
+			libgcc_ns / exported_ns, count_mismatches(h));
+	}
+	return sink == 0x12345678;
+}
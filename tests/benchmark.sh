@@ -1,6 +1,7 @@
 #!/bin/bash
 ROOT="$(pwd)/.."
-PRELOAD="$ROOT/build/arm-fp-emu.so"
+# Set PRELOAD to another build of the emulator, e.g. one without DO_JIT, to compare them
+PRELOAD="${PRELOAD:-$ROOT/build/arm-fp-emu.so}"
 LIB_PATH="$ROOT/contrib/keystone/build/llvm/lib"
 EXEC_BIN="./build/vadd"
 CMP_BIN="./build/getpid"
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+* Measures the throughput of emulated NEON instructions in lanes per
+* second. Each measurement runs a loop of one q register instruction that
+* accumulates into q0, with q1 holding 1 (or 1.0) in every lane, and checks
+* that every lane of q0 ends up with the value the iterations should give.
+* The multiplication instead starts with 1 in q0 and multiplies it by 3, so
+* each lane holds 3^iters modulo 2^16.
+* Run under the emulator with the number of iterations (at most 2^24, which
+* a float counts exactly), e.g. 'neon-bench 1000000'.
+*/
+
+#define REPEAT10(instr) \
+	asm volatile (instr); asm volatile (instr); asm volatile (instr); asm volatile (instr); asm volatile (instr); \
+	asm volatile (instr); asm volatile (instr); asm volatile (instr); asm volatile (instr); asm volatile (instr);
+
+/*
+* Defines a loop of 'iters' (rounded up to a multiple of 10) 'instr' that
+* starts with 'init' in q0 and 'operand' in q1 and leaves q0 in 'result'
+*/
+#define NEON_LOOP(name, instr) \
+	void name(long iters, const uint32_t* init, const uint32_t* operand, uint32_t* result) { \
+		asm volatile ("vld1.32 {d0-d1}, [%0]" : : "r" (init) : "memory"); \
+		asm volatile ("vld1.32 {d2-d3}, [%0]" : : "r" (operand) : "memory"); \
+		for (long i = 0; i < iters; i += 10) { \
+			REPEAT10(instr) \
+		} \
+		asm volatile ("vst1.32 {d0-d1}, [%0]" : : "r" (result) : "memory"); \
+	}
+
+NEON_LOOP(loop_vadd_i8, "vadd.i8 q0, q0, q1")
+NEON_LOOP(loop_vadd_i16, "vadd.i16 q0, q0, q1")
+NEON_LOOP(loop_vadd_i32, "vadd.i32 q0, q0, q1")
+NEON_LOOP(loop_vmul_i16, "vmul.i16 q0, q0, q1")
+NEON_LOOP(loop_vadd_f32, "vadd.f32 q0, q0, q1")
+NEON_LOOP(loop_vmla_f32, "vmla.f32 q0, q1, q1")
+
+struct bench_op {
+	const char* name;
+	void (*loop)(long, const uint32_t*, const uint32_t*, uint32_t*);
+	int lanes;
+	uint32_t init;		// q0's lanes at the start
+	uint32_t operand;	// q1's lanes
+	int is_float;
+	int is_mul;
+};
+
+struct bench_op ops[] = {
+	{ "vadd.i8", &loop_vadd_i8, 16, 0, 0x01010101, 0, 0 },
+	{ "vadd.i16", &loop_vadd_i16, 8, 0, 0x00010001, 0, 0 },
+	{ "vadd.i32", &loop_vadd_i32, 4, 0, 0x00000001, 0, 0 },
+	{ "vmul.i16", &loop_vmul_i16, 8, 0x00010001, 0x00030003, 0, 1 },
+	{ "vadd.f32", &loop_vadd_f32, 4, 0, 0x3F800000, 1, 0 },
+	{ "vmla.f32", &loop_vmla_f32, 4, 0, 0x3F800000, 1, 0 },
+};
+
+// Returns the value every 32-bit word of q0 should hold after 'iters' iterations of 'op'
+uint32_t expected_word(const struct bench_op* op, long iters) {
+	if (op->is_float) {
+		float f = (float) iters;
+		uint32_t word;
+		memcpy(&word, &f, sizeof(word));
+		return word;
+	}
+	int size = 128 / op->lanes;
+	uint32_t mask = size == 32 ? 0xFFFFFFFF : (1u << size) - 1;
+	uint32_t lane = (uint32_t) iters & mask;
+	if (op->is_mul) {
+		lane = op->init & mask;
+		for (long i = 0; i < iters; i++) {
+			lane = (lane * (op->operand & mask)) & mask;
+		}
+	}
+	uint32_t word = 0;
+	for (int i = 0; i < 32; i += size) {
+		word |= lane << i;
+	}
+	return word;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+	long iters = (atol(argv[1]) + 9) / 10 * 10;
+
+	printf("%-10s %14s %14s %8s\n", "op", "Mops/s", "Mlanes/s", "errors");
+	for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		uint32_t init[4] = { ops[i].init, ops[i].init, ops[i].init, ops[i].init };
+		uint32_t operand[4] = { ops[i].operand, ops[i].operand, ops[i].operand, ops[i].operand };
+		uint32_t result[4];
+		double start = now();
+		ops[i].loop(iters, init, operand, result);
+		double mops = iters / (now() - start) / 1e6;
+		int errors = 0;
+		for (int j = 0; j < 4; j++) {
+			errors += result[j] != expected_word(&ops[i], iters);
+		}
+		printf("%-10s %14.2f %14.2f %8d\n", ops[i].name, mops, mops * ops[i].lanes, errors);
+	}
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include "../src/softfloat.h"
+#include "../src/fpexc.h"
+
+/*
+* Measures the throughput of the emulator's integer soft-float kernels
+* against the libgcc and libm routines a soft-float build uses for the
+* same operations, and counts any results that differ.
+* Built with -mfloat-abi=soft, so floats are passed in core registers and
+* the libgcc helpers can be called through the same pointer types as the
+* kernels.
+* It then measures what keeping the FPSCR's cumulative exception flags
+* costs, worked out after every operation (eager) or only when they could
+* change (lazy), and checks that both give the same flags.
+* Given the clock rate in MHz as well, it also reports division and square
+* root in cycles per operation; build it with and without DO_FAST_DIV_SQRT
+* to compare the Newton-Raphson kernels with the bit-serial ones.
+* Run with the number of operations per measurement and optionally the
+* clock rate, e.g. 'softfloat-bench 1000000 1200'.
+*/
+
+extern uint32_t __aeabi_fadd(uint32_t, uint32_t);
+extern uint32_t __aeabi_fsub(uint32_t, uint32_t);
+extern uint32_t __aeabi_fmul(uint32_t, uint32_t);
+extern uint32_t __aeabi_fdiv(uint32_t, uint32_t);
+extern uint32_t __aeabi_fcmplt(uint32_t, uint32_t);
+extern uint32_t __aeabi_f2iz(uint32_t);
+extern uint32_t __aeabi_f2uiz(uint32_t);
+extern uint32_t __aeabi_i2f(uint32_t);
+extern uint32_t __aeabi_ui2f(uint32_t);
+extern uint64_t __aeabi_dadd(uint64_t, uint64_t);
+extern uint64_t __aeabi_dsub(uint64_t, uint64_t);
+extern uint64_t __aeabi_dmul(uint64_t, uint64_t);
+extern uint64_t __aeabi_ddiv(uint64_t, uint64_t);
+extern uint32_t __aeabi_dcmplt(uint64_t, uint64_t);
+
+typedef uint32_t (*op1_t)(uint32_t);
+typedef uint32_t (*op2_t)(uint32_t, uint32_t);
+typedef uint32_t (*op3_t)(uint32_t, uint32_t, uint32_t);
+typedef uint64_t (*op1d_t)(uint64_t);
+typedef uint64_t (*op2d_t)(uint64_t, uint64_t);
+
+// Kernels whose signatures differ from the libgcc helpers they are compared with
+uint32_t kernel_cmplt(uint32_t a, uint32_t b) { return f32_compare(a, b) == FLAGS_LESS; }
+uint32_t kernel_f2iz(uint32_t a) { return f32_to_i32(a, ROUND_ZERO); }
+uint32_t kernel_f2uiz(uint32_t a) { return f32_to_u32(a, ROUND_ZERO); }
+uint32_t kernel_i2f(uint32_t a) { return i32_to_f32(a); }
+uint32_t kernel_fma(uint32_t a, uint32_t b, uint32_t c) { return f32_mul_add(c, a, b); }
+uint64_t kernel_dcmplt(uint64_t a, uint64_t b) { return f64_compare(a, b) == FLAGS_LESS; }
+uint64_t libgcc_dcmplt(uint64_t a, uint64_t b) { return __aeabi_dcmplt(a, b); }
+
+struct bench_op {
+	const char* name;
+	int arity;
+	int int_operands;	// whether the operands are integers rather than floats
+	void* kernel;
+	void* libgcc;
+};
+
+struct bench_op bench_ops[] = {
+	{ "add", 2, 0, &f32_add, &__aeabi_fadd },
+	{ "sub", 2, 0, &f32_sub, &__aeabi_fsub },
+	{ "mul", 2, 0, &f32_mul, &__aeabi_fmul },
+	{ "div", 2, 0, &f32_div, &__aeabi_fdiv },
+	{ "sqrt", 1, 0, &f32_sqrt, &sqrtf },
+	{ "fma", 3, 0, &kernel_fma, &fmaf },
+	{ "cmplt", 2, 0, &kernel_cmplt, &__aeabi_fcmplt },
+	{ "f2iz", 1, 0, &kernel_f2iz, &__aeabi_f2iz },
+	{ "f2uiz", 1, 0, &kernel_f2uiz, &__aeabi_f2uiz },
+	{ "i2f", 1, 1, &kernel_i2f, &__aeabi_i2f },
+	{ "ui2f", 1, 1, &u32_to_f32, &__aeabi_ui2f },
+};
+
+// Double precision operations, timed separately as their operands are 64-bit
+struct bench_op bench_ops64[] = {
+	{ "dadd", 2, 0, &f64_add, &__aeabi_dadd },
+	{ "dsub", 2, 0, &f64_sub, &__aeabi_dsub },
+	{ "dmul", 2, 0, &f64_mul, &__aeabi_dmul },
+	{ "ddiv", 2, 0, &f64_div, &__aeabi_ddiv },
+	{ "dsqrt", 1, 0, &f64_sqrt, &sqrt },
+	{ "dcmplt", 2, 0, &kernel_dcmplt, &libgcc_dcmplt },
+};
+
+// The division and square root operations, timed in cycles
+struct cycles_op {
+	struct bench_op* op;
+	int is_f64;
+};
+
+struct cycles_op cycles_ops[] = {
+	{ &bench_ops[3], 0 },
+	{ &bench_ops[4], 0 },
+	{ &bench_ops64[3], 1 },
+	{ &bench_ops64[4], 1 },
+};
+
+/*
+* Each kernel followed by the eager and the lazy recording of its
+* exceptions, into a stand-in for the emulated FPSCR.
+*/
+uint32_t bench_fpscr;
+struct fp_record bench_pending;
+
+#define EXC_KERNELS(name, type, kernel, op) \
+	type eager_##name(type a, type b) { \
+		type r = kernel(a, b); \
+		fp_note_eager(&bench_fpscr, &bench_pending, op, a, b, 0, r); \
+		return r; \
+	} \
+	type lazy_##name(type a, type b) { \
+		type r = kernel(a, b); \
+		fp_note_lazy(&bench_fpscr, &bench_pending, op, a, b, 0, r); \
+		return r; \
+	}
+
+EXC_KERNELS(add, uint32_t, f32_add, FP_OP_ADD)
+EXC_KERNELS(mul, uint32_t, f32_mul, FP_OP_MUL)
+EXC_KERNELS(div, uint32_t, f32_div, FP_OP_DIV)
+EXC_KERNELS(dadd, uint64_t, f64_add, FP_OP_ADD | FP_OP_F64)
+EXC_KERNELS(dmul, uint64_t, f64_mul, FP_OP_MUL | FP_OP_F64)
+EXC_KERNELS(ddiv, uint64_t, f64_div, FP_OP_DIV | FP_OP_F64)
+
+struct exc_op {
+	const char* name;
+	int is_f64;
+	void* kernel;
+	void* eager;
+	void* lazy;
+};
+
+struct exc_op exc_ops[] = {
+	{ "add", 0, &f32_add, &eager_add, &lazy_add },
+	{ "mul", 0, &f32_mul, &eager_mul, &lazy_mul },
+	{ "div", 0, &f32_div, &eager_div, &lazy_div },
+	{ "dadd", 1, &f64_add, &eager_dadd, &lazy_dadd },
+	{ "dmul", 1, &f64_mul, &eager_dmul, &lazy_dmul },
+	{ "ddiv", 1, &f64_div, &eager_ddiv, &lazy_ddiv },
+};
+
+#define NUM_OPERANDS 4096
+uint32_t float_operands[NUM_OPERANDS];
+uint32_t int_operands[NUM_OPERANDS];
+uint64_t double_operands[NUM_OPERANDS];
+
+/*
+* Fills the operand tables from a fixed LCG so every run sees the same
+* values: mostly normal floats with exponents that keep results in range,
+* and integers of all sizes.
+*/
+void make_operands() {
+	uint32_t x = 12345;
+	for (int i = 0; i < NUM_OPERANDS; i++) {
+		x = x * 1664525 + 1013904223;
+		uint32_t exp = 0x70 + (x >> 27); // 2^-15 to 2^16
+		x = x * 1664525 + 1013904223;
+		float_operands[i] = (x & F32_SIGN) | (exp << 23) | (x & 0x007FFFFF);
+		x = x * 1664525 + 1013904223;
+		int_operands[i] = x >> (x & 31);
+		x = x * 1664525 + 1013904223;
+		uint64_t dexp = 0x3F0 + (x >> 27); // 2^-15 to 2^16
+		x = x * 1664525 + 1013904223;
+		uint64_t frac = ((uint64_t) (x & 0x000FFFFF) << 32);
+		x = x * 1664525 + 1013904223;
+		double_operands[i] = ((uint64_t) (x & F32_SIGN) << 32) | (dexp << 52) | frac | x;
+	}
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+* Calls 'func' 'iters' times on operands from 'operands', returning the
+* time taken in ns per call. The results are XOR-ed into 'sink' so the
+* calls can't be optimised away.
+*/
+double time_op(struct bench_op* op, void* func, uint32_t* operands, long iters, uint32_t* sink) {
+	uint32_t acc = 0;
+	double start = now();
+	for (long i = 0; i < iters; i++) {
+		uint32_t a = operands[i % NUM_OPERANDS];
+		uint32_t b = operands[(i + 1) % NUM_OPERANDS];
+		uint32_t c = operands[(i + 2) % NUM_OPERANDS];
+		if (op->arity == 1) {
+			acc ^= ((op1_t) func)(a);
+		} else if (op->arity == 2) {
+			acc ^= ((op2_t) func)(a, b);
+		} else {
+			acc ^= ((op3_t) func)(a, b, c);
+		}
+	}
+	double elapsed = now() - start;
+	*sink ^= acc;
+	return elapsed * 1e9 / iters;
+}
+
+// Counts the operands for which the kernel and the library disagree
+int count_mismatches(struct bench_op* op, uint32_t* operands) {
+	int mismatches = 0;
+	for (int i = 0; i < NUM_OPERANDS; i++) {
+		uint32_t a = operands[i];
+		uint32_t b = operands[(i + 1) % NUM_OPERANDS];
+		uint32_t c = operands[(i + 2) % NUM_OPERANDS];
+		uint32_t expected, actual;
+		if (op->arity == 1) {
+			expected = ((op1_t) op->libgcc)(a);
+			actual = ((op1_t) op->kernel)(a);
+		} else if (op->arity == 2) {
+			expected = ((op2_t) op->libgcc)(a, b);
+			actual = ((op2_t) op->kernel)(a, b);
+		} else {
+			expected = ((op3_t) op->libgcc)(a, b, c);
+			actual = ((op3_t) op->kernel)(a, b, c);
+		}
+		mismatches += expected != actual;
+	}
+	return mismatches;
+}
+
+// As time_op() and count_mismatches(), for the double precision operations
+double time_op64(struct bench_op* op, void* func, long iters, uint64_t* sink) {
+	uint64_t acc = 0;
+	double start = now();
+	for (long i = 0; i < iters; i++) {
+		uint64_t a = double_operands[i % NUM_OPERANDS];
+		uint64_t b = double_operands[(i + 1) % NUM_OPERANDS];
+		if (op->arity == 1) {
+			acc ^= ((op1d_t) func)(a);
+		} else {
+			acc ^= ((op2d_t) func)(a, b);
+		}
+	}
+	double elapsed = now() - start;
+	*sink ^= acc;
+	return elapsed * 1e9 / iters;
+}
+
+int count_mismatches64(struct bench_op* op) {
+	int mismatches = 0;
+	for (int i = 0; i < NUM_OPERANDS; i++) {
+		uint64_t a = double_operands[i];
+		uint64_t b = double_operands[(i + 1) % NUM_OPERANDS];
+		uint64_t expected, actual;
+		if (op->arity == 1) {
+			expected = ((op1d_t) op->libgcc)(a);
+			actual = ((op1d_t) op->kernel)(a);
+		} else {
+			expected = ((op2d_t) op->libgcc)(a, b);
+			actual = ((op2d_t) op->kernel)(a, b);
+		}
+		mismatches += expected != actual;
+	}
+	return mismatches;
+}
+
+/*
+* Times 'func', one of the variants of 'op', from a clear FPSCR, leaving
+* the flags it recorded in 'bench_fpscr'.
+*/
+double time_exc_op(struct exc_op* op, void* func, long iters, uint64_t* sink) {
+	struct bench_op bench = { op->name, 2, 0, func, NULL };
+	bench_fpscr = 0;
+	bench_pending.op = FP_OP_NONE;
+	if (op->is_f64) {
+		return time_op64(&bench, func, iters, sink);
+	}
+	uint32_t sink32 = 0;
+	double ns = time_op(&bench, func, float_operands, iters, &sink32);
+	*sink ^= sink32;
+	return ns;
+}
+
+int main(int argc, char** argv) {
+	long iters = atol(argv[1]);
+	uint32_t sink = 0;
+	make_operands();
+
+	printf("%-8s %12s %12s %8s %12s\n", "op", "kernel ns", "libgcc ns", "speedup", "mismatches");
+	for (int i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++) {
+		struct bench_op* op = &bench_ops[i];
+		uint32_t* operands = op->int_operands ? int_operands : float_operands;
+		double kernel_ns = time_op(op, op->kernel, operands, iters, &sink);
+		double libgcc_ns = time_op(op, op->libgcc, operands, iters, &sink);
+		printf("%-8s %12.2f %12.2f %8.2f %12d\n", op->name, kernel_ns, libgcc_ns,
+			libgcc_ns / kernel_ns, count_mismatches(op, operands));
+	}
+	uint64_t sink64 = 0;
+	for (int i = 0; i < sizeof(bench_ops64) / sizeof(bench_ops64[0]); i++) {
+		struct bench_op* op = &bench_ops64[i];
+		double kernel_ns = time_op64(op, op->kernel, iters, &sink64);
+		double libgcc_ns = time_op64(op, op->libgcc, iters, &sink64);
+		printf("%-8s %12.2f %12.2f %8.2f %12d\n", op->name, kernel_ns, libgcc_ns,
+			libgcc_ns / kernel_ns, count_mismatches64(op));
+	}
+
+	if (argc > 2) {
+		double mhz = atof(argv[2]);
+		printf("\n%-8s %14s %14s %8s\n", "op", "kernel cycles", "libgcc cycles", "speedup");
+		for (int i = 0; i < sizeof(cycles_ops) / sizeof(cycles_ops[0]); i++) {
+			struct bench_op* op = cycles_ops[i].op;
+			double kernel_ns, libgcc_ns;
+			if (cycles_ops[i].is_f64) {
+				kernel_ns = time_op64(op, op->kernel, iters, &sink64);
+				libgcc_ns = time_op64(op, op->libgcc, iters, &sink64);
+			} else {
+				kernel_ns = time_op(op, op->kernel, float_operands, iters, &sink);
+				libgcc_ns = time_op(op, op->libgcc, float_operands, iters, &sink);
+			}
+			printf("%-8s %14.1f %14.1f %8.2f\n", op->name, kernel_ns * mhz / 1000,
+				libgcc_ns * mhz / 1000, libgcc_ns / kernel_ns);
+		}
+	}
+
+	printf("\n%-8s %12s %12s %12s %8s %8s\n", "op", "kernel ns", "eager ns", "lazy ns", "speedup", "flags");
+	for (int i = 0; i < sizeof(exc_ops) / sizeof(exc_ops[0]); i++) {
+		struct exc_op* op = &exc_ops[i];
+		double kernel_ns = time_exc_op(op, op->kernel, iters, &sink64);
+		double eager_ns = time_exc_op(op, op->eager, iters, &sink64);
+		uint32_t eager_flags = bench_fpscr;
+		double lazy_ns = time_exc_op(op, op->lazy, iters, &sink64);
+		fp_settle(&bench_fpscr, &bench_pending);
+		printf("%-8s %12.2f %12.2f %12.2f %8.2f %8s\n", op->name, kernel_ns, eager_ns, lazy_ns,
+			eager_ns / lazy_ns, bench_fpscr == eager_flags ? "same" : "DIFFER");
+	}
+	return sink == 0x12345678 && sink64 == 0x12345678;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+* Measures how the throughput of emulated FP instructions scales with the
+* number of threads. Each thread adds 1.0 to s0 in a loop of 'vadd.f32'
+* and checks that s0 ends up equal to its number of iterations, so a thread
+* whose registers were changed by another counts as an error.
+* Run under the emulator with the number of iterations per thread (at most
+* 2^24, which a float counts exactly) and the largest number of threads,
+* e.g. 'threads-bench 1000000 4'.
+*/
+
+long iters;
+
+void* worker(void* arg) {
+	int* errors = arg;
+	uint32_t one = 0x3F800000;
+	uint32_t result;
+	asm volatile ("vmov s0, %0" : : "r" (0) : "s0");
+	asm volatile ("vmov s1, %0" : : "r" (one) : "s1");
+	for (long i = 0; i < iters; i += 10) {
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+		asm volatile ("vadd.f32 s0, s0, s1" : : : "s0");
+	}
+	asm volatile ("vmov %0, s0" : "=r" (result));
+	float expected = (float) ((iters + 9) / 10 * 10);
+	*errors = memcmp(&result, &expected, sizeof(result)) != 0;
+	return NULL;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+	iters = atol(argv[1]);
+	int max_threads = atoi(argv[2]);
+	pthread_t* threads = malloc(max_threads * sizeof(pthread_t));
+	int* errors = malloc(max_threads * sizeof(int));
+	double base = 0;
+
+	printf("%-8s %14s %8s %8s\n", "threads", "Mops/s", "scaling", "errors");
+	for (int n = 1; n <= max_threads; n++) {
+		double start = now();
+		for (int i = 0; i < n; i++) {
+			pthread_create(&threads[i], NULL, &worker, &errors[i]);
+		}
+		int total_errors = 0;
+		for (int i = 0; i < n; i++) {
+			pthread_join(threads[i], NULL);
+			total_errors += errors[i];
+		}
+		double mops = n * (double) iters / (now() - start) / 1e6;
+		if (n == 1) {
+			base = mops;
+		}
+		printf("%-8d %14.2f %8.2f %8d\n", n, mops, mops / base, total_errors);
+	}
+	return 0;
+}